@@ -40,6 +40,8 @@ typedef struct redisAeEvents {
     aeEventLoop *loop;
     int fd;
     int reading, writing;
+    int doorbell_fd; /* shared memory doorbell, once watched */
+    long long poll_id; /* time event polling the shared memory, or -1 */
 } redisAeEvents;
 
 static void redisAeReadEvent(aeEventLoop *el, int fd, void *privdata, int mask) {
@@ -56,6 +58,15 @@ static void redisAeWriteEvent(aeEventLoop *el, int fd, void *privdata, int mask)
     redisAsyncHandleWrite(e->context);
 }
 
+/* Fires on every iteration, see SHARED_MEMORY_OPT_LOOP_POLL. */
+static int redisAePollEvent(aeEventLoop *el, long long id, void *privdata) {
+    ((void)el); ((void)id);
+
+    redisAeEvents *e = (redisAeEvents*)privdata;
+    redisAsyncPollSharedMemory(e->context);
+    return 0;
+}
+
 static void redisAeAddRead(void *privdata) {
     redisAeEvents *e = (redisAeEvents*)privdata;
     aeEventLoop *loop = e->loop;
@@ -63,6 +74,13 @@ static void redisAeAddRead(void *privdata) {
         e->reading = 1;
         aeCreateFileEvent(loop,e->fd,AE_READABLE,redisAeReadEvent,e);
     }
+    if (e->doorbell_fd == -1) {
+        e->doorbell_fd = redisGetSharedMemoryDoorbellFd(&e->context->c);
+        if (e->doorbell_fd != -1)
+            aeCreateFileEvent(loop,e->doorbell_fd,AE_READABLE,redisAeReadEvent,e);
+    }
+    if (e->poll_id == -1 && redisIsSharedMemoryLoopPolled(&e->context->c))
+        e->poll_id = aeCreateTimeEvent(loop,0,redisAePollEvent,e,NULL);
 }
 
 static void redisAeDelRead(void *privdata) {
@@ -72,6 +90,14 @@ static void redisAeDelRead(void *privdata) {
         e->reading = 0;
         aeDeleteFileEvent(loop,e->fd,AE_READABLE);
     }
+    if (e->doorbell_fd != -1) {
+        aeDeleteFileEvent(loop,e->doorbell_fd,AE_READABLE);
+        e->doorbell_fd = -1;
+    }
+    if (e->poll_id != -1) {
+        aeDeleteTimeEvent(loop,e->poll_id);
+        e->poll_id = -1;
+    }
 }
 
 static void redisAeAddWrite(void *privdata) {
@@ -116,6 +142,8 @@ static int redisAeAttach(aeEventLoop *loop, redisAsyncContext *ac) {
     e->loop = loop;
     e->fd = c->fd;
     e->reading = e->writing = 0;
+    e->doorbell_fd = -1;
+    e->poll_id = -1;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = redisAeAddRead;
@@ -11,6 +11,8 @@ typedef struct
     GSource source;
     redisAsyncContext *ac;
     GPollFD poll_fd;
+    GPollFD doorbell_fd; /* shared memory doorbell, added once fd >= 0 */
+    gboolean polling; /* dispatched on every iteration, see SHARED_MEMORY_OPT_LOOP_POLL */
 } RedisSource;
 
 static void
@@ -19,6 +21,15 @@ redis_source_add_read (gpointer data)
     RedisSource *source = (RedisSource *)data;
     g_return_if_fail(source);
     source->poll_fd.events |= G_IO_IN;
+    if (source->doorbell_fd.fd < 0) {
+        int fd = redisGetSharedMemoryDoorbellFd(&source->ac->c);
+        if (fd >= 0) {
+            source->doorbell_fd.fd = fd;
+            g_source_add_poll((GSource *)data, &source->doorbell_fd);
+        }
+    }
+    source->doorbell_fd.events |= G_IO_IN;
+    source->polling = redisIsSharedMemoryLoopPolled(&source->ac->c);
     g_main_context_wakeup(g_source_get_context((GSource *)data));
 }
 
@@ -28,6 +39,8 @@ redis_source_del_read (gpointer data)
     RedisSource *source = (RedisSource *)data;
     g_return_if_fail(source);
     source->poll_fd.events &= ~G_IO_IN;
+    source->doorbell_fd.events &= ~G_IO_IN;
+    source->polling = FALSE;
     g_main_context_wakeup(g_source_get_context((GSource *)data));
 }
 
@@ -66,6 +79,10 @@ redis_source_cleanup (gpointer data)
         g_source_remove_poll((GSource *)data, &source->poll_fd);
         source->poll_fd.fd = -1;
     }
+    if (source->doorbell_fd.fd >= 0) {
+        g_source_remove_poll((GSource *)data, &source->doorbell_fd);
+        source->doorbell_fd.fd = -1;
+    }
 }
 
 static gboolean
@@ -73,15 +90,19 @@ redis_source_prepare (GSource *source,
                       gint    *timeout_)
 {
     RedisSource *redis = (RedisSource *)source;
-    *timeout_ = -1;
-    return !!(redis->poll_fd.events & redis->poll_fd.revents);
+    *timeout_ = redis->polling ? 0 : -1;
+    return redis->polling ||
+           !!(redis->poll_fd.events & redis->poll_fd.revents) ||
+           !!(redis->doorbell_fd.events & redis->doorbell_fd.revents);
 }
 
 static gboolean
 redis_source_check (GSource *source)
 {
     RedisSource *redis = (RedisSource *)source;
-    return !!(redis->poll_fd.events & redis->poll_fd.revents);
+    return redis->polling ||
+           !!(redis->poll_fd.events & redis->poll_fd.revents) ||
+           !!(redis->doorbell_fd.events & redis->doorbell_fd.revents);
 }
 
 static gboolean
@@ -96,9 +117,14 @@ redis_source_dispatch (GSource      *source,
         redis->poll_fd.revents &= ~G_IO_OUT;
     }
 
-    if ((redis->poll_fd.revents & G_IO_IN)) {
+    if ((redis->poll_fd.revents & G_IO_IN) || (redis->doorbell_fd.revents & G_IO_IN)) {
         redisAsyncHandleRead(redis->ac);
         redis->poll_fd.revents &= ~G_IO_IN;
+        redis->doorbell_fd.revents &= ~G_IO_IN;
+    }
+
+    if (redis->polling) {
+        redisAsyncPollSharedMemory(redis->ac);
     }
 
     if (callback) {
@@ -117,6 +143,10 @@ redis_source_finalize (GSource *source)
         g_source_remove_poll(source, &redis->poll_fd);
         redis->poll_fd.fd = -1;
     }
+    if (redis->doorbell_fd.fd >= 0) {
+        g_source_remove_poll(source, &redis->doorbell_fd);
+        redis->doorbell_fd.fd = -1;
+    }
 }
 
 static GSource *
@@ -142,6 +172,10 @@ redis_source_new (redisAsyncContext *ac)
     source->poll_fd.events = 0;
     source->poll_fd.revents = 0;
     g_source_add_poll((GSource *)source, &source->poll_fd);
+    source->doorbell_fd.fd = -1;
+    source->doorbell_fd.events = 0;
+    source->doorbell_fd.revents = 0;
+    source->polling = FALSE;
 
     ac->ev.addRead = redis_source_add_read;
     ac->ev.delRead = redis_source_del_read;
@@ -7,6 +7,7 @@
 typedef struct redisIvykisEvents {
     redisAsyncContext *context;
     struct iv_fd fd;
+    struct iv_fd doorbell; /* shared memory doorbell, registered when fd != -1 */
 } redisIvykisEvents;
 
 static void redisIvykisReadEvent(void *arg) {
@@ -22,11 +23,22 @@ static void redisIvykisWriteEvent(void *arg) {
 static void redisIvykisAddRead(void *privdata) {
     redisIvykisEvents *e = (redisIvykisEvents*)privdata;
     iv_fd_set_handler_in(&e->fd, redisIvykisReadEvent);
+    if (e->doorbell.fd == -1) {
+        int fd = redisGetSharedMemoryDoorbellFd(&e->context->c);
+        if (fd != -1) {
+            e->doorbell.fd = fd;
+            iv_fd_register(&e->doorbell);
+        }
+    }
+    if (e->doorbell.fd != -1)
+        iv_fd_set_handler_in(&e->doorbell, redisIvykisReadEvent);
 }
 
 static void redisIvykisDelRead(void *privdata) {
     redisIvykisEvents *e = (redisIvykisEvents*)privdata;
     iv_fd_set_handler_in(&e->fd, NULL);
+    if (e->doorbell.fd != -1)
+        iv_fd_set_handler_in(&e->doorbell, NULL);
 }
 
 static void redisIvykisAddWrite(void *privdata) {
@@ -43,6 +55,8 @@ static void redisIvykisCleanup(void *privdata) {
     redisIvykisEvents *e = (redisIvykisEvents*)privdata;
 
     iv_fd_unregister(&e->fd);
+    if (e->doorbell.fd != -1)
+        iv_fd_unregister(&e->doorbell);
     hi_free(e);
 }
 
@@ -77,6 +91,11 @@ static int redisIvykisAttach(redisAsyncContext *ac) {
     e->fd.handler_err = NULL;
     e->fd.cookie = e->context;
 
+    IV_FD_INIT(&e->doorbell);
+    e->doorbell.fd = -1;
+    e->doorbell.handler_in = redisIvykisReadEvent;
+    e->doorbell.cookie = e->context;
+
     iv_fd_register(&e->fd);
 
     return REDIS_OK;
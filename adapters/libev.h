@@ -40,7 +40,10 @@ typedef struct redisLibevEvents {
     redisAsyncContext *context;
     struct ev_loop *loop;
     int reading, writing;
-    ev_io rev, wev;
+    int doorbell; /* dev watches the shared memory doorbell */
+    int polling; /* idle polls the shared memory, see SHARED_MEMORY_OPT_LOOP_POLL */
+    ev_io rev, wev, dev;
+    ev_idle idle;
     ev_timer timer;
 } redisLibevEvents;
 
@@ -64,6 +67,16 @@ static void redisLibevWriteEvent(EV_P_ ev_io *watcher, int revents) {
     redisAsyncHandleWrite(e->context);
 }
 
+static void redisLibevPollEvent(EV_P_ ev_idle *watcher, int revents) {
+#if EV_MULTIPLICITY
+    ((void)EV_A);
+#endif
+    ((void)revents);
+
+    redisLibevEvents *e = (redisLibevEvents*)watcher->data;
+    redisAsyncPollSharedMemory(e->context);
+}
+
 static void redisLibevAddRead(void *privdata) {
     redisLibevEvents *e = (redisLibevEvents*)privdata;
 #if EV_MULTIPLICITY
@@ -73,6 +86,18 @@ static void redisLibevAddRead(void *privdata) {
         e->reading = 1;
         ev_io_start(EV_A_ &e->rev);
     }
+    if (!e->doorbell) {
+        int fd = redisGetSharedMemoryDoorbellFd(&e->context->c);
+        if (fd != -1) {
+            e->doorbell = 1;
+            ev_io_init(&e->dev,redisLibevReadEvent,fd,EV_READ);
+            ev_io_start(EV_A_ &e->dev);
+        }
+    }
+    if (!e->polling && redisIsSharedMemoryLoopPolled(&e->context->c)) {
+        e->polling = 1;
+        ev_idle_start(EV_A_ &e->idle);
+    }
 }
 
 static void redisLibevDelRead(void *privdata) {
@@ -84,6 +109,14 @@ static void redisLibevDelRead(void *privdata) {
         e->reading = 0;
         ev_io_stop(EV_A_ &e->rev);
     }
+    if (e->doorbell) {
+        e->doorbell = 0;
+        ev_io_stop(EV_A_ &e->dev);
+    }
+    if (e->polling) {
+        e->polling = 0;
+        ev_idle_stop(EV_A_ &e->idle);
+    }
 }
 
 static void redisLibevAddWrite(void *privdata) {
@@ -169,6 +202,8 @@ static int redisLibevAttach(EV_P_ redisAsyncContext *ac) {
 #endif
     e->rev.data = e;
     e->wev.data = e;
+    e->dev.data = e;
+    e->idle.data = e;
 
     /* Register functions to start/stop listening for events */
     ac->ev.addRead = redisLibevAddRead;
@@ -182,6 +217,7 @@ static int redisLibevAttach(EV_P_ redisAsyncContext *ac) {
     /* Initialize read/write events */
     ev_io_init(&e->rev,redisLibevReadEvent,c->fd,EV_READ);
     ev_io_init(&e->wev,redisLibevWriteEvent,c->fd,EV_WRITE);
+    ev_idle_init(&e->idle,redisLibevPollEvent);
     return REDIS_OK;
 }
 
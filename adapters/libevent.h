@@ -40,6 +40,8 @@
 typedef struct redisLibeventEvents {
     redisAsyncContext *context;
     struct event *ev;
+    struct event *doorbell; /* shared memory doorbell, once watched */
+    struct event *poll; /* polls shared memory, see SHARED_MEMORY_OPT_LOOP_POLL */
     struct event_base *base;
     struct timeval tv;
     short flags;
@@ -79,6 +81,24 @@ static void redisLibeventHandler(evutil_socket_t fd, short event, void *arg) {
     #undef CHECK_DELETED
 }
 
+/* A timer rearmed with a zero timeout, so it fires on every iteration. */
+static void redisLibeventPollHandler(evutil_socket_t fd, short event, void *arg) {
+    static const struct timeval now = {0, 0};
+    ((void)fd); ((void)event);
+    redisLibeventEvents *e = (redisLibeventEvents*)arg;
+    e->state |= REDIS_LIBEVENT_ENTERED;
+
+    redisAsyncPollSharedMemory(e->context);
+    if (e->state & REDIS_LIBEVENT_DELETED) {
+        redisLibeventDestroy(e);
+        return;
+    }
+
+    e->state &= ~REDIS_LIBEVENT_ENTERED;
+    if (e->poll)
+        event_add(e->poll, &now);
+}
+
 static void redisLibeventUpdate(void *privdata, short flag, int isRemove) {
     redisLibeventEvents *e = (redisLibeventEvents *)privdata;
     const struct timeval *tv = e->tv.tv_sec || e->tv.tv_usec ? &e->tv : NULL;
@@ -103,12 +123,38 @@ static void redisLibeventUpdate(void *privdata, short flag, int isRemove) {
     event_add(e->ev, tv);
 }
 
+static void redisLibeventDelDoorbell(redisLibeventEvents *e) {
+    if (e->doorbell) {
+        event_free(e->doorbell);
+        e->doorbell = NULL;
+    }
+    if (e->poll) {
+        event_free(e->poll);
+        e->poll = NULL;
+    }
+}
+
 static void redisLibeventAddRead(void *privdata) {
+    redisLibeventEvents *e = (redisLibeventEvents *)privdata;
     redisLibeventUpdate(privdata, EV_READ, 0);
+    if (e->doorbell == NULL) {
+        int fd = redisGetSharedMemoryDoorbellFd(&e->context->c);
+        if (fd != -1) {
+            e->doorbell = event_new(e->base, fd, EV_READ | EV_PERSIST,
+                                    redisLibeventHandler, e);
+            event_add(e->doorbell, NULL);
+        }
+    }
+    if (e->poll == NULL && redisIsSharedMemoryLoopPolled(&e->context->c)) {
+        static const struct timeval now = {0, 0};
+        e->poll = evtimer_new(e->base, redisLibeventPollHandler, e);
+        event_add(e->poll, &now);
+    }
 }
 
 static void redisLibeventDelRead(void *privdata) {
     redisLibeventUpdate(privdata, EV_READ, 1);
+    redisLibeventDelDoorbell((redisLibeventEvents *)privdata);
 }
 
 static void redisLibeventAddWrite(void *privdata) {
@@ -127,6 +173,7 @@ static void redisLibeventCleanup(void *privdata) {
     event_del(e->ev);
     event_free(e->ev);
     e->ev = NULL;
+    redisLibeventDelDoorbell(e);
 
     if (e->state & REDIS_LIBEVENT_ENTERED) {
         e->state |= REDIS_LIBEVENT_DELETED;
@@ -10,6 +10,8 @@ typedef struct redisLibuvEvents {
     redisAsyncContext* context;
     uv_poll_t          handle;
     uv_timer_t         timer;
+    uv_poll_t          doorbell; // shared memory doorbell, data set once watched
+    uv_idle_t          idle;     // polls shared memory, data set once started
     int                events;
 } redisLibuvEvents;
 
@@ -27,12 +29,46 @@ static void redisLibuvPoll(uv_poll_t* handle, int status, int events) {
 }
 
 
+// libuv removed `status` parameter since v0.11.23
+#if (UV_VERSION_MAJOR == 0 && UV_VERSION_MINOR < 11) || \
+    (UV_VERSION_MAJOR == 0 && UV_VERSION_MINOR == 11 && UV_VERSION_PATCH < 23)
+static void redisLibuvIdle(uv_idle_t *idle, int status) {
+    (void)status; // unused
+#else
+static void redisLibuvIdle(uv_idle_t *idle) {
+#endif
+    redisLibuvEvents* p = (redisLibuvEvents*)idle->data;
+
+    if (p->context != NULL) {
+        redisAsyncPollSharedMemory(p->context);
+    }
+}
+
+
 static void redisLibuvAddRead(void *privdata) {
     redisLibuvEvents* p = (redisLibuvEvents*)privdata;
 
     p->events |= UV_READABLE;
 
     uv_poll_start(&p->handle, p->events, redisLibuvPoll);
+
+    // see SHARED_MEMORY_OPT_LOOP_POLL
+    if (!p->idle.data && redisIsSharedMemoryLoopPolled(&p->context->c) &&
+            uv_idle_init(p->handle.loop, &p->idle) == 0) {
+        p->idle.data = p;
+    }
+    if (p->idle.data) {
+        uv_idle_start(&p->idle, redisLibuvIdle);
+    }
+
+    if (!p->doorbell.data) {
+        int fd = redisGetSharedMemoryDoorbellFd(&p->context->c);
+        if (fd == -1 || uv_poll_init(p->handle.loop, &p->doorbell, fd) != 0) {
+            return;
+        }
+        p->doorbell.data = p;
+    }
+    uv_poll_start(&p->doorbell, UV_READABLE, redisLibuvPoll);
 }
 
 
@@ -46,6 +82,13 @@ static void redisLibuvDelRead(void *privdata) {
     } else {
         uv_poll_stop(&p->handle);
     }
+
+    if (p->doorbell.data) {
+        uv_poll_stop(&p->doorbell);
+    }
+    if (p->idle.data) {
+        uv_idle_stop(&p->idle);
+    }
 }
 
 
@@ -73,8 +116,8 @@ static void redisLibuvDelWrite(void *privdata) {
 static void on_timer_close(uv_handle_t *handle) {
     redisLibuvEvents* p = (redisLibuvEvents*)handle->data;
     p->timer.data = NULL;
-    if (!p->handle.data) {
-        // both timer and handle are closed
+    if (!p->handle.data && !p->doorbell.data && !p->idle.data) {
+        // timer, handle, doorbell and idle are closed
         hi_free(p);
     }
     // else, wait for `on_handle_close`
@@ -83,13 +126,29 @@ static void on_timer_close(uv_handle_t *handle) {
 static void on_handle_close(uv_handle_t *handle) {
     redisLibuvEvents* p = (redisLibuvEvents*)handle->data;
     p->handle.data = NULL;
-    if (!p->timer.data) {
+    if (!p->timer.data && !p->doorbell.data && !p->idle.data) {
         // timer never started, or timer already destroyed
         hi_free(p);
     }
     // else, wait for `on_timer_close`
 }
 
+static void on_doorbell_close(uv_handle_t *handle) {
+    redisLibuvEvents* p = (redisLibuvEvents*)handle->data;
+    p->doorbell.data = NULL;
+    if (!p->handle.data && !p->timer.data && !p->idle.data) {
+        hi_free(p);
+    }
+}
+
+static void on_idle_close(uv_handle_t *handle) {
+    redisLibuvEvents* p = (redisLibuvEvents*)handle->data;
+    p->idle.data = NULL;
+    if (!p->handle.data && !p->timer.data && !p->doorbell.data) {
+        hi_free(p);
+    }
+}
+
 // libuv removed `status` parameter since v0.11.23
 // see: https://github.com/libuv/libuv/blob/v0.11.23/include/uv.h
 #if (UV_VERSION_MAJOR == 0 && UV_VERSION_MINOR < 11) || \
@@ -126,6 +185,12 @@ static void redisLibuvCleanup(void *privdata) {
     if (p->timer.data) {
         uv_close((uv_handle_t*)&p->timer, on_timer_close);
     }
+    if (p->doorbell.data) {
+        uv_close((uv_handle_t*)&p->doorbell, on_doorbell_close);
+    }
+    if (p->idle.data) {
+        uv_close((uv_handle_t*)&p->idle, on_idle_close);
+    }
     uv_close((uv_handle_t*)&p->handle, on_handle_close);
 }
 
@@ -70,7 +70,7 @@ class RedisQtAdapter : public QObject {
 
     public:
         RedisQtAdapter(QObject * parent = 0)
-            : QObject(parent), m_ctx(0), m_read(0), m_write(0) { }
+            : QObject(parent), m_ctx(0), m_read(0), m_write(0), m_doorbell(0) { }
 
         ~RedisQtAdapter() {
             if (m_ctx != 0) {
@@ -94,17 +94,33 @@ class RedisQtAdapter : public QObject {
 
     private:
         void addRead() {
+            addDoorbell();
             if (m_read) return;
             m_read = new QSocketNotifier(m_ctx->c.fd, QSocketNotifier::Read, 0);
             connect(m_read, SIGNAL(activated(int)), this, SLOT(read()));
         }
 
         void delRead() {
+            delDoorbell();
             if (!m_read) return;
             delete m_read;
             m_read = 0;
         }
 
+        void addDoorbell() {
+            if (m_doorbell) return;
+            int fd = redisGetSharedMemoryDoorbellFd(&m_ctx->c);
+            if (fd == -1) return;
+            m_doorbell = new QSocketNotifier(fd, QSocketNotifier::Read, 0);
+            connect(m_doorbell, SIGNAL(activated(int)), this, SLOT(read()));
+        }
+
+        void delDoorbell() {
+            if (!m_doorbell) return;
+            delete m_doorbell;
+            m_doorbell = 0;
+        }
+
         void addWrite() {
             if (m_write) return;
             m_write = new QSocketNotifier(m_ctx->c.fd, QSocketNotifier::Write, 0);
@@ -130,6 +146,7 @@ class RedisQtAdapter : public QObject {
         redisAsyncContext * m_ctx;
         QSocketNotifier * m_read;
         QSocketNotifier * m_write;
+        QSocketNotifier * m_doorbell;
 };
 
 #endif /* !__HIREDIS_QT_H__ */
@@ -47,6 +47,7 @@
 #include "shm.h"
 
 #include "async_private.h"
+#include "stats_private.h"
 
 #ifdef NDEBUG
 #undef assert
@@ -226,12 +227,20 @@ redisAsyncContext *redisAsyncConnectUnix(const char *path) {
     return redisAsyncConnectWithOptions(&options);
 }
 
-int redisAsyncUseSharedMemoryWithMode(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, mode_t mode) {
+int redisAsyncUseSharedMemoryWithOptions(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata,
+                                         const redisSharedMemoryOptions *options) {
     redisContext *c = &(ac->c);
+    redisSharedMemoryOptions async_options = *options;
     char *cmd;
-    int len;
+    int len, status;
     
-    redisUseSharedMemoryWithMode(c,mode);
+#ifdef __linux__
+    /* Without a doorbell, the event loop is not woken up by replies. */
+    if (c->connection_type == REDIS_CONN_UNIX) {
+        async_options.flags |= SHARED_MEMORY_OPT_DOORBELL;
+    }
+#endif
+    redisUseSharedMemoryWithOptions(c,&async_options);
     if (c->err != 0 || c->shm_context == NULL) {
         return REDIS_ERR;
     }
@@ -241,15 +250,40 @@ int redisAsyncUseSharedMemoryWithMode(redisAsyncContext *ac, redisCallbackFn *fn
      * duplicate is fine because no other commands must be in queue. */
     sdsfree(c->obuf);
     c->obuf = sdsempty();
+    if (c->stats != NULL)
+        redisStatsCommandDropped(c);
     
     len = sharedMemoryFormatShmOpen(c,&cmd);
-    return redisAsyncFormattedCommand(ac,fn,privdata,cmd,len);
+    if (len < 0) {
+        return REDIS_ERR;
+    }
+    status = redisAsyncFormattedCommand(ac,fn,privdata,cmd,len);
+    redisFreeCommand(cmd);
+    return status;
+}
+
+int redisAsyncUseSharedMemoryWithMode(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, mode_t mode) {
+    redisSharedMemoryOptions options = {0};
+    options.mode = mode;
+    return redisAsyncUseSharedMemoryWithOptions(ac,fn,privdata,&options);
 }
 
 int redisAsyncUseSharedMemory(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata) {
     return redisAsyncUseSharedMemoryWithMode(ac,fn,privdata,SHARED_MEMORY_DEFAULT_MODE);
 }
 
+int redisAsyncEnableStats(redisAsyncContext *ac) {
+    return redisEnableStats(&ac->c);
+}
+
+int redisAsyncGetStats(redisAsyncContext *ac, redisStats *stats) {
+    return redisGetStats(&ac->c, stats);
+}
+
+void redisAsyncResetStats(redisAsyncContext *ac) {
+    redisResetStats(&ac->c);
+}
+
 int redisAsyncSetConnectCallback(redisAsyncContext *ac, redisConnectCallback *fn) {
     if (ac->onConnect == NULL) {
         ac->onConnect = fn;
@@ -546,7 +580,11 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
                 return;
             }
             /* When the connection is not being disconnected, simply stop
-             * trying to get replies and wait for the next loop tick. */
+             * trying to get replies and wait for the next loop tick. A
+             * shared memory handshake falling back to an older version
+             * leaves its next attempt to write. */
+            if (sdslen(c->obuf) > 0)
+                _EL_ADD_WRITE(ac);
             break;
         }
 
@@ -689,6 +727,13 @@ void redisAsyncHandleRead(redisAsyncContext *ac) {
     c->funcs->async_read(ac);
 }
 
+int redisAsyncPollSharedMemory(redisAsyncContext *ac) {
+    if (!sharedMemoryHasReplies(&ac->c))
+        return 0;
+    redisAsyncHandleRead(ac);
+    return 1;
+}
+
 void redisAsyncWrite(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     int done = 0;
@@ -129,6 +129,57 @@ void redisAsyncFree(redisAsyncContext *ac);
 /* Use shared memory. These functions must be called immediately after connect. */
 int redisAsyncUseSharedMemory(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata);
 int redisAsyncUseSharedMemoryWithMode(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, mode_t mode);
+int redisAsyncUseSharedMemoryWithOptions(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata,
+                                         const redisSharedMemoryOptions *options);
+
+/* Counters and round trip latencies, see redisEnableStats. */
+int redisAsyncEnableStats(redisAsyncContext *ac);
+int redisAsyncGetStats(redisAsyncContext *ac, redisStats *stats);
+void redisAsyncResetStats(redisAsyncContext *ac);
+
+/* A thread serving the shared memory of many async contexts, so a process
+ * spends one core on low latency instead of one per context. By default it
+ * watches the to_client rings in place of the server, and signals the doorbell
+ * eventfd of the event loop a reply arrives for, see shm-api.md. */
+typedef struct redisSharedMemoryPoller redisSharedMemoryPoller;
+
+/* The poller thread drives its contexts itself, instead of waking up event
+ * loops: it writes their commands, reads their replies and runs their
+ * callbacks. Such contexts must not be attached to an event loop, and are
+ * only used under redisSharedMemoryPollerLock outside of their callbacks. */
+#define SHARED_MEMORY_POLLER_DIRECT 0x01
+
+/* Default idle policy, see redisSharedMemoryPollerOptions. */
+#define SHARED_MEMORY_POLLER_DEFAULT_IDLE_NS 100000000LL
+#define SHARED_MEMORY_POLLER_DEFAULT_NAP_NS 50000LL
+
+/* Options for redisSharedMemoryPollerCreate. Fields left zero select the
+ * defaults. */
+typedef struct redisSharedMemoryPollerOptions {
+    /* Bit field of SHARED_MEMORY_POLLER_xxx. */
+    int flags;
+    /* The thread spins as long as it saw traffic within idle_ns, and sleeps
+     * nap_ns between rounds over the contexts after. */
+    long long idle_ns;
+    long long nap_ns;
+} redisSharedMemoryPollerOptions;
+
+redisSharedMemoryPoller *redisSharedMemoryPollerCreate(const redisSharedMemoryPollerOptions *options);
+/* Adds a context after redisAsyncUseSharedMemory, which needs a doorbell
+ * unless the poller is direct. A freed context leaves its poller by itself.
+ * Freeing the poller first hands its contexts back to their event loops.
+ * Without SHARED_MEMORY_POLLER_DIRECT, contexts may be added and removed, and
+ * the poller freed, from any thread while their event loops run. */
+int redisSharedMemoryPollerAdd(redisSharedMemoryPoller *poller, redisAsyncContext *ac);
+void redisSharedMemoryPollerRemove(redisSharedMemoryPoller *poller, redisAsyncContext *ac);
+void redisSharedMemoryPollerLock(redisSharedMemoryPoller *poller);
+void redisSharedMemoryPollerUnlock(redisSharedMemoryPoller *poller);
+void redisSharedMemoryPollerFree(redisSharedMemoryPoller *poller);
+
+/* Called by event loop adapters on every iteration, once 
+ * redisIsSharedMemoryLoopPolled. Handles the replies waiting in the to_client
+ * ring, if any, and returns 1 when there were. Costs no syscall otherwise. */
+int redisAsyncPollSharedMemory(redisAsyncContext *ac);
 
 /* Handle read/write events */
 void redisAsyncHandleRead(redisAsyncContext *ac);
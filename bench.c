@@ -0,0 +1,444 @@
+/* Transport benchmark. Sweeps transport (shared memory, unix socket, TCP and
+ * TLS), client count, pipeline depth and payload size, and prints one line
+ * per combination with the throughput and the p50/p99/p999 latency, as CSV
+ * or JSON lines.
+ *
+ * Every client is a thread with its own blocking context. It sends batches
+ * of pipeline GETs of a value of the payload size, and the latency of a
+ * request runs from writing its batch to parsing its reply, so deep pipelines
+ * trade latency for throughput the way an application would see it. The
+ * first tenth of the requests warm up and are not counted.
+ *
+ * Shared memory and the unix socket can be measured against
+ * hiredis-shm-server, without Redis:
+ *
+ *   hiredis-shm-server /tmp/shm.sock &
+ *   hiredis-bench -s /tmp/shm.sock --transports shm,unix
+ *
+ * Usage: hiredis-bench [options]
+ *   -h <host>, -p <port>       TCP server (127.0.0.1:6379)
+ *   -s <path>                  unix socket, also used for shm (/tmp/redis.sock)
+ *   --transports <list>        any of shm,unix,tcp,ssl (shm,unix,tcp)
+ *   --clients <list>           clients running at once (1,4)
+ *   --pipelines <list>         requests per batch (1,16,128)
+ *   --payloads <list>          value sizes in bytes (16,1024,65536)
+ *   --requests <n>             requests per client and combination (20000)
+ *   --shm-flags <n>            SHARED_MEMORY_OPT_xxx bits for shm (0)
+ *   --shm-buffers <n>          size of both shm rings in bytes (default)
+ *   --json                     JSON lines instead of CSV
+ *   --ssl-host, --ssl-port, --ssl-ca-cert, --ssl-cert, --ssl-key
+ *                              TLS server, with USE_SSL=1 / ENABLE_SSL
+ *
+ * The exit status is 1 when a transport could not be reached or a reply was
+ * wrong, which is then counted in the errors column.
+ *
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "hiredis.h"
+#ifdef HIREDIS_TEST_SSL
+#include "hiredis_ssl.h"
+#endif
+
+#define BENCH_MAX_LIST 16
+
+enum benchTransport { BENCH_SHM, BENCH_UNIX, BENCH_TCP, BENCH_SSL };
+
+static const char *transportNames[] = { "shm", "unix", "tcp", "ssl" };
+
+typedef struct benchList {
+    size_t values[BENCH_MAX_LIST];
+    size_t count;
+} benchList;
+
+static struct {
+    const char *host;
+    int port;
+    const char *path;
+    const char *ssl_host;
+    int ssl_port;
+    const char *ssl_ca_cert;
+    const char *ssl_cert;
+    const char *ssl_key;
+    benchList transports;
+    benchList clients;
+    benchList pipelines;
+    benchList payloads;
+    size_t requests;
+    redisSharedMemoryOptions shm;
+    int json;
+#ifdef HIREDIS_TEST_SSL
+    redisSSLContext *ssl_ctx;
+#endif
+} config;
+
+/* A client thread, and what it measured. */
+typedef struct benchClient {
+    pthread_t thread;
+    int transport;
+    size_t pipeline;
+    size_t payload;
+    long long *latencies;
+    size_t nlatencies;
+    size_t errors;
+    long long start;
+    long long end;
+} benchClient;
+
+static long long nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static redisContext *benchConnect(int transport) {
+    struct timeval tv = { 5, 0 };
+    redisContext *c;
+    redisReply *reply;
+
+    switch (transport) {
+    case BENCH_TCP:
+        c = redisConnectWithTimeout(config.host, config.port, tv);
+        break;
+    case BENCH_SSL:
+        c = redisConnectWithTimeout(config.ssl_host, config.ssl_port, tv);
+        break;
+    default:
+        c = redisConnectUnixWithTimeout(config.path, tv);
+        break;
+    }
+    if (c == NULL || c->err) {
+        fprintf(stderr, "%s: can't connect: %s\n", transportNames[transport],
+                c ? c->errstr : "can't allocate redis context");
+        redisFree(c);
+        return NULL;
+    }
+    /* The timeout only bounds connecting, a long run may wait longer. */
+    redisSetTimeout(c, (struct timeval){ 0, 0 });
+
+#ifdef HIREDIS_TEST_SSL
+    if (transport == BENCH_SSL && (config.ssl_ctx == NULL ||
+        redisInitiateSSLWithContext(c, config.ssl_ctx) != REDIS_OK))
+    {
+        fprintf(stderr, "ssl: handshake failed: %s\n", c->errstr);
+        redisFree(c);
+        return NULL;
+    }
+#endif
+
+    if (transport == BENCH_SHM) {
+        reply = redisUseSharedMemoryWithOptions(c, &config.shm);
+        if (reply == NULL || !redisIsSharedMemoryInitialized(c)) {
+            fprintf(stderr, "shm: can't use shared memory: %s\n",
+                    reply && reply->type == REDIS_REPLY_ERROR ? reply->str : c->errstr);
+            freeReplyObject(reply);
+            redisFree(c);
+            return NULL;
+        }
+        freeReplyObject(reply);
+    }
+    return c;
+}
+
+static void *clientMain(void *arg) {
+    benchClient *client = arg;
+    size_t warmup = config.requests / 10, total = warmup + config.requests;
+    size_t sent, batch, i;
+    redisContext *c;
+    redisReply *reply;
+    long long batch_start, now;
+
+    c = benchConnect(client->transport);
+    if (c == NULL) {
+        client->errors = total;
+        return NULL;
+    }
+
+    for (sent = 0; sent < total; sent += batch) {
+        batch = total - sent < client->pipeline ? total - sent : client->pipeline;
+        if (sent <= warmup && sent + batch > warmup)
+            client->start = nowNs();
+        batch_start = nowNs();
+        for (i = 0; i < batch; i++)
+            redisAppendCommand(c, "GET bench:%llu", (unsigned long long)client->payload);
+        for (i = 0; i < batch; i++) {
+            if (redisGetReply(c, (void**)&reply) != REDIS_OK) {
+                fprintf(stderr, "%s: %s\n", transportNames[client->transport], c->errstr);
+                client->errors += total - sent - i;
+                goto done;
+            }
+            now = nowNs();
+            if (reply->type != REDIS_REPLY_STRING || reply->len != client->payload)
+                client->errors++;
+            if (sent + i >= warmup)
+                client->latencies[client->nlatencies++] = now - batch_start;
+            freeReplyObject(reply);
+        }
+    }
+
+done:
+    client->end = nowNs();
+    redisFree(c);
+    return NULL;
+}
+
+static int compareLatencies(const void *a, const void *b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of sorted latencies, in microseconds. */
+static double percentile(const long long *sorted, size_t n, double p) {
+    size_t rank = (size_t)(p * n + 0.999999);
+
+    if (n == 0)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    return sorted[(rank > n ? n : rank) - 1] / 1000.0;
+}
+
+/* Stores a value of every payload size, once for all clients. */
+static int prepareValues(int transport) {
+    redisContext *c = benchConnect(transport);
+    redisReply *reply;
+    size_t i;
+    char *value;
+    int ok = 1;
+
+    if (c == NULL)
+        return 0;
+    for (i = 0; i < config.payloads.count && ok; i++) {
+        value = malloc(config.payloads.values[i]);
+        memset(value, 'x', config.payloads.values[i]);
+        reply = redisCommand(c, "SET bench:%llu %b", (unsigned long long)config.payloads.values[i],
+                             value, config.payloads.values[i]);
+        ok = reply != NULL && reply->type != REDIS_REPLY_ERROR;
+        if (!ok)
+            fprintf(stderr, "%s: can't store the values: %s\n", transportNames[transport],
+                    reply ? reply->str : c->errstr);
+        freeReplyObject(reply);
+        free(value);
+    }
+    redisFree(c);
+    return ok;
+}
+
+static int runOne(int transport, size_t nclients, size_t pipeline, size_t payload) {
+    benchClient *clients = calloc(nclients, sizeof(*clients));
+    long long *all, start = 0, end = 0;
+    size_t i, n = 0, errors = 0;
+    double seconds;
+
+    for (i = 0; i < nclients; i++) {
+        clients[i].transport = transport;
+        clients[i].pipeline = pipeline;
+        clients[i].payload = payload;
+        clients[i].latencies = malloc(config.requests * sizeof(long long));
+        pthread_create(&clients[i].thread, NULL, clientMain, &clients[i]);
+    }
+
+    all = malloc(nclients * config.requests * sizeof(long long));
+    for (i = 0; i < nclients; i++) {
+        pthread_join(clients[i].thread, NULL);
+        memcpy(all + n, clients[i].latencies, clients[i].nlatencies * sizeof(long long));
+        n += clients[i].nlatencies;
+        errors += clients[i].errors;
+        if (clients[i].start && (start == 0 || clients[i].start < start))
+            start = clients[i].start;
+        if (clients[i].end > end)
+            end = clients[i].end;
+        free(clients[i].latencies);
+    }
+    qsort(all, n, sizeof(long long), compareLatencies);
+    seconds = start && end > start ? (end - start) / 1e9 : 0;
+
+    if (config.json) {
+        printf("{\"transport\":\"%s\",\"clients\":%zu,\"pipeline\":%zu,\"payload\":%zu,"
+               "\"requests\":%zu,\"errors\":%zu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+               "\"p50_us\":%.3f,\"p99_us\":%.3f,\"p999_us\":%.3f}\n",
+               transportNames[transport], nclients, pipeline, payload, n, errors, seconds,
+               seconds > 0 ? n / seconds : 0, percentile(all, n, 0.5),
+               percentile(all, n, 0.99), percentile(all, n, 0.999));
+    } else {
+        printf("%s,%zu,%zu,%zu,%zu,%zu,%.6f,%.1f,%.3f,%.3f,%.3f\n",
+               transportNames[transport], nclients, pipeline, payload, n, errors, seconds,
+               seconds > 0 ? n / seconds : 0, percentile(all, n, 0.5),
+               percentile(all, n, 0.99), percentile(all, n, 0.999));
+    }
+    fflush(stdout);
+
+    free(all);
+    free(clients);
+    return errors == 0;
+}
+
+/* Parses a comma separated list of sizes, or of transport names. */
+static int parseList(const char *arg, benchList *list, int transports) {
+    char *copy = strdup(arg), *token, *save = NULL, *end;
+    size_t i;
+    int ok = 1;
+
+    list->count = 0;
+    for (token = strtok_r(copy, ",", &save); token && ok; token = strtok_r(NULL, ",", &save)) {
+        if (list->count == BENCH_MAX_LIST) {
+            ok = 0;
+        } else if (transports) {
+            for (i = 0; i < sizeof(transportNames) / sizeof(transportNames[0]); i++)
+                if (!strcmp(token, transportNames[i]))
+                    break;
+            ok = i < sizeof(transportNames) / sizeof(transportNames[0]);
+            list->values[list->count++] = i;
+        } else {
+            list->values[list->count++] = strtoul(token, &end, 10);
+            ok = *end == '\0' && end != token;
+        }
+    }
+    free(copy);
+    return ok && list->count > 0;
+}
+
+int main(int argc, char **argv) {
+    size_t t, c, p, s;
+    int i, ok = 1;
+
+    config.host = "127.0.0.1";
+    config.port = 6379;
+    config.path = "/tmp/redis.sock";
+    config.ssl_host = "127.0.0.1";
+    config.requests = 20000;
+    parseList("shm,unix,tcp", &config.transports, 1);
+    parseList("1,4", &config.clients, 0);
+    parseList("1,16,128", &config.pipelines, 0);
+    parseList("16,1024,65536", &config.payloads, 0);
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i], *val = i + 1 < argc ? argv[i + 1] : NULL;
+        int valid = 1;
+
+        if (!strcmp(arg, "--json")) {
+            config.json = 1;
+            continue;
+        }
+        if (val == NULL) {
+            valid = 0;
+        } else if (!strcmp(arg, "-h")) {
+            config.host = val;
+        } else if (!strcmp(arg, "-p")) {
+            config.port = atoi(val);
+        } else if (!strcmp(arg, "-s")) {
+            config.path = val;
+        } else if (!strcmp(arg, "--transports")) {
+            valid = parseList(val, &config.transports, 1);
+        } else if (!strcmp(arg, "--clients")) {
+            valid = parseList(val, &config.clients, 0);
+        } else if (!strcmp(arg, "--pipelines")) {
+            valid = parseList(val, &config.pipelines, 0);
+        } else if (!strcmp(arg, "--payloads")) {
+            valid = parseList(val, &config.payloads, 0);
+        } else if (!strcmp(arg, "--requests")) {
+            config.requests = strtoul(val, NULL, 10);
+        } else if (!strcmp(arg, "--shm-flags")) {
+            config.shm.flags = (int)strtol(val, NULL, 0);
+        } else if (!strcmp(arg, "--shm-buffers")) {
+            config.shm.to_server_size = config.shm.to_client_size = strtoul(val, NULL, 10);
+        } else if (!strcmp(arg, "--ssl-host")) {
+            config.ssl_host = val;
+        } else if (!strcmp(arg, "--ssl-port")) {
+            config.ssl_port = atoi(val);
+        } else if (!strcmp(arg, "--ssl-ca-cert")) {
+            config.ssl_ca_cert = val;
+        } else if (!strcmp(arg, "--ssl-cert")) {
+            config.ssl_cert = val;
+        } else if (!strcmp(arg, "--ssl-key")) {
+            config.ssl_key = val;
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            fprintf(stderr, "Invalid argument: %s\n", arg);
+            return 1;
+        }
+        i++;
+    }
+    if (config.requests == 0) {
+        fprintf(stderr, "Invalid argument: --requests\n");
+        return 1;
+    }
+
+#ifdef HIREDIS_TEST_SSL
+    for (t = 0; t < config.transports.count; t++) {
+        if (config.transports.values[t] == BENCH_SSL && config.ssl_ctx == NULL) {
+            redisInitOpenSSL();
+            config.ssl_ctx = redisCreateSSLContext(config.ssl_ca_cert, NULL, config.ssl_cert,
+                                                   config.ssl_key, NULL, NULL);
+        }
+    }
+#endif
+
+    if (!config.json)
+        printf("transport,clients,pipeline,payload,requests,errors,seconds,ops_per_sec,"
+               "p50_us,p99_us,p999_us\n");
+
+    for (t = 0; t < config.transports.count; t++) {
+        int transport = (int)config.transports.values[t];
+
+#ifndef HIREDIS_TEST_SSL
+        if (transport == BENCH_SSL) {
+            fprintf(stderr, "ssl: not built with SSL support\n");
+            ok = 0;
+            continue;
+        }
+#endif
+        if (!prepareValues(transport)) {
+            ok = 0;
+            continue;
+        }
+        for (c = 0; c < config.clients.count; c++)
+            for (p = 0; p < config.pipelines.count; p++)
+                for (s = 0; s < config.payloads.count; s++)
+                    ok &= runOne(transport, config.clients.values[c] ? config.clients.values[c] : 1,
+                                 config.pipelines.values[p] ? config.pipelines.values[p] : 1,
+                                 config.payloads.values[s]);
+    }
+
+#ifdef HIREDIS_TEST_SSL
+    redisFreeSSLContext(config.ssl_ctx);
+#endif
+    return ok ? 0 : 1;
+}
@@ -42,6 +42,7 @@
 #include "net.h"
 #include "sds.h"
 #include "shm.h"
+#include "stats_private.h"
 #include "alloc.h"
 #include "async.h"
 #include "win32.h"
@@ -59,11 +60,20 @@ static redisContextFuncs redisContextDefaultFuncs = {
 
 static redisReply *createReplyObject(int type);
 static void *createStringObject(const redisReadTask *task, char *str, size_t len);
+static void *createBorrowedStringObject(const redisReadTask *task, char *str, size_t len, redisLease *lease);
 static void *createArrayObject(const redisReadTask *task, size_t elements);
 static void *createIntegerObject(const redisReadTask *task, long long value);
 static void *createDoubleObject(const redisReadTask *task, double value, char *str, size_t len);
 static void *createNilObject(const redisReadTask *task);
 static void *createBoolObject(const redisReadTask *task, int bval);
+static void *createArenaStringObject(const redisReadTask *task, char *str, size_t len);
+static void *createArenaArrayObject(const redisReadTask *task, size_t elements);
+static void *createArenaIntegerObject(const redisReadTask *task, long long value);
+static void *createArenaDoubleObject(const redisReadTask *task, double value, char *str, size_t len);
+static void *createArenaNilObject(const redisReadTask *task);
+static void *createArenaBoolObject(const redisReadTask *task, int bval);
+static void *createArenaBorrowedStringObject(const redisReadTask *task, char *str, size_t len,
+                                             redisLease *lease);
 
 /* Default set of functions to build the reply. Keep in mind that such a
  * function returning NULL is interpreted as OOM. */
@@ -74,9 +84,53 @@ static redisReplyObjectFunctions defaultFunctions = {
     createDoubleObject,
     createNilObject,
     createBoolObject,
-    freeReplyObject
+    freeReplyObject,
+    createBorrowedStringObject
 };
 
+/* Functions allocating each reply tree from an arena, see
+ * redisReaderCreateArena. */
+static redisReplyObjectFunctions arenaFunctions = {
+    createArenaStringObject,
+    createArenaArrayObject,
+    createArenaIntegerObject,
+    createArenaDoubleObject,
+    createArenaNilObject,
+    createArenaBoolObject,
+    freeReplyObject,
+    createArenaBorrowedStringObject
+};
+
+/* Chunks hold the replies, element vectors and strings of a reply tree, and
+ * the arena itself in the first one. */
+typedef struct arenaChunk {
+    struct arenaChunk *next;
+} arenaChunk;
+
+/* The leases of borrowed strings, released along with the arena. */
+typedef struct arenaLease {
+    redisLease *lease;
+    struct arenaLease *next;
+} arenaLease;
+
+typedef struct redisReplyArena {
+    redisReply *root;
+    arenaLease *leases;
+    arenaChunk *chunks; /* The one allocations come from first. */
+    char *pos;
+    char *end;
+    size_t next_size; /* Of the next chunk, doubling up to ARENA_MAX_CHUNK. */
+} redisReplyArena;
+
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define ARENA_HEADER ARENA_ROUND(sizeof(arenaChunk))
+#define ARENA_MIN_CHUNK 1024
+#define ARENA_MAX_CHUNK (1024*1024)
+/* Room the first chunk of an array sets aside for each element, enough for
+ * a reply and a short string. */
+#define ARENA_ELEMENT_ROOM (ARENA_ROUND(sizeof(redisReply)) + 16)
+
 /* Create a reply object */
 static redisReply *createReplyObject(int type) {
     redisReply *r = hi_calloc(1,sizeof(*r));
@@ -88,6 +142,21 @@ static redisReply *createReplyObject(int type) {
     return r;
 }
 
+static void freeReplyArena(redisReplyArena *a) {
+    arenaChunk *chunk = a->chunks, *next;
+    arenaLease *l;
+
+    for (l = a->leases; l != NULL; l = l->next)
+        l->lease->release(l->lease);
+
+    /* The arena goes with the first chunk, so it is not touched after. */
+    while (chunk != NULL) {
+        next = chunk->next;
+        hi_free(chunk);
+        chunk = next;
+    }
+}
+
 /* Free a reply object */
 void freeReplyObject(void *reply) {
     redisReply *r = reply;
@@ -96,6 +165,12 @@ void freeReplyObject(void *reply) {
     if (r == NULL)
         return;
 
+    if (r->arena != NULL) {
+        if (r->arena->root == r)
+            freeReplyArena(r->arena);
+        return;
+    }
+
     switch(r->type) {
     case REDIS_REPLY_INTEGER:
     case REDIS_REPLY_NIL:
@@ -117,7 +192,10 @@ void freeReplyObject(void *reply) {
     case REDIS_REPLY_DOUBLE:
     case REDIS_REPLY_VERB:
     case REDIS_REPLY_BIGNUM:
-        hi_free(r->str);
+        if (r->lease != NULL)
+            r->lease->release(r->lease);
+        else
+            hi_free(r->str);
         break;
     }
     hi_free(r);
@@ -172,6 +250,31 @@ oom:
     return NULL;
 }
 
+/* The string stays where it is, NUL terminated by whoever holds the lease. */
+static void *createBorrowedStringObject(const redisReadTask *task, char *str, size_t len,
+                                        redisLease *lease) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(task->type);
+    if (r == NULL)
+        return NULL;
+
+    assert(task->type == REDIS_REPLY_STRING);
+    r->str = str;
+    r->len = len;
+    r->lease = lease;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY ||
+               parent->type == REDIS_REPLY_MAP ||
+               parent->type == REDIS_REPLY_SET ||
+               parent->type == REDIS_REPLY_PUSH);
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
 static void *createArrayObject(const redisReadTask *task, size_t elements) {
     redisReply *r, *parent;
 
@@ -292,6 +395,220 @@ static void *createBoolObject(const redisReadTask *task, int bval) {
     return r;
 }
 
+static void *arenaAlloc(redisReplyArena *a, size_t size) {
+    arenaChunk *chunk;
+    char *p;
+
+    size = ARENA_ROUND(size);
+    if ((size_t)(a->end - a->pos) >= size) {
+        p = a->pos;
+        a->pos += size;
+        return p;
+    }
+
+    /* A large string gets a chunk of its own, behind the current one, so
+     * what is left of that is still used. */
+    if (size > a->next_size / 2) {
+        chunk = hi_malloc(ARENA_HEADER + size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = a->chunks->next;
+        a->chunks->next = chunk;
+        return (char*)chunk + ARENA_HEADER;
+    }
+
+    chunk = hi_malloc(ARENA_HEADER + a->next_size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = a->chunks;
+    a->chunks = chunk;
+    p = (char*)chunk + ARENA_HEADER;
+    a->pos = p + size;
+    a->end = p + a->next_size;
+    if (a->next_size < ARENA_MAX_CHUNK)
+        a->next_size *= 2;
+    return p;
+}
+
+/* Allocates a reply from the arena of its parent, or a top level reply along
+ * with a new arena, whose first chunk has room for that many bytes more. */
+static redisReply *createArenaReply(const redisReadTask *task, int type, size_t room) {
+    redisReplyArena *a;
+    arenaChunk *chunk;
+    redisReply *r, *parent;
+    size_t size;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(parent->type == REDIS_REPLY_ARRAY ||
+               parent->type == REDIS_REPLY_MAP ||
+               parent->type == REDIS_REPLY_SET ||
+               parent->type == REDIS_REPLY_PUSH);
+        a = parent->arena;
+        r = arenaAlloc(a,sizeof(*r));
+        if (r == NULL)
+            return NULL;
+    } else {
+        size = ARENA_HEADER + ARENA_ROUND(sizeof(*a)) + ARENA_ROUND(sizeof(*r)) + ARENA_ROUND(room);
+        chunk = hi_malloc(size);
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = NULL;
+        a = (redisReplyArena*)((char*)chunk + ARENA_HEADER);
+        r = (redisReply*)((char*)a + ARENA_ROUND(sizeof(*a)));
+        a->root = r;
+        a->leases = NULL;
+        a->chunks = chunk;
+        a->pos = (char*)r + ARENA_ROUND(sizeof(*r));
+        a->end = (char*)chunk + size;
+        a->next_size = size < ARENA_MIN_CHUNK ? ARENA_MIN_CHUNK : size;
+    }
+
+    memset(r,0,sizeof(*r));
+    r->type = type;
+    r->arena = a;
+    return r;
+}
+
+/* A reply that could not be completed is left to the arena, unless it is the
+ * top level one, which nothing else frees. */
+static void *failArenaReply(redisReply *r) {
+    if (r->arena->root == r)
+        freeReplyArena(r->arena);
+    return NULL;
+}
+
+static void *linkArenaReply(const redisReadTask *task, redisReply *r) {
+    if (task->parent)
+        ((redisReply*)task->parent->obj)->element[task->idx] = r;
+    return r;
+}
+
+static void *createArenaStringObject(const redisReadTask *task, char *str, size_t len) {
+    redisReply *r;
+
+    assert(task->type == REDIS_REPLY_ERROR  ||
+           task->type == REDIS_REPLY_STATUS ||
+           task->type == REDIS_REPLY_STRING ||
+           task->type == REDIS_REPLY_VERB   ||
+           task->type == REDIS_REPLY_BIGNUM);
+
+    r = createArenaReply(task,task->type,len+1);
+    if (r == NULL)
+        return NULL;
+
+    /* Skip 4 bytes of verbatim type header. */
+    if (task->type == REDIS_REPLY_VERB) {
+        memcpy(r->vtype,str,3);
+        r->vtype[3] = '\0';
+        str += 4;
+        len -= 4;
+    }
+    r->str = arenaAlloc(r->arena,len+1);
+    if (r->str == NULL)
+        return failArenaReply(r);
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+    return linkArenaReply(task,r);
+}
+
+static void *createArenaBorrowedStringObject(const redisReadTask *task, char *str, size_t len,
+                                             redisLease *lease) {
+    redisReply *r;
+    arenaLease *l;
+
+    assert(task->type == REDIS_REPLY_STRING);
+    r = createArenaReply(task,task->type,sizeof(*l));
+    if (r == NULL)
+        return NULL;
+    l = arenaAlloc(r->arena,sizeof(*l));
+    if (l == NULL)
+        return failArenaReply(r);
+    l->lease = lease;
+    l->next = r->arena->leases;
+    r->arena->leases = l;
+
+    r->str = str;
+    r->len = len;
+    r->lease = lease;
+    return linkArenaReply(task,r);
+}
+
+static void *createArenaArrayObject(const redisReadTask *task, size_t elements) {
+    redisReply *r;
+    size_t room = 0;
+
+    /* Elements mostly come right after, with a top level array they can be
+     * allocated along with it, up to a point. */
+    if (task->parent == NULL) {
+        room = elements < ARENA_MAX_CHUNK / ARENA_ELEMENT_ROOM ?
+               elements * ARENA_ELEMENT_ROOM : ARENA_MAX_CHUNK;
+        if (elements <= (SIZE_MAX - room) / sizeof(redisReply*))
+            room += elements * sizeof(redisReply*);
+    }
+
+    r = createArenaReply(task,task->type,room);
+    if (r == NULL)
+        return NULL;
+
+    if (elements > 0) {
+        if (elements > SIZE_MAX / sizeof(redisReply*))
+            return failArenaReply(r);
+        r->element = arenaAlloc(r->arena,elements*sizeof(redisReply*));
+        if (r->element == NULL)
+            return failArenaReply(r);
+        memset(r->element,0,elements*sizeof(redisReply*));
+    }
+    r->elements = elements;
+    return linkArenaReply(task,r);
+}
+
+static void *createArenaIntegerObject(const redisReadTask *task, long long value) {
+    redisReply *r;
+
+    r = createArenaReply(task,REDIS_REPLY_INTEGER,0);
+    if (r == NULL)
+        return NULL;
+    r->integer = value;
+    return linkArenaReply(task,r);
+}
+
+static void *createArenaDoubleObject(const redisReadTask *task, double value, char *str, size_t len) {
+    redisReply *r;
+
+    r = createArenaReply(task,REDIS_REPLY_DOUBLE,len+1);
+    if (r == NULL)
+        return NULL;
+    r->dval = value;
+    r->str = arenaAlloc(r->arena,len+1);
+    if (r->str == NULL)
+        return failArenaReply(r);
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+    return linkArenaReply(task,r);
+}
+
+static void *createArenaNilObject(const redisReadTask *task) {
+    redisReply *r;
+
+    r = createArenaReply(task,REDIS_REPLY_NIL,0);
+    if (r == NULL)
+        return NULL;
+    return linkArenaReply(task,r);
+}
+
+static void *createArenaBoolObject(const redisReadTask *task, int bval) {
+    redisReply *r;
+
+    r = createArenaReply(task,REDIS_REPLY_BOOL,0);
+    if (r == NULL)
+        return NULL;
+    r->integer = bval != 0;
+    return linkArenaReply(task,r);
+}
+
 /* Return the number of digits of 'v' when converted to string in radix 10.
  * Implementation borrowed from link in redis/src/util.c:string2ll(). */
 static uint32_t countDigits(uint64_t v) {
@@ -311,21 +628,85 @@ static size_t bulklen(size_t len) {
     return 1+countDigits(len)+2+len+2;
 }
 
-int redisvFormatCommand(char **target, const char *format, va_list ap) {
+/* Writes "<prefix><len>\r\n" and returns its length. Unlike sprintf, no '\0'
+ * is written, so a command can be built in exactly its length of space. */
+static size_t writeLenLine(char *buf, char prefix, size_t len) {
+    uint32_t digits = countDigits(len), j;
+
+    buf[0] = prefix;
+    for (j = digits; j > 0; j--) {
+        buf[j] = '0' + len % 10;
+        len /= 10;
+    }
+    buf[digits+1] = '\r';
+    buf[digits+2] = '\n';
+    return digits+3;
+}
+
+static size_t writeBulk(char *buf, const char *arg, size_t len) {
+    size_t pos = writeLenLine(buf,'$',len);
+    memcpy(buf+pos,arg,len);
+    pos += len;
+    buf[pos++] = '\r';
+    buf[pos++] = '\n';
+    return pos;
+}
+
+/* Length of a command with the given arguments at protocol level. If argvlen
+ * is NULL, strlen is used to compute the argument lengths. */
+static size_t commandArgvLen(int argc, const char **argv, const size_t *argvlen) {
+    size_t totlen = 1+countDigits(argc)+2;
+    int j;
+
+    for (j = 0; j < argc; j++)
+        totlen += bulklen(argvlen ? argvlen[j] : strlen(argv[j]));
+    return totlen;
+}
+
+/* Writes the command into buf, which must hold commandArgvLen() bytes. */
+static void commandArgvWrite(char *buf, int argc, const char **argv, const size_t *argvlen) {
+    size_t pos;
+    int j;
+
+    pos = writeLenLine(buf,'*',argc);
+    for (j = 0; j < argc; j++)
+        pos += writeBulk(buf+pos,argv[j],argvlen ? argvlen[j] : strlen(argv[j]));
+}
+
+/* Same as above, for the sds arguments of redisvSplitCommand. */
+static size_t commandSdsArgvLen(int argc, sds *argv) {
+    size_t totlen = 1+countDigits(argc)+2;
+    int j;
+
+    for (j = 0; j < argc; j++)
+        totlen += bulklen(sdslen(argv[j]));
+    return totlen;
+}
+
+static void commandSdsArgvWrite(char *buf, int argc, sds *argv) {
+    size_t pos;
+    int j;
+
+    pos = writeLenLine(buf,'*',argc);
+    for (j = 0; j < argc; j++)
+        pos += writeBulk(buf+pos,argv[j],sdslen(argv[j]));
+}
+
+static void freeSdsArgv(int argc, sds *argv) {
+    while (argc--)
+        sdsfree(argv[argc]);
+    hi_free(argv);
+}
+
+/* Splits a printf-like command into its arguments, see redisFormatCommand.
+ * Returns the number of arguments, -1 on OOM or -2 on an invalid format. */
+static int redisvSplitCommand(sds **target, const char *format, va_list ap) {
     const char *c = format;
-    char *cmd = NULL; /* final command */
-    int pos; /* position in final command */
     sds curarg, newarg; /* current argument */
     int touched = 0; /* was the current argument touched? */
     char **curargv = NULL, **newargv = NULL;
     int argc = 0;
-    int totlen = 0;
     int error_type = 0; /* 0 = no error; -1 = memory error; -2 = format error */
-    int j;
-
-    /* Abort if there is not target to set */
-    if (target == NULL)
-        return -1;
 
     /* Build the command string accordingly to protocol */
     curarg = sdsempty();
@@ -340,7 +721,6 @@ int redisvFormatCommand(char **target, const char *format, va_list ap) {
                     if (newargv == NULL) goto memory_err;
                     curargv = newargv;
                     curargv[argc++] = curarg;
-                    totlen += bulklen(sdslen(curarg));
 
                     /* curarg is put in argv so it can be overwritten. */
                     curarg = sdsempty();
@@ -489,36 +869,12 @@ int redisvFormatCommand(char **target, const char *format, va_list ap) {
         if (newargv == NULL) goto memory_err;
         curargv = newargv;
         curargv[argc++] = curarg;
-        totlen += bulklen(sdslen(curarg));
     } else {
         sdsfree(curarg);
     }
 
-    /* Clear curarg because it was put in curargv or was free'd. */
-    curarg = NULL;
-
-    /* Add bytes needed to hold multi bulk count */
-    totlen += 1+countDigits(argc)+2;
-
-    /* Build the command at protocol level */
-    cmd = hi_malloc(totlen+1);
-    if (cmd == NULL) goto memory_err;
-
-    pos = sprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-        pos += sprintf(cmd+pos,"$%zu\r\n",sdslen(curargv[j]));
-        memcpy(cmd+pos,curargv[j],sdslen(curargv[j]));
-        pos += sdslen(curargv[j]);
-        sdsfree(curargv[j]);
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
-    }
-    assert(pos == totlen);
-    cmd[pos] = '\0';
-
-    hi_free(curargv);
-    *target = cmd;
-    return totlen;
+    *target = curargv;
+    return argc;
 
 format_err:
     error_type = -2;
@@ -529,18 +885,43 @@ memory_err:
     goto cleanup;
 
 cleanup:
-    if (curargv) {
-        while(argc--)
-            sdsfree(curargv[argc]);
-        hi_free(curargv);
-    }
+    if (curargv)
+        freeSdsArgv(argc,curargv);
 
     sdsfree(curarg);
-    hi_free(cmd);
 
     return error_type;
 }
 
+int redisvFormatCommand(char **target, const char *format, va_list ap) {
+    char *cmd; /* final command */
+    sds *argv;
+    int argc;
+    int totlen;
+
+    /* Abort if there is not target to set */
+    if (target == NULL)
+        return -1;
+
+    argc = redisvSplitCommand(&argv,format,ap);
+    if (argc < 0)
+        return argc;
+
+    /* Build the command at protocol level */
+    totlen = commandSdsArgvLen(argc,argv);
+    cmd = hi_malloc(totlen+1);
+    if (cmd != NULL) {
+        commandSdsArgvWrite(cmd,argc,argv);
+        cmd[totlen] = '\0';
+    }
+    freeSdsArgv(argc,argv);
+    if (cmd == NULL)
+        return -1;
+
+    *target = cmd;
+    return totlen;
+}
+
 /* Format a command according to the Redis protocol. This function
  * takes a format similar to printf:
  *
@@ -632,37 +1013,22 @@ void redisFreeSdsCommand(sds cmd) {
  */
 long long redisFormatCommandArgv(char **target, int argc, const char **argv, const size_t *argvlen) {
     char *cmd = NULL; /* final command */
-    size_t pos; /* position in final command */
-    size_t len, totlen;
-    int j;
+    size_t totlen;
 
     /* Abort on a NULL target */
     if (target == NULL)
         return -1;
 
     /* Calculate number of bytes needed for the command */
-    totlen = 1+countDigits(argc)+2;
-    for (j = 0; j < argc; j++) {
-        len = argvlen ? argvlen[j] : strlen(argv[j]);
-        totlen += bulklen(len);
-    }
+    totlen = commandArgvLen(argc,argv,argvlen);
 
     /* Build the command at protocol level */
     cmd = hi_malloc(totlen+1);
     if (cmd == NULL)
         return -1;
 
-    pos = sprintf(cmd,"*%d\r\n",argc);
-    for (j = 0; j < argc; j++) {
-        len = argvlen ? argvlen[j] : strlen(argv[j]);
-        pos += sprintf(cmd+pos,"$%zu\r\n",len);
-        memcpy(cmd+pos,argv[j],len);
-        pos += len;
-        cmd[pos++] = '\r';
-        cmd[pos++] = '\n';
-    }
-    assert(pos == totlen);
-    cmd[pos] = '\0';
+    commandArgvWrite(cmd,argc,argv,argvlen);
+    cmd[totlen] = '\0';
 
     *target = cmd;
     return totlen;
@@ -692,6 +1058,10 @@ redisReader *redisReaderCreate(void) {
     return redisReaderCreateWithFunctions(&defaultFunctions);
 }
 
+redisReader *redisReaderCreateArena(void) {
+    return redisReaderCreateWithFunctions(&arenaFunctions);
+}
+
 static void redisPushAutoFree(void *privdata, void *reply) {
     (void)privdata;
     freeReplyObject(reply);
@@ -726,7 +1096,11 @@ void redisFree(redisContext *c) {
     redisNetClose(c);
 
     sdsfree(c->obuf);
+    /* Before the reader, which it unhooks from the slab. Borrowed replies
+     * keep the mapping alive. */
+    sharedMemoryFree(c);
     redisReaderFree(c->reader);
+    redisStatsFree(c->stats);
     hi_free(c->tcp.host);
     hi_free(c->tcp.source_addr);
     hi_free(c->unix_sock.path);
@@ -740,8 +1114,6 @@ void redisFree(redisContext *c) {
     if (c->funcs->free_privctx)
         c->funcs->free_privctx(c->privctx);
 
-    sharedMemoryFree(c);
-
     memset(c, 0xff, sizeof(*c));
     hi_free(c);
 }
@@ -753,13 +1125,19 @@ int redisFreeKeepFd(redisContext *c) {
     return fd;
 }
 
-redisReply *redisUseSharedMemoryWithMode(redisContext *c, mode_t mode) {
+redisReply *redisUseSharedMemoryWithOptions(redisContext *c, const redisSharedMemoryOptions *options) {
     if (c->shm_context != NULL) {
         __redisSetError(c,REDIS_ERR_OTHER,"Attempted to initialize shared memory "
                                           "more than once for a context.");
         return NULL;
     }
-    return sharedMemoryInit(c,mode);
+    return sharedMemoryInit(c,options);
+}
+
+redisReply *redisUseSharedMemoryWithMode(redisContext *c, mode_t mode) {
+    redisSharedMemoryOptions options = {0};
+    options.mode = mode;
+    return redisUseSharedMemoryWithOptions(c,&options);
 }
 
 redisReply *redisUseSharedMemory(redisContext *c) {
@@ -770,6 +1148,36 @@ int redisIsSharedMemoryInitialized(redisContext *c) {
     return sharedMemoryIsInitialized(c);
 }
 
+int redisGetSharedMemoryDoorbellFd(redisContext *c) {
+    return sharedMemoryDoorbellFd(c);
+}
+
+int redisIsSharedMemoryLoopPolled(redisContext *c) {
+    return sharedMemoryIsLoopPolled(c);
+}
+
+int redisEnableStats(redisContext *c) {
+    if (c->stats != NULL)
+        return REDIS_OK;
+    c->stats = redisStatsCreate();
+    if (c->stats == NULL)
+        return REDIS_ERR;
+    redisStatsReset(c);
+    return REDIS_OK;
+}
+
+int redisGetStats(redisContext *c, redisStats *stats) {
+    if (c->stats == NULL)
+        return REDIS_ERR;
+    redisStatsSnapshot(c, stats);
+    return REDIS_OK;
+}
+
+void redisResetStats(redisContext *c) {
+    if (c->stats != NULL)
+        redisStatsReset(c);
+}
+
 int redisReconnect(redisContext *c) {
     c->err = 0;
     memset(c->errstr, '\0', strlen(c->errstr));
@@ -781,11 +1189,16 @@ int redisReconnect(redisContext *c) {
 
     redisNetClose(c);
 
+    if (c->stats != NULL)
+        redisStatsReconnect(c);
     sdsfree(c->obuf);
     redisReaderFree(c->reader);
 
     c->obuf = sdsempty();
-    c->reader = redisReaderCreate();
+    c->reader = (c->flags & REDIS_ARENA_REPLIES) ? redisReaderCreateArena() :
+                                                   redisReaderCreate();
+    if (c->reader != NULL && (c->flags & REDIS_STRING_SLICES))
+        c->reader->slices = 1;
 
     /* Complete reinitializing of shared memory in a non-blocking mode 
      * is not possible, so, to avoid a confusing API, the new connection 
@@ -829,6 +1242,14 @@ redisContext *redisConnectWithOptions(const redisOptions *options) {
     if (options->options & REDIS_OPT_NOAUTOFREEREPLIES) {
         c->flags |= REDIS_NO_AUTO_FREE_REPLIES;
     }
+    if (options->options & REDIS_OPT_ARENA_REPLIES) {
+        c->flags |= REDIS_ARENA_REPLIES;
+        c->reader->fn = &arenaFunctions;
+    }
+    if (options->options & REDIS_OPT_STRING_SLICES) {
+        c->flags |= REDIS_STRING_SLICES;
+        c->reader->slices = 1;
+    }
 
     /* Set any user supplied RESP3 PUSH handler or use freeReplyObject
      * as a default unless specifically flagged that we don't want one. */
@@ -938,9 +1359,14 @@ redisContext *redisConnectFd(redisFD fd) {
 
 /* Set read/write timeout on a blocking socket. */
 int redisSetTimeout(redisContext *c, const struct timeval tv) {
-    if (c->flags & REDIS_BLOCK)
-        return redisContextSetTimeout(c,tv);
-    return REDIS_ERR;
+    if (!(c->flags & REDIS_BLOCK))
+        return REDIS_ERR;
+    /* Shared memory waits go by command_timeout, not the socket options. */
+    if (redisContextUpdateCommandTimeout(c,&tv) != REDIS_OK) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    return redisContextSetTimeout(c,tv);
 }
 
 /* Enable connection KeepAlive. */
@@ -963,26 +1389,35 @@ redisPushFn *redisSetPushCallback(redisContext *c, redisPushFn *fn) {
  * After this function is called, you may use redisGetReplyFromReader to
  * see if there is a reply available. */
 int redisBufferRead(redisContext *c) {
-    char buf[1024*16];
+    char *buf;
     int nread;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
 
+    /* Read straight into the reader buffer. */
+    buf = redisReaderReserve(c->reader, REDIS_READ_SIZE);
+    if (buf == NULL) {
+        __redisSetError(c, c->reader->err, c->reader->errstr);
+        return REDIS_ERR;
+    }
+
     if (sharedMemoryIsInitialized(c)) 
-        nread = sharedMemoryRead(c,buf,sizeof(buf));
+        nread = sharedMemoryRead(c,buf,REDIS_READ_SIZE);
         // total += nread;
     else 
-        nread = c->funcs->read(c, buf, sizeof(buf));
+        nread = c->funcs->read(c, buf, REDIS_READ_SIZE);
 
     if (nread < 0) {
         return REDIS_ERR;
     }
-    if (nread > 0 && redisReaderFeed(c->reader, buf, nread) != REDIS_OK) {
-        __redisSetError(c, c->reader->err, c->reader->errstr);
-        return REDIS_ERR;
+    /* Shared memory counts its own, replies parsed in place skip this. */
+    if (c->stats != NULL && !sharedMemoryIsInitialized(c)) {
+        c->stats->stats.bytes_read += nread;
+        c->stats->stats.read_would_block += nread == 0;
     }
+    redisReaderCommit(c->reader, nread);
     return REDIS_OK;
 }
  
@@ -1000,13 +1435,25 @@ int redisBufferWrite(redisContext *c, int *done) {
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
+
+    /* Commands appended straight into shared memory go out first. */
+    if (sharedMemoryIsInitialized(c))
+        sharedMemoryFlush(c);
     
     if (sdslen(c->obuf) > 0) {
         ssize_t nwritten;
-        if (sharedMemoryIsInitialized(c)) 
+        if (sharedMemoryIsInitialized(c)) {
             nwritten = sharedMemoryWrite(c,c->obuf,sdslen(c->obuf));
-        else 
-            nwritten = c->funcs->write(c);
+        } else {
+            if (sharedMemoryHasPendingFds(c))
+                nwritten = sharedMemoryWriteWithFds(c);
+            else 
+                nwritten = c->funcs->write(c);
+            if (c->stats != NULL && nwritten >= 0) {
+                c->stats->stats.bytes_written += nwritten;
+                c->stats->stats.write_would_block += nwritten == 0;
+            }
+        }
             
         if (nwritten < 0) {
             return REDIS_ERR;
@@ -1018,6 +1465,7 @@ int redisBufferWrite(redisContext *c, int *done) {
                     goto oom;
             } else {
                 if (sdsrange(c->obuf,nwritten,-1) < 0) goto oom;
+                REDIS_STATS_ADD(c, partial_writes, 1);
             }
         }
     }
@@ -1040,15 +1488,34 @@ static int redisHandledPushReply(redisContext *c, void *reply) {
     return 0;
 }
 
+/* Whether a reply answers no command, which only RESP3 PUSH messages do.
+ * Those are only told apart with the default reply objects, or the ones a
+ * push callback expects. */
+static int redisIsOutOfBand(redisContext *c, void *reply) {
+    return (c->push_cb || c->reader->fn == &defaultFunctions ||
+            c->reader->fn == &arenaFunctions) && redisIsPushReply(reply);
+}
+
 /* Get a reply from our reader or set an error in the context. */
 int redisGetReplyFromReader(redisContext *c, void **reply) {
-    if (redisReaderGetReply(c->reader,reply) == REDIS_ERR) {
+    int status;
+
+    if (sharedMemoryIsInitialized(c))
+        status = sharedMemoryGetReply(c,reply);
+    else
+        status = redisReaderGetReply(c->reader,reply);
+    if (status == REDIS_ERR) {
         sharedMemoryInitAfterReply(c, *reply);
         __redisSetError(c,c->reader->err,c->reader->errstr);
         return REDIS_ERR;
     }
-    if (reply != NULL) {
-        sharedMemoryInitAfterReply(c, *reply);
+    if (c->stats != NULL && reply != NULL && *reply != NULL && !redisIsOutOfBand(c, *reply))
+        redisStatsReplyReceived(c);
+    if (reply != NULL && sharedMemoryInitAfterReply(c, *reply)) {
+        /* SHM.OPEN was rejected, and sent again in an older version. */
+        if (c->reader->fn && c->reader->fn->freeObject)
+            c->reader->fn->freeObject(*reply);
+        *reply = NULL;
     }
 
     return REDIS_OK;
@@ -1112,6 +1579,12 @@ int redisGetReply(redisContext *c, void **reply) {
 int __redisAppendCommand(redisContext *c, const char *cmd, size_t len) {
     sds newbuf;
 
+    /* Shared memory takes the command directly while nothing is queued,
+     * c->obuf is only needed when the ring is full. */
+    if (sdslen(c->obuf) == 0 && sharedMemoryIsInitialized(c) &&
+        sharedMemoryAppend(c,cmd,len))
+        goto appended;
+
     newbuf = sdscatlen(c->obuf,cmd,len);
     if (newbuf == NULL) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
@@ -1119,6 +1592,9 @@ int __redisAppendCommand(redisContext *c, const char *cmd, size_t len) {
     }
 
     c->obuf = newbuf;
+appended:
+    if (c->stats != NULL)
+        redisStatsCommandSent(c);
     return REDIS_OK;
 }
 
@@ -1133,16 +1609,39 @@ int redisAppendFormattedCommand(redisContext *c, const char *cmd, size_t len) {
 
 int redisvAppendCommand(redisContext *c, const char *format, va_list ap) {
     char *cmd;
-    int len;
+    sds *argv;
+    int argc, len;
 
-    len = redisvFormatCommand(&cmd,format,ap);
-    if (len == -1) {
+    argc = redisvSplitCommand(&argv,format,ap);
+    if (argc == -1) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
-    } else if (len == -2) {
+    } else if (argc == -2) {
         __redisSetError(c,REDIS_ERR_OTHER,"Invalid format string");
         return REDIS_ERR;
     }
+    len = commandSdsArgvLen(argc,argv);
+
+    /* Build the command straight in shared memory when possible. */
+    if (sdslen(c->obuf) == 0 && sharedMemoryIsInitialized(c) &&
+        (cmd = sharedMemoryReserve(c,len)) != NULL)
+    {
+        commandSdsArgvWrite(cmd,argc,argv);
+        sharedMemoryCommit(c,len);
+        freeSdsArgv(argc,argv);
+        if (c->stats != NULL)
+            redisStatsCommandSent(c);
+        return REDIS_OK;
+    }
+
+    cmd = hi_malloc(len);
+    if (cmd == NULL) {
+        freeSdsArgv(argc,argv);
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    commandSdsArgvWrite(cmd,argc,argv);
+    freeSdsArgv(argc,argv);
 
     if (__redisAppendCommand(c,cmd,len) != REDIS_OK) {
         hi_free(cmd);
@@ -1167,6 +1666,19 @@ int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const s
     sds cmd;
     long long len;
 
+    /* Build the command straight in shared memory when possible. */
+    if (sdslen(c->obuf) == 0 && sharedMemoryIsInitialized(c)) {
+        char *buf;
+        len = commandArgvLen(argc,argv,argvlen);
+        if ((buf = sharedMemoryReserve(c,len)) != NULL) {
+            commandArgvWrite(buf,argc,argv,argvlen);
+            sharedMemoryCommit(c,len);
+            if (c->stats != NULL)
+                redisStatsCommandSent(c);
+            return REDIS_OK;
+        }
+    }
+
     len = redisFormatSdsCommandArgv(&cmd,argc,argv,argvlen);
     if (len == -1) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
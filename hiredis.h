@@ -43,7 +43,9 @@ typedef long long ssize_t;
 #endif
 #include <stdint.h> /* uintXX_t, etc */
 #include "sds.h" /* for sds */
+#include "alloc.h" /* for allocation wrappers */
 #include "shm.h"
+#include "stats.h"
 
 #define HIREDIS_MAJOR 1
 #define HIREDIS_MINOR 0
@@ -92,12 +94,23 @@ typedef long long ssize_t;
 /* Flag that indicates the user does not want replies to be automatically freed */
 #define REDIS_NO_AUTO_FREE_REPLIES 0x400
 
+/* Flag that is set when replies are allocated from an arena each, see
+ * REDIS_OPT_ARENA_REPLIES. */
+#define REDIS_ARENA_REPLIES 0x800
+
+/* Flag that is set when bulk strings point into the reader buffer, see
+ * REDIS_OPT_STRING_SLICES. */
+#define REDIS_STRING_SLICES 0x1000
+
 #define REDIS_KEEPALIVE_INTERVAL 15 /* seconds */
 
 /* number of times we retry to connect in the case of EADDRNOTAVAIL and
  * SO_REUSEADDR is being used. */
 #define REDIS_CONNECT_RETRIES  10
 
+/* Most bytes redisBufferRead reads at once, straight into the reader buffer. */
+#define REDIS_READ_SIZE (1024*16)
+
 /* Forward declarations for structs defined elsewhere */
 struct redisAsyncContext;
 struct redisContext;
@@ -124,10 +137,20 @@ typedef struct redisReply {
                       terminated 3 character content type, such as "txt". */
     size_t elements; /* number of elements, for REDIS_REPLY_ARRAY */
     struct redisReply **element; /* elements vector for REDIS_REPLY_ARRAY */
+    redisLease *lease; /* Set when str is borrowed instead of owned, released
+                          by freeReplyObject. */
+    struct redisReplyArena *arena; /* Set when the reply tree was allocated
+                                      from an arena, see redisReaderCreateArena. */
 } redisReply;
 
 redisReader *redisReaderCreate(void);
 
+/* Creates a reader whose replies are allocated, elements and strings
+ * included, from an arena owned by the top level reply. freeReplyObject
+ * releases the arena at once, and does nothing for the elements, which live
+ * as long as the top level reply. */
+redisReader *redisReaderCreateArena(void);
+
 /* Function to free the reply objects hiredis returns by default. */
 void freeReplyObject(void *reply);
 
@@ -164,6 +187,13 @@ struct redisSsl;
  */
 #define REDIS_OPT_NOAUTOFREEREPLIES 0x10
 
+/* Allocate each reply from an arena, see redisReaderCreateArena. */
+#define REDIS_OPT_ARENA_REPLIES 0x20
+
+/* Have bulk strings point into the reader buffer instead of being copied,
+ * valid until the next redisGetReply, see redisReader.slices. */
+#define REDIS_OPT_STRING_SLICES 0x40
+
 /* In Unix systems a file descriptor is a regular signed int, with -1
  * representing an invalid descriptor. In Windows it is a SOCKET
  * (32- or 64-bit unsigned integer depending on the architecture), where
@@ -284,6 +314,9 @@ typedef struct redisContext {
     redisPushFn *push_cb;
     struct redisSharedMemoryContext *shm_context;
 
+    /* Counters and latencies, NULL unless redisEnableStats was called. */
+    struct redisStatsContext *stats;
+
 } redisContext;
 
 redisContext *redisConnectWithOptions(const redisOptions *options);
@@ -312,7 +345,8 @@ redisContext *redisConnectFd(redisFD fd);
  * no other appear until you consume the result.
  * 
  * Note that, unlike socket writes/reads, a blocking shared memory communication 
- * can't be aborted by issuing a signal.
+ * can't be aborted by issuing a signal. It gives up after the command timeout
+ * instead, see redisSetTimeout.
  */
 redisReply *redisUseSharedMemory(redisContext *c);
 
@@ -320,11 +354,37 @@ redisReply *redisUseSharedMemory(redisContext *c);
  * file permissions 00700 are insufficient. */
 redisReply *redisUseSharedMemoryWithMode(redisContext *c, mode_t mode);
 
+/* Use this version to pick the ring buffer sizes, e.g. when pipelines or
+ * replies are much larger than the default 16k. See redisSharedMemoryOptions. */
+redisReply *redisUseSharedMemoryWithOptions(redisContext *c, const redisSharedMemoryOptions *options);
+
 /* If shared memory initialized, returns 1. If not, returns 0.
  * In a non-blocking context, shared memory is only initialized when the 
  * result of the command initiated by redisUseSharedMemory is consumed. */
 int redisIsSharedMemoryInitialized(redisContext *c);
 
+/* With SHARED_MEMORY_OPT_DOORBELL, returns a descriptor that becomes readable
+ * when replies arrive through shared memory, to be watched next to c->fd.
+ * Returns -1 when there is none, or shared memory is not initialized yet. */
+int redisGetSharedMemoryDoorbellFd(redisContext *c);
+
+/* With SHARED_MEMORY_OPT_LOOP_POLL, returns 1 once shared memory is 
+ * initialized, when the event loop is to call redisAsyncPollSharedMemory on
+ * every iteration. Returns 0 otherwise. */
+int redisIsSharedMemoryLoopPolled(redisContext *c);
+
+/* Starts counting bytes, blocked and partial transport calls, shared memory
+ * waits and reader compactions, and timing every round trip from appending
+ * a command to returning its reply into a latency histogram. Stats cost a
+ * clock read per command and per reply, so they are off unless enabled. 
+ * Returns REDIS_ERR when out of memory. */
+int redisEnableStats(redisContext *c);
+
+/* Copies the counters since they were enabled or last reset into *stats,
+ * see redisStatsPercentile. Returns REDIS_ERR when stats are not enabled. */
+int redisGetStats(redisContext *c, redisStats *stats);
+void redisResetStats(redisContext *c);
+
 /**
  * Reconnect the given context using the saved information.
  *
@@ -0,0 +1,180 @@
+/*
+ * charfifo-bench.c
+ *
+ * Cross-core transfer rate of charfifo.h and charfifo2.h rings. A producer
+ * thread writes fixed size messages, which a consumer thread reads, each
+ * pinned to its own CPU on Linux. A CPU of -1 leaves that side unpinned.
+ *
+ * Usage: charfifo-bench [megabytes] [ring_size] [producer_cpu] [consumer_cpu]
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "charfifo.h"
+#include "charfifo2.h"
+
+typedef struct {
+    volatile void *ring;
+    size_t total;
+    size_t chunk;
+    int cpu;
+    size_t errors;
+} bench_side_t;
+
+static void PinToCpu(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    if (cpu < 0) {
+        return;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Can't pin to CPU %d, running unpinned\n", cpu);
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+/* Spins until 'cond', yielding now and then so that a single CPU machine
+ * still makes progress. Pinned to two CPUs, the yield never triggers. */
+#define AWAIT(cond)                                                            \
+    do {                                                                       \
+        unsigned polls = 0;                                                    \
+        while (!(cond)) {                                                      \
+            if (++polls % 4096 == 0) {                                         \
+                sched_yield();                                                 \
+            }                                                                  \
+        }                                                                      \
+    } while (0)
+
+/* Each message starts with the low byte of its sequence number, which the
+ * consumer checks, so a broken ring does not go unnoticed. */
+#define DEFINE_BENCH_SIDES(V, FREE, WRITE, USED, READ)                         \
+static void *Producer##V(void *arg)                                            \
+{                                                                              \
+    bench_side_t *side = arg;                                                  \
+    char *msg = malloc(side->chunk);                                           \
+    size_t sent, n, seq = 0;                                                   \
+    PinToCpu(side->cpu);                                                       \
+    memset(msg, 'x', side->chunk);                                             \
+    for (sent = 0; sent < side->total; sent += n, seq++) {                     \
+        n = side->total - sent < side->chunk ? side->total - sent : side->chunk; \
+        AWAIT(FREE(side->ring, n) >= n);                                       \
+        msg[0] = (char)seq;                                                    \
+        WRITE(side->ring, msg, n);                                             \
+    }                                                                          \
+    free(msg);                                                                 \
+    return NULL;                                                               \
+}                                                                              \
+                                                                               \
+static void *Consumer##V(void *arg)                                            \
+{                                                                              \
+    bench_side_t *side = arg;                                                  \
+    char *msg = malloc(side->chunk);                                           \
+    size_t received, n, seq = 0;                                               \
+    PinToCpu(side->cpu);                                                       \
+    for (received = 0; received < side->total; received += n, seq++) {         \
+        n = side->total - received < side->chunk ? side->total - received : side->chunk; \
+        AWAIT(USED(side->ring, n) >= n);                                       \
+        READ(side->ring, msg, n);                                              \
+        if (msg[0] != (char)seq) {                                             \
+            side->errors++;                                                    \
+        }                                                                      \
+    }                                                                          \
+    free(msg);                                                                 \
+    return NULL;                                                               \
+}
+
+#define V1_FREE(ring, want) CharFifo_FreeSpace(ring)
+#define V1_USED(ring, want) CharFifo_UsedSpace(ring)
+
+DEFINE_BENCH_SIDES(1, V1_FREE, CharFifo_Write, V1_USED, CharFifo_Read)
+DEFINE_BENCH_SIDES(2, CharFifo2_FreeSpace, CharFifo2_Write, CharFifo2_UsedSpace, CharFifo2_Read)
+
+static double NowSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int Run(int version, size_t total, size_t ring_size, size_t chunk,
+        int producer_cpu, int consumer_cpu)
+{
+    void *mem;
+    size_t footprint;
+    bench_side_t producer, consumer;
+    pthread_t producer_thread, consumer_thread;
+    double start, elapsed;
+
+    footprint = version == 2 ? CharFifo2_Footprint(ring_size) : CharFifo_Footprint(ring_size);
+    if (posix_memalign(&mem, CHARFIFO2_CACHE_LINE, footprint) != 0) {
+        fprintf(stderr, "Out of memory\n");
+        return 0;
+    }
+    if (version == 2) {
+        CharFifo2_Init(mem, ring_size);
+    } else {
+        CharFifo_Init(mem, ring_size);
+    }
+
+    producer.ring = consumer.ring = mem;
+    producer.total = consumer.total = total;
+    producer.chunk = consumer.chunk = chunk;
+    producer.errors = consumer.errors = 0;
+    producer.cpu = producer_cpu;
+    consumer.cpu = consumer_cpu;
+
+    start = NowSeconds();
+    pthread_create(&consumer_thread, NULL, version == 2 ? Consumer2 : Consumer1, &consumer);
+    pthread_create(&producer_thread, NULL, version == 2 ? Producer2 : Producer1, &producer);
+    pthread_join(producer_thread, NULL);
+    pthread_join(consumer_thread, NULL);
+    elapsed = NowSeconds() - start;
+    free(mem);
+
+    printf("v%d  ring %8zu  message %6zu  %9.1f MB/s  %7.2f M messages/s%s\n",
+           version, ring_size, chunk,
+           total / elapsed / 1e6,
+           (double)((total + chunk - 1) / chunk) / elapsed / 1e6,
+           consumer.errors ? "  CORRUPTED" : "");
+    return consumer.errors == 0;
+}
+
+int main(int argc, char **argv)
+{
+    static const size_t chunks[] = {8, 64, 512, 4096};
+    size_t total = (size_t)(argc > 1 ? atol(argv[1]) : 256) * 1024 * 1024;
+    size_t ring_size = argc > 2 ? (size_t)atol(argv[2]) : 16 * 1024;
+    int cross_core = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    int producer_cpu = argc > 3 ? atoi(argv[3]) : (cross_core ? 0 : -1);
+    int consumer_cpu = argc > 4 ? atoi(argv[4]) : (cross_core ? 1 : -1);
+    size_t i;
+    int ok = 1;
+
+    if (!cross_core) {
+        fprintf(stderr, "Only one CPU online, both sides share it\n");
+    }
+
+    for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+        if (chunks[i] >= ring_size) {
+            continue;
+        }
+        ok &= Run(1, total, ring_size, chunks[i], producer_cpu, consumer_cpu);
+        ok &= Run(2, total, ring_size, chunks[i], producer_cpu, consumer_cpu);
+    }
+    return ok ? 0 : 1;
+}
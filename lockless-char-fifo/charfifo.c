@@ -28,6 +28,12 @@ inline static size_t aget(size_t *p)
     return atomic_load_explicit(p, memory_order_relaxed);
 }
 
+size_t CharFifo_Footprint(size_t size)
+{
+    size_t bytes = sizeof(charfifo_header_t) + size + 1;
+    return (bytes + 7) & ~(size_t)7; /* same padding as the aligned(8) CHARFIFO */
+}
+
 void CharFifo_Init(volatile void *charfifo, size_t size)
 {
     EXTRACT_HEADER(charfifo);
@@ -130,3 +136,79 @@ void CharFifo_Read(volatile void *charfifo, char *buf, size_t btr) {
             FIFO_TO_BUF);
 }
 
+size_t CharFifo_Peek(volatile void *charfifo, const char **buf) {
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t read_idx = aget(&header->read_idx);
+    size_t write_idx = atomic_load_explicit(&header->write_idx, memory_order_acquire);
+    *buf = (const char*)fifo_buf + read_idx;
+    if (write_idx >= read_idx) {
+        return write_idx - read_idx;
+    }
+    return header->size - read_idx;
+}
+
+void CharFifo_Consume(volatile void *charfifo, size_t btr) {
+    EXTRACT_HEADER(charfifo);
+    size_t read_idx = aget(&header->read_idx) + btr;
+    if (read_idx >= header->size) {
+        read_idx -= header->size;
+    }
+    atomic_store_explicit(&header->read_idx, read_idx, memory_order_release);
+}
+
+size_t CharFifo_Reserve(volatile void *charfifo, char **buf) {
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t write_idx = aget(&header->write_idx);
+    size_t read_idx = atomic_load_explicit(&header->read_idx, memory_order_acquire);
+    *buf = (char*)fifo_buf + write_idx;
+    if (read_idx > write_idx) {
+        return read_idx - write_idx - 1;
+    }
+    /* One byte always stays free, so write_idx never catches up read_idx. */
+    return header->size - write_idx - (read_idx == 0 ? 1 : 0);
+}
+
+void CharFifo_Commit(volatile void *charfifo, size_t btw) {
+    EXTRACT_HEADER(charfifo);
+    size_t write_idx = aget(&header->write_idx) + btw;
+    if (write_idx >= header->size) {
+        write_idx -= header->size;
+    }
+    atomic_store_explicit(&header->write_idx, write_idx, memory_order_release);
+}
+
+/* Splits 'bytes' starting 'offset' past 'idx' at the buffer end. */
+static inline size_t Spans(volatile char *v_fifo_buf, size_t idx, size_t offset,
+        size_t bytes, size_t size, charfifo_span_t spans[2])
+{
+    char* fifo_buf = (char*)v_fifo_buf;
+    size_t start = idx + offset;
+    if (start >= size) {
+        start -= size;
+    }
+    spans[0].buf = fifo_buf + start;
+    spans[0].len = bytes < size - start ? bytes : size - start;
+    spans[1].buf = fifo_buf;
+    spans[1].len = bytes - spans[0].len;
+    return bytes;
+}
+
+size_t CharFifo_PeekSpans(volatile void *charfifo, size_t offset, charfifo_span_t spans[2]) {
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t read_idx = aget(&header->read_idx);
+    size_t write_idx = atomic_load_explicit(&header->write_idx, memory_order_acquire);
+    size_t used = WraparoundDiff(read_idx, write_idx, header->size, 0);
+    return Spans(fifo_buf, read_idx, offset, used - offset, header->size, spans);
+}
+
+size_t CharFifo_ReserveSpans(volatile void *charfifo, size_t offset, charfifo_span_t spans[2]) {
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t write_idx = aget(&header->write_idx);
+    size_t read_idx = atomic_load_explicit(&header->read_idx, memory_order_acquire);
+    size_t free = WraparoundDiff(write_idx, read_idx, header->size, 1);
+    return Spans(fifo_buf, write_idx, offset, free - offset, header->size, spans);
+}
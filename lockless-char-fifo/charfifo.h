@@ -24,6 +24,9 @@ typedef struct {
         char buf[size + 1];                                                    \
     } __attribute__((aligned(8))) /* aligned for atomic instructions */
 
+// Bytes occupied by a CHARFIFO(size), for laying out buffers at run time.
+size_t CharFifo_Footprint(size_t size);
+
 void CharFifo_Init(volatile void *charfifo, size_t size);
 
 size_t CharFifo_FreeSpace(volatile void *charfifo);
@@ -32,5 +35,34 @@ void CharFifo_Write(volatile void *charfifo, const char *buf, size_t btw); // do
 size_t CharFifo_UsedSpace(volatile void *charfifo);
 void CharFifo_Read(volatile void *charfifo, char *buf, size_t btr); // does not check used space!
 
+// Zero-copy reading. Peek points *buf at the used bytes up to the end of the
+// buffer and returns their count, the rest (if wrapped) follows from the
+// buffer beginning. Consume then releases bytes, like Read without the copy.
+size_t CharFifo_Peek(volatile void *charfifo, const char **buf);
+void CharFifo_Consume(volatile void *charfifo, size_t btr); // does not check used space!
+
+// Zero-copy writing. Reserve points *buf at the free bytes up to the end of
+// the buffer and returns their count. Commit then publishes bytes written 
+// there, like Write without the copy.
+size_t CharFifo_Reserve(volatile void *charfifo, char **buf);
+void CharFifo_Commit(volatile void *charfifo, size_t btw); // does not check free space!
+
+// A run of bytes in the buffer.
+typedef struct {
+    char *buf;
+    size_t len;
+} charfifo_span_t;
+
+// Zero-copy access to all of the used (or free) bytes, skipping the first
+// 'offset' of them: spans[0] runs up to the buffer end, and spans[1] holds
+// the rest from the buffer beginning, empty unless wrapped. Returns the
+// total of both. With 'offset' counting bytes already parsed (or written)
+// but not yet consumed (or committed), several messages can be handled
+// before publishing a single index update with Consume (or Commit). When
+// the buffer is mapped twice back to back, spans[1] continues spans[0] in
+// memory, so the two form a single span.
+size_t CharFifo_PeekSpans(volatile void *charfifo, size_t offset, charfifo_span_t spans[2]);
+size_t CharFifo_ReserveSpans(volatile void *charfifo, size_t offset, charfifo_span_t spans[2]);
+
 
 #endif /* LOCKLESS_CHAR_FIFO_CHARFIFO_H_ */
@@ -0,0 +1,212 @@
+/*
+ * charfifo2.c
+ *
+ * See charfifo2.h for how it differs from charfifo.c.
+ */
+
+
+#include "charfifo2.h"
+
+#include <sys/types.h>
+#include <string.h>
+#include <stdatomic.h>
+
+
+#define EXTRACT_HEADER(p) \
+    charfifo2_header_t *header = (charfifo2_header_t*)p;
+
+#define EXTRACT_FIFO_BUF(p) \
+    char* fifo_buf = (char*)p + sizeof(charfifo2_header_t);
+
+/* Own index, only this side writes it. */
+inline static size_t aget(size_t *p)
+{
+    return atomic_load_explicit(p, memory_order_relaxed);
+}
+
+/* Peer's index, pairs with the release store publishing it. */
+inline static size_t aget_peer(size_t *p)
+{
+    return atomic_load_explicit(p, memory_order_acquire);
+}
+
+size_t CharFifo2_Footprint(size_t size)
+{
+    size_t bytes = sizeof(charfifo2_header_t) + size;
+    return (bytes + CHARFIFO2_CACHE_LINE - 1) & ~(size_t)(CHARFIFO2_CACHE_LINE - 1);
+}
+
+void CharFifo2_Init(volatile void *charfifo, size_t size)
+{
+    EXTRACT_HEADER(charfifo);
+    memset(header, 0, sizeof(*header));
+    header->size = size;
+    __sync_synchronize();
+}
+
+// Same as in charfifo.c.
+inline static size_t WraparoundDiff(size_t start_idx, size_t end_idx, size_t size, size_t stop_padding)
+{
+    ssize_t diff = (ssize_t) end_idx - start_idx - stop_padding;
+    if (end_idx < start_idx + stop_padding) {
+        diff = diff + size;
+    }
+    return diff;
+}
+
+size_t CharFifo2_FreeSpace(volatile void *charfifo, size_t want)
+{
+    EXTRACT_HEADER(charfifo);
+    size_t write_idx = aget(&header->write_idx);
+    size_t free = WraparoundDiff(write_idx, header->cached_read_idx, header->size, 1);
+    if (free < want) {
+        header->cached_read_idx = aget_peer(&header->read_idx);
+        free = WraparoundDiff(write_idx, header->cached_read_idx, header->size, 1);
+    }
+    return free;
+}
+
+size_t CharFifo2_UsedSpace(volatile void *charfifo, size_t want)
+{
+    EXTRACT_HEADER(charfifo);
+    size_t read_idx = aget(&header->read_idx);
+    size_t used = WraparoundDiff(read_idx, header->cached_write_idx, header->size, 0);
+    if (used < want) {
+        header->cached_write_idx = aget_peer(&header->write_idx);
+        used = WraparoundDiff(read_idx, header->cached_write_idx, header->size, 0);
+    }
+    return used;
+}
+
+/* Moves *p_idx forward by 'bytes', wrapping at 'size'. */
+inline static void Advance(size_t *p_idx, size_t bytes, size_t size)
+{
+    size_t idx = aget(p_idx) + bytes;
+    if (idx >= size) {
+        idx -= size;
+    }
+    atomic_store_explicit(p_idx, idx, memory_order_release);
+}
+
+void CharFifo2_Write(volatile void *charfifo, const char *buf, size_t btw)
+{
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t write_idx = aget(&header->write_idx);
+    size_t bytes_to_eob = header->size - write_idx;
+    if (btw > bytes_to_eob) {
+        memcpy(fifo_buf + write_idx, buf, bytes_to_eob);
+        memcpy(fifo_buf, buf + bytes_to_eob, btw - bytes_to_eob);
+    } else {
+        memcpy(fifo_buf + write_idx, buf, btw);
+    }
+    Advance(&header->write_idx, btw, header->size);
+}
+
+void CharFifo2_Read(volatile void *charfifo, char *buf, size_t btr)
+{
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t read_idx = aget(&header->read_idx);
+    size_t bytes_to_eob = header->size - read_idx;
+    if (btr > bytes_to_eob) {
+        memcpy(buf, fifo_buf + read_idx, bytes_to_eob);
+        memcpy(buf + bytes_to_eob, fifo_buf, btr - bytes_to_eob);
+    } else {
+        memcpy(buf, fifo_buf + read_idx, btr);
+    }
+    Advance(&header->read_idx, btr, header->size);
+}
+
+size_t CharFifo2_Peek(volatile void *charfifo, const char **buf)
+{
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t read_idx = aget(&header->read_idx);
+    size_t write_idx = header->cached_write_idx;
+    if (write_idx == read_idx) {
+        write_idx = header->cached_write_idx = aget_peer(&header->write_idx);
+    }
+    *buf = fifo_buf + read_idx;
+    if (write_idx >= read_idx) {
+        return write_idx - read_idx;
+    }
+    return header->size - read_idx;
+}
+
+void CharFifo2_Consume(volatile void *charfifo, size_t btr)
+{
+    EXTRACT_HEADER(charfifo);
+    Advance(&header->read_idx, btr, header->size);
+}
+
+/* Contiguous free bytes at write_idx, if read_idx is where the reader is. */
+inline static size_t ContiguousFree(size_t write_idx, size_t read_idx, size_t size)
+{
+    if (read_idx > write_idx) {
+        return read_idx - write_idx - 1;
+    }
+    /* One byte always stays free, so write_idx never catches up read_idx. */
+    return size - write_idx - (read_idx == 0 ? 1 : 0);
+}
+
+size_t CharFifo2_Reserve(volatile void *charfifo, char **buf, size_t want)
+{
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t write_idx = aget(&header->write_idx);
+    size_t free = ContiguousFree(write_idx, header->cached_read_idx, header->size);
+    if (free < want) {
+        header->cached_read_idx = aget_peer(&header->read_idx);
+        free = ContiguousFree(write_idx, header->cached_read_idx, header->size);
+    }
+    *buf = fifo_buf + write_idx;
+    return free;
+}
+
+void CharFifo2_Commit(volatile void *charfifo, size_t btw)
+{
+    EXTRACT_HEADER(charfifo);
+    Advance(&header->write_idx, btw, header->size);
+}
+
+/* Splits 'bytes' starting 'offset' past 'idx' at the buffer end. */
+inline static size_t Spans(char *fifo_buf, size_t idx, size_t offset,
+        size_t bytes, size_t size, charfifo_span_t spans[2])
+{
+    size_t start = idx + offset;
+    if (start >= size) {
+        start -= size;
+    }
+    spans[0].buf = fifo_buf + start;
+    spans[0].len = bytes < size - start ? bytes : size - start;
+    spans[1].buf = fifo_buf;
+    spans[1].len = bytes - spans[0].len;
+    return bytes;
+}
+
+size_t CharFifo2_PeekSpans(volatile void *charfifo, size_t offset, charfifo_span_t spans[2])
+{
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t read_idx = aget(&header->read_idx);
+    size_t used = WraparoundDiff(read_idx, header->cached_write_idx, header->size, 0);
+    if (used <= offset) {
+        header->cached_write_idx = aget_peer(&header->write_idx);
+        used = WraparoundDiff(read_idx, header->cached_write_idx, header->size, 0);
+    }
+    return Spans(fifo_buf, read_idx, offset, used - offset, header->size, spans);
+}
+
+size_t CharFifo2_ReserveSpans(volatile void *charfifo, size_t offset, size_t want, charfifo_span_t spans[2])
+{
+    EXTRACT_HEADER(charfifo);
+    EXTRACT_FIFO_BUF(charfifo);
+    size_t write_idx = aget(&header->write_idx);
+    size_t free = WraparoundDiff(write_idx, header->cached_read_idx, header->size, 1);
+    if (free < offset + want) {
+        header->cached_read_idx = aget_peer(&header->read_idx);
+        free = WraparoundDiff(write_idx, header->cached_read_idx, header->size, 1);
+    }
+    return Spans(fifo_buf, write_idx, offset, free - offset, header->size, spans);
+}
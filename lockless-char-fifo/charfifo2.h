@@ -0,0 +1,71 @@
+/*
+ * charfifo2.h
+ *
+ * Version 2 of the char FIFO. Same semantics as charfifo.h, but the header
+ * keeps the producer's and the consumer's index on separate cache lines, each
+ * next to a private copy of the peer's index. Free and used space come from
+ * that copy, and the peer's line is only loaded when the copy says the ring
+ * is too full or too empty. A side that keeps up with its peer then touches
+ * the other line about once per lap instead of on every call.
+ *
+ * Because of the cached copies, the producer calls only FreeSpace, Write,
+ * Reserve and Commit, and the consumer calls only UsedSpace, Read, Peek and
+ * Consume.
+ */
+
+#ifndef LOCKLESS_CHAR_FIFO_CHARFIFO2_H_
+#define LOCKLESS_CHAR_FIFO_CHARFIFO2_H_
+
+#include <stdlib.h>
+
+#include "charfifo.h" /* charfifo_span_t */
+
+#define CHARFIFO2_CACHE_LINE 64
+
+typedef struct {
+    /* Written by the producer. */
+    size_t write_idx;
+    size_t cached_read_idx;
+    char pad_producer[CHARFIFO2_CACHE_LINE - 2*sizeof(size_t)];
+    /* Written by the consumer. */
+    size_t read_idx;
+    size_t cached_write_idx;
+    char pad_consumer[CHARFIFO2_CACHE_LINE - 2*sizeof(size_t)];
+    /* Read-only after init. */
+    size_t size;
+    char pad_size[CHARFIFO2_CACHE_LINE - sizeof(size_t)];
+} charfifo2_header_t;
+
+// Bytes occupied by a ring of 'size', a multiple of the cache line. The ring
+// itself must start on a cache line.
+size_t CharFifo2_Footprint(size_t size);
+
+void CharFifo2_Init(volatile void *charfifo, size_t size);
+
+// Return at least 'want' bytes if that many are free (or used), and possibly
+// less than there really are otherwise. The peer's index is only reloaded
+// when the cached copy falls short of 'want'.
+size_t CharFifo2_FreeSpace(volatile void *charfifo, size_t want);
+void CharFifo2_Write(volatile void *charfifo, const char *buf, size_t btw); // does not check free space!
+
+size_t CharFifo2_UsedSpace(volatile void *charfifo, size_t want);
+void CharFifo2_Read(volatile void *charfifo, char *buf, size_t btr); // does not check used space!
+
+// Zero-copy reading, as CharFifo_Peek. The write index is only reloaded when
+// the cached copy says the ring is empty.
+size_t CharFifo2_Peek(volatile void *charfifo, const char **buf);
+void CharFifo2_Consume(volatile void *charfifo, size_t btr); // does not check used space!
+
+// Zero-copy writing, as CharFifo_Reserve. The read index is only reloaded
+// when the cached copy leaves less than 'want' contiguous bytes.
+size_t CharFifo2_Reserve(volatile void *charfifo, char **buf, size_t want);
+void CharFifo2_Commit(volatile void *charfifo, size_t btw); // does not check free space!
+
+// Zero-copy access across the wraparound, as CharFifo_PeekSpans and
+// CharFifo_ReserveSpans. The peer's index is only reloaded when the cached
+// copy leaves nothing past 'offset' to peek, or less than 'want' to reserve.
+size_t CharFifo2_PeekSpans(volatile void *charfifo, size_t offset, charfifo_span_t spans[2]);
+size_t CharFifo2_ReserveSpans(volatile void *charfifo, size_t offset, size_t want, charfifo_span_t spans[2]);
+
+
+#endif /* LOCKLESS_CHAR_FIFO_CHARFIFO2_H_ */
@@ -0,0 +1,297 @@
+/* A thread serving the shared memory of many async contexts for hiredis.
+ *
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2014, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <pthread.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "async.h"
+#include "shm.h"
+
+/* A direct poller looks at the socket of an initialized context this often,
+ * to notice a server gone without a heartbeat. */
+#define POLLER_SOCKET_CHECK_NS 100000000LL
+
+typedef struct pollerEntry {
+    redisAsyncContext *ac; /* NULL once removed, until compacted. */
+    long long next_socket_check;
+} pollerEntry;
+
+struct redisSharedMemoryPoller {
+    pthread_t thread;
+    pthread_mutex_t lock; /* Recursive, callbacks run under it. */
+    int flags;
+    long long idle_ns;
+    long long nap_ns;
+    pollerEntry *entries;
+    size_t len;
+    size_t cap;
+    int removed; /* Some entries are NULL. */
+    uint32_t stop;
+    uint32_t waiters; /* Threads blocked in redisSharedMemoryPollerLock. */
+    /* One for redisSharedMemoryPollerFree, and one per attached context, so
+     * a context being freed can still lock the poller. */
+    uint32_t refs;
+};
+
+static long long pollerNowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static void pollerCompact(redisSharedMemoryPoller *p) {
+    size_t i, j = 0;
+
+    for (i = 0; i < p->len; i++) {
+        if (p->entries[i].ac != NULL)
+            p->entries[j++] = p->entries[i];
+    }
+    p->len = j;
+    p->removed = 0;
+}
+
+/* Until the SHM.OPEN reply, and now and then after, the socket is polled
+ * without waiting, and the context handles whatever it is ready for. */
+static int pollerCheckSocket(pollerEntry *e, long long now) {
+    redisAsyncContext *ac = e->ac;
+    redisContext *c = &ac->c;
+    struct pollfd pfd;
+
+    if (sharedMemoryIsInitialized(c)) {
+        if (now < e->next_socket_check)
+            return 0;
+        e->next_socket_check = now + POLLER_SOCKET_CHECK_NS;
+        /* Reading checks the socket once the ring turns out empty. */
+        redisAsyncHandleRead(ac);
+        return 0;
+    }
+
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    if (!(c->flags & REDIS_CONNECTED) || sdslen(c->obuf) > 0)
+        pfd.events |= POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0)
+        return 0;
+    if (pfd.revents & (POLLOUT|POLLERR|POLLHUP)) {
+        redisAsyncHandleWrite(ac);
+        /* The context may be gone. */
+        if (e->ac != ac)
+            return 1;
+    }
+    if (pfd.revents & (POLLIN|POLLERR|POLLHUP))
+        redisAsyncHandleRead(ac);
+    return 1;
+}
+
+/* Runs one round over the contexts, returns whether any had traffic. Callbacks
+ * may add and remove contexts, so entries are reloaded after each call. */
+static int pollerRound(redisSharedMemoryPoller *p, long long now) {
+    redisAsyncContext *ac;
+    int active = 0;
+    size_t i;
+
+    for (i = 0; i < p->len; i++) {
+        if ((ac = p->entries[i].ac) == NULL)
+            continue;
+        if (!(p->flags & SHARED_MEMORY_POLLER_DIRECT)) {
+            active |= sharedMemoryPollerNotify(&ac->c);
+            continue;
+        }
+        if (sharedMemoryPollerHasCommands(&ac->c)) {
+            redisAsyncHandleWrite(ac);
+            active = 1;
+        }
+        if (p->entries[i].ac == ac && sharedMemoryHasReplies(&ac->c)) {
+            redisAsyncHandleRead(ac);
+            active = 1;
+        }
+        if (p->entries[i].ac == ac)
+            active |= pollerCheckSocket(&p->entries[i], now);
+    }
+    if (p->removed)
+        pollerCompact(p);
+    return active;
+}
+
+/* Spins as long as there was traffic within idle_ns, and naps between
+ * rounds after, so an idle process does not keep a core busy. */
+static void *pollerMain(void *privdata) {
+    redisSharedMemoryPoller *p = privdata;
+    long long now, last_active = pollerNowNs();
+    struct timespec nap;
+
+    nap.tv_sec = p->nap_ns / 1000000000LL;
+    nap.tv_nsec = p->nap_ns % 1000000000LL;
+    while (!atomic_load_explicit(&p->stop, memory_order_acquire)) {
+        now = pollerNowNs();
+        pthread_mutex_lock(&p->lock);
+        if (pollerRound(p, now))
+            last_active = now;
+        pthread_mutex_unlock(&p->lock);
+
+        /* The mutex is not fair, hand it over to whoever waits for it. */
+        while (atomic_load_explicit(&p->waiters, memory_order_relaxed) > 0)
+            sched_yield();
+        if (now - last_active > p->idle_ns)
+            nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+redisSharedMemoryPoller *redisSharedMemoryPollerCreate(const redisSharedMemoryPollerOptions *options) {
+    redisSharedMemoryPoller *p;
+    pthread_mutexattr_t attr;
+
+    p = hi_calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    if (options != NULL) {
+        p->flags = options->flags;
+        p->idle_ns = options->idle_ns;
+        p->nap_ns = options->nap_ns;
+    }
+    if (p->idle_ns <= 0)
+        p->idle_ns = SHARED_MEMORY_POLLER_DEFAULT_IDLE_NS;
+    if (p->nap_ns <= 0)
+        p->nap_ns = SHARED_MEMORY_POLLER_DEFAULT_NAP_NS;
+    p->refs = 1;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&p->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (pthread_create(&p->thread, NULL, pollerMain, p) != 0) {
+        pthread_mutex_destroy(&p->lock);
+        hi_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+int redisSharedMemoryPollerAdd(redisSharedMemoryPoller *p, redisAsyncContext *ac) {
+    pollerEntry *entries;
+    size_t cap;
+    int status = REDIS_ERR;
+
+    redisSharedMemoryPollerLock(p);
+    if (p->removed)
+        pollerCompact(p);
+    if (p->len == p->cap) {
+        cap = p->cap ? p->cap * 2 : 8;
+        entries = hi_realloc(p->entries, cap * sizeof(*entries));
+        if (entries == NULL)
+            goto out;
+        p->entries = entries;
+        p->cap = cap;
+    }
+    /* Taken first, a context can be freed as soon as it is attached. */
+    atomic_fetch_add_explicit(&p->refs, 1, memory_order_relaxed);
+    if (sharedMemoryPollerAttach(&ac->c, p, p->flags & SHARED_MEMORY_POLLER_DIRECT) != REDIS_OK) {
+        atomic_fetch_sub_explicit(&p->refs, 1, memory_order_relaxed);
+        goto out;
+    }
+    p->entries[p->len].ac = ac;
+    p->entries[p->len].next_socket_check = 0;
+    p->len++;
+    status = REDIS_OK;
+out:
+    redisSharedMemoryPollerUnlock(p);
+    return status;
+}
+
+void sharedMemoryPollerForget(redisSharedMemoryPoller *p, redisContext *c) {
+    size_t i;
+
+    redisSharedMemoryPollerLock(p);
+    for (i = 0; i < p->len; i++) {
+        if (p->entries[i].ac != NULL && &p->entries[i].ac->c == c) {
+            /* Compacted after the round, which may be iterating. */
+            p->entries[i].ac = NULL;
+            p->removed = 1;
+            break;
+        }
+    }
+    redisSharedMemoryPollerUnlock(p);
+}
+
+void redisSharedMemoryPollerRemove(redisSharedMemoryPoller *p, redisAsyncContext *ac) {
+    redisSharedMemoryPollerLock(p);
+    if (sharedMemoryPoller(&ac->c) == p) {
+        sharedMemoryPollerForget(p, &ac->c);
+        sharedMemoryPollerDetach(&ac->c);
+    }
+    redisSharedMemoryPollerUnlock(p);
+}
+
+void redisSharedMemoryPollerLock(redisSharedMemoryPoller *p) {
+    atomic_fetch_add_explicit(&p->waiters, 1, memory_order_relaxed);
+    pthread_mutex_lock(&p->lock);
+    atomic_fetch_sub_explicit(&p->waiters, 1, memory_order_relaxed);
+}
+
+void redisSharedMemoryPollerUnlock(redisSharedMemoryPoller *p) {
+    pthread_mutex_unlock(&p->lock);
+}
+
+void sharedMemoryPollerRelease(redisSharedMemoryPoller *p) {
+    if (atomic_fetch_sub_explicit(&p->refs, 1, memory_order_acq_rel) != 1)
+        return;
+    pthread_mutex_destroy(&p->lock);
+    hi_free(p->entries);
+    hi_free(p);
+}
+
+/* Contexts freed meanwhile on their event loops either left already, or wait
+ * for the lock with a reference of their own, or wait for their detach. */
+void redisSharedMemoryPollerFree(redisSharedMemoryPoller *p) {
+    size_t i;
+
+    if (p == NULL)
+        return;
+    atomic_store_explicit(&p->stop, 1, memory_order_release);
+    pthread_join(p->thread, NULL);
+    redisSharedMemoryPollerLock(p);
+    for (i = 0; i < p->len; i++) {
+        if (p->entries[i].ac != NULL)
+            sharedMemoryPollerDetach(&p->entries[i].ac->c);
+    }
+    p->len = 0;
+    redisSharedMemoryPollerUnlock(p);
+    sharedMemoryPollerRelease(p);
+}
@@ -50,6 +50,74 @@
 /* Initial size of our nested reply stack and how much we grow it when needd */
 #define REDIS_READER_STACK_SIZE 9
 
+/* Type of an out-of-band string task, until its string is created. */
+#define REDIS_READER_OOB_STRING 64
+
+/* Strings lent out of buf stay where they are, so there is nothing to
+ * release. */
+static void releaseSlice(redisLease *lease) {
+    (void)lease;
+}
+
+static redisLease sliceLease = { releaseSlice };
+
+/* Strings lent by the last reply are no longer in use. */
+static void redisReaderUnpin(redisReader *r) {
+    size_t i;
+
+    for (i = 0; i < r->retired_len; i++)
+        sdsfree(r->retired[i]);
+    r->retired_len = 0;
+    r->pinned = 0;
+}
+
+static int redisReaderCompact(redisReader *r) {
+    if (sdsrange(r->buf,r->pos,-1) < 0)
+        return REDIS_ERR;
+    r->pos = 0;
+    r->len = sdslen(r->buf);
+    r->compactions++;
+    return REDIS_OK;
+}
+
+/* Once the reader is used again after a reply, the strings it lent are no
+ * longer in use, and the buffer gets the compaction they put off. */
+static int redisReaderSlicesDone(redisReader *r) {
+    if (r->ridx != -1 || (!r->pinned && r->retired_len == 0))
+        return REDIS_OK;
+    redisReaderUnpin(r);
+    if (r->pos >= 1024 && r->pos >= r->len - r->pos)
+        return redisReaderCompact(r);
+    return REDIS_OK;
+}
+
+/* Moves what is left to parse to a new buffer, keeping the current one and
+ * the strings borrowed from it where they are. */
+static int redisReaderRetire(redisReader *r) {
+    char **retired;
+    size_t cap;
+    sds newbuf;
+
+    if (r->retired_len == r->retired_cap) {
+        cap = r->retired_cap ? r->retired_cap * 2 : 4;
+        retired = hi_realloc(r->retired, cap * sizeof(*retired));
+        if (retired == NULL)
+            return REDIS_ERR;
+        r->retired = retired;
+        r->retired_cap = cap;
+    }
+
+    newbuf = sdsnewlen(r->buf+r->pos,r->len-r->pos);
+    if (newbuf == NULL)
+        return REDIS_ERR;
+    r->retired[r->retired_len++] = r->buf;
+    r->buf = newbuf;
+    r->pos = 0;
+    r->len = sdslen(r->buf);
+    r->pinned = 0;
+    return REDIS_OK;
+}
+
 static void __redisReaderSetError(redisReader *r, int type, const char *str) {
     size_t len;
 
@@ -57,14 +125,17 @@ static void __redisReaderSetError(redisReader *r, int type, const char *str) {
         r->fn->freeObject(r->reply);
         r->reply = NULL;
     }
+    redisReaderUnpin(r);
 
     /* Clear input buffer on errors. */
-    sdsfree(r->buf);
+    if (!r->borrowed)
+        sdsfree(r->buf);
     r->buf = NULL;
     r->pos = r->len = 0;
 
     /* Reset task stack. */
     r->ridx = -1;
+    r->streaming = 0;
 
     /* Set error. */
     r->err = type;
@@ -222,6 +293,41 @@ static int string2ll(const char *s, size_t slen, long long *value) {
     return REDIS_OK;
 }
 
+/* Finds the \r\n ending a line holding a decimal, such as a length or an
+ * integer reply, and parses it as string2ll does. Returns the \r\n, or NULL
+ * when it is not in the buffer yet, with *valid telling whether the line is
+ * a long long.
+ *
+ * These lines come with every element of a reply and are mostly a few
+ * digits, so up to 18 digits, which cannot overflow, are parsed on the way to
+ * their \r\n. Anything else, "0" included, takes seekNewline and string2ll. */
+static char *seekNewlineLL(char *s, size_t len, long long *value, int *valid) {
+    char *p = s, *end = s+len, *limit;
+    unsigned long long v;
+    int negative = 0;
+
+    if (p < end && *p == '-') {
+        negative = 1;
+        p++;
+    }
+    if (p < end && *p >= '1' && *p <= '9') {
+        limit = end-p > 18 ? p+18 : end;
+        v = *p++ - '0';
+        while (p < limit && *p >= '0' && *p <= '9')
+            v = v*10 + (*p++ - '0');
+        if (end-p >= 2 && p[0] == '\r' && p[1] == '\n') {
+            *value = negative ? -(long long)v : (long long)v;
+            *valid = 1;
+            return p;
+        }
+    }
+
+    p = seekNewline(s,len);
+    if (p != NULL)
+        *valid = string2ll(s,p-s,value) == REDIS_OK;
+    return p;
+}
+
 static char *readLine(redisReader *r, int *_len) {
     char *p, *s;
     int len;
@@ -237,6 +343,22 @@ static char *readLine(redisReader *r, int *_len) {
     return NULL;
 }
 
+/* readLine for a line holding a long long, see seekNewlineLL. */
+static char *readLineLL(redisReader *r, int *_len, long long *value, int *valid) {
+    char *p, *s;
+    int len;
+
+    p = r->buf+r->pos;
+    s = seekNewlineLL(p,(r->len-r->pos),value,valid);
+    if (s != NULL) {
+        len = s-(r->buf+r->pos);
+        r->pos += len+2; /* skip \r\n */
+        if (_len) *_len = len;
+        return p;
+    }
+    return NULL;
+}
+
 static void moveToNextTask(redisReader *r) {
     redisReadTask *cur, *prv;
     while (r->ridx >= 0) {
@@ -269,13 +391,17 @@ static int processLineItem(redisReader *r) {
     redisReadTask *cur = r->task[r->ridx];
     void *obj;
     char *p;
-    int len;
+    long long v = 0;
+    int len, valid = 0;
 
-    if ((p = readLine(r,&len)) != NULL) {
-        if (cur->type == REDIS_REPLY_INTEGER) {
-            long long v;
+    if (cur->type == REDIS_REPLY_INTEGER)
+        p = readLineLL(r,&len,&v,&valid);
+    else
+        p = readLine(r,&len);
 
-            if (string2ll(p, len, &v) == REDIS_ERR) {
+    if (p != NULL) {
+        if (cur->type == REDIS_REPLY_INTEGER) {
+            if (!valid) {
                 __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
                         "Bad integer value");
                 return REDIS_ERR;
@@ -391,21 +517,66 @@ static int processLineItem(redisReader *r) {
     return REDIS_ERR;
 }
 
+/* Hands what the buffer holds of a streamed string to r->stream, and once
+ * it is all there, creates its reply. */
+static int processStreamedBulkItem(redisReader *r) {
+    redisReadTask *cur = r->task[r->ridx];
+    size_t n;
+    void *obj;
+
+    if (r->stream_left > 0) {
+        n = r->len - r->pos;
+        if (n == 0)
+            return REDIS_ERR;
+        if (n > r->stream_left)
+            n = r->stream_left;
+        r->stream_left -= n;
+        if (r->stream(r->streamdata,cur,r->buf+r->pos,n,r->stream_left) != REDIS_OK) {
+            __redisReaderSetError(r,REDIS_ERR_OTHER,"Bulk string stream failed");
+            return REDIS_ERR;
+        }
+        r->pos += n;
+    }
+
+    /* Wait for the \r\n after the string. */
+    if (r->stream_left > 0 || r->len - r->pos < 2)
+        return REDIS_ERR;
+    r->pos += 2;
+    r->streaming = 0;
+
+    if (r->fn && r->fn->createString)
+        obj = r->fn->createString(cur,(char*)"",0);
+    else
+        obj = (void*)REDIS_REPLY_STRING;
+    if (obj == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return REDIS_ERR;
+    }
+
+    /* Set reply if this is the root object. */
+    if (r->ridx == 0) r->reply = obj;
+    moveToNextTask(r);
+    return REDIS_OK;
+}
+
 static int processBulkItem(redisReader *r) {
     redisReadTask *cur = r->task[r->ridx];
+    redisLease *lease;
     void *obj = NULL;
     char *p, *s;
     long long len;
     unsigned long bytelen;
-    int success = 0;
+    int success = 0, valid = 0;
+
+    if (r->streaming)
+        return processStreamedBulkItem(r);
 
     p = r->buf+r->pos;
-    s = seekNewline(p,r->len-r->pos);
+    s = seekNewlineLL(p,r->len-r->pos,&len,&valid);
     if (s != NULL) {
-        p = r->buf+r->pos;
         bytelen = s-(r->buf+r->pos)+2; /* include \r\n */
 
-        if (string2ll(p, bytelen - 2, &len) == REDIS_ERR) {
+        if (!valid) {
             __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
                     "Bad bulk string length");
             return REDIS_ERR;
@@ -417,6 +588,15 @@ static int processBulkItem(redisReader *r) {
             return REDIS_ERR;
         }
 
+        if (r->stream && cur->type == REDIS_REPLY_STRING && len > 0 &&
+            (unsigned long long)len >= r->stream_min)
+        {
+            r->pos += bytelen;
+            r->streaming = 1;
+            r->stream_left = (size_t)len;
+            return processStreamedBulkItem(r);
+        }
+
         if (len == -1) {
             /* The nil object can always be created. */
             if (r->fn && r->fn->createNil)
@@ -436,7 +616,20 @@ static int processBulkItem(redisReader *r) {
                             "missing or incorrectly encoded.");
                     return REDIS_ERR;
                 }
-                if (r->fn && r->fn->createString)
+                if (r->borrowed && r->lend && r->fn && r->fn->createBorrowedString &&
+                    cur->type == REDIS_REPLY_STRING &&
+                    (lease = r->lend(r->lenddata,s+2,(size_t)len)) != NULL)
+                {
+                    obj = r->fn->createBorrowedString(cur,s+2,len,lease);
+                    if (obj == NULL)
+                        lease->release(lease);
+                } else if (r->slices && !r->borrowed && r->fn && r->fn->createBorrowedString &&
+                           cur->type == REDIS_REPLY_STRING)
+                {
+                    s[2+len] = '\0';
+                    obj = r->fn->createBorrowedString(cur,s+2,len,&sliceLease);
+                    r->pinned = 1;
+                } else if (r->fn && r->fn->createString)
                     obj = r->fn->createString(cur,s+2,len);
                 else
                     obj = (void*)(long)cur->type;
@@ -463,6 +656,63 @@ static int processBulkItem(redisReader *r) {
     return REDIS_ERR;
 }
 
+/* An out-of-band string is a line of the offset, length and generation the
+ * r->oob hook resolves, rather than the bytes themselves. */
+static int processOutOfBandItem(redisReader *r) {
+    redisReadTask *cur = r->task[r->ridx];
+    redisLease *lease;
+    long long v[3];
+    char *p, *end, *str;
+    void *obj;
+    int len, i, err;
+
+    if ((p = readLine(r,&len)) == NULL)
+        return REDIS_ERR;
+
+    for (i = 0; i < 3; i++) {
+        end = i < 2 ? memchr(p,',',len) : p+len;
+        if (end == NULL || string2ll(p,end-p,&v[i]) == REDIS_ERR || v[i] < 0) {
+            __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                    "Bad out-of-band string");
+            return REDIS_ERR;
+        }
+        len -= end-p+1;
+        p = end+1;
+    }
+
+    err = r->oob(r->oobdata,(size_t)v[0],(size_t)v[1],(unsigned long long)v[2],&str,&lease);
+    if (err != 0) {
+        if (err == REDIS_ERR_OOM)
+            __redisReaderSetErrorOOM(r);
+        else
+            __redisReaderSetError(r,err,"Invalid out-of-band string");
+        return REDIS_ERR;
+    }
+
+    cur->type = REDIS_REPLY_STRING;
+    if (r->fn && r->fn->createBorrowedString) {
+        obj = r->fn->createBorrowedString(cur,str,(size_t)v[1],lease);
+        if (obj == NULL)
+            lease->release(lease);
+    } else {
+        if (r->fn && r->fn->createString)
+            obj = r->fn->createString(cur,str,(size_t)v[1]);
+        else
+            obj = (void*)REDIS_REPLY_STRING;
+        lease->release(lease);
+    }
+
+    if (obj == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return REDIS_ERR;
+    }
+
+    /* Set reply if this is the root object. */
+    if (r->ridx == 0) r->reply = obj;
+    moveToNextTask(r);
+    return REDIS_OK;
+}
+
 static int redisReaderGrow(redisReader *r) {
     redisReadTask **aux;
     int newlen;
@@ -492,17 +742,16 @@ oom:
 static int processAggregateItem(redisReader *r) {
     redisReadTask *cur = r->task[r->ridx];
     void *obj;
-    char *p;
     long long elements;
-    int root = 0, len;
+    int root = 0, valid = 0;
 
     if (r->ridx == r->tasks - 1) {
         if (redisReaderGrow(r) == REDIS_ERR)
             return REDIS_ERR;
     }
 
-    if ((p = readLine(r,&len)) != NULL) {
-        if (string2ll(p, len, &elements) == REDIS_ERR) {
+    if (readLineLL(r,NULL,&elements,&valid) != NULL) {
+        if (!valid) {
             __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
                     "Bad multi-bulk length");
             return REDIS_ERR;
@@ -614,6 +863,12 @@ static int processItem(redisReader *r) {
             case '(':
                 cur->type = REDIS_REPLY_BIGNUM;
                 break;
+            case '&':
+                if (r->oob != NULL) {
+                    cur->type = REDIS_READER_OOB_STRING;
+                    break;
+                }
+                /* fall through */
             default:
                 __redisReaderSetErrorProtocolByte(r,*p);
                 return REDIS_ERR;
@@ -637,6 +892,8 @@ static int processItem(redisReader *r) {
     case REDIS_REPLY_STRING:
     case REDIS_REPLY_VERB:
         return processBulkItem(r);
+    case REDIS_READER_OOB_STRING:
+        return processOutOfBandItem(r);
     case REDIS_REPLY_ARRAY:
     case REDIS_REPLY_MAP:
     case REDIS_REPLY_SET:
@@ -696,54 +953,86 @@ void redisReaderFree(redisReader *r) {
         hi_free(r->task);
     }
 
+    redisReaderUnpin(r);
+    hi_free(r->retired);
     sdsfree(r->buf);
     hi_free(r);
 }
 
-int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
+char *redisReaderReserve(redisReader *r, size_t len) {
     sds newbuf;
 
     /* Return early when this reader is in an erroneous state. */
     if (r->err)
-        return REDIS_ERR;
+        return NULL;
 
-    /* Copy the provided buffer. */
-    if (buf != NULL && len >= 1) {
-        /* Destroy internal buffer when it is empty and is quite large. */
-        if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf) {
-            sdsfree(r->buf);
-            r->buf = sdsempty();
-            if (r->buf == 0) goto oom;
+    if (redisReaderSlicesDone(r) != REDIS_OK)
+        goto oom;
 
-            r->pos = 0;
+    if (sdsavail(r->buf) < len) {
+        /* Growing buf could move the strings the reply in progress borrows
+         * from it. */
+        if (r->pinned) {
+            if (redisReaderRetire(r) != REDIS_OK)
+                goto oom;
+        } else if (r->pos > 0) {
+            /* Moving what is left to parse costs less than growing would
+             * copy, and often makes enough room. */
+            if (redisReaderCompact(r) != REDIS_OK)
+                goto oom;
         }
+    }
 
-        newbuf = sdscatlen(r->buf,buf,len);
-        if (newbuf == NULL) goto oom;
+    /* Destroy internal buffer when it is empty and is quite large. */
+    if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf &&
+        sdsavail(r->buf) / 2 > len)
+    {
+        sdsfree(r->buf);
+        r->buf = sdsempty();
+        if (r->buf == 0) goto oom;
 
-        r->buf = newbuf;
-        r->len = sdslen(r->buf);
+        r->pos = 0;
     }
 
-    return REDIS_OK;
+    newbuf = sdsMakeRoomFor(r->buf,len);
+    if (newbuf == NULL) goto oom;
+    r->buf = newbuf;
+    return r->buf + r->len;
 oom:
     __redisReaderSetErrorOOM(r);
-    return REDIS_ERR;
+    return NULL;
 }
 
-int redisReaderGetReply(redisReader *r, void **reply) {
-    /* Default target pointer to NULL. */
-    if (reply != NULL)
-        *reply = NULL;
+void redisReaderCommit(redisReader *r, size_t len) {
+    r->len += len;
+    sdssetlen(r->buf,r->len);
+    r->buf[r->len] = '\0';
+}
+
+int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
+    char *dst;
 
     /* Return early when this reader is in an erroneous state. */
     if (r->err)
         return REDIS_ERR;
 
-    /* When the buffer is empty, there will never be a reply. */
-    if (r->len == 0)
-        return REDIS_OK;
+    /* Copy the provided buffer. */
+    if (buf != NULL && len >= 1) {
+        if ((dst = redisReaderReserve(r,len)) == NULL)
+            return REDIS_ERR;
+        memcpy(dst,buf,len);
+        redisReaderCommit(r,len);
+    } else if (redisReaderSlicesDone(r) != REDIS_OK) {
+        __redisReaderSetErrorOOM(r);
+        return REDIS_ERR;
+    }
 
+    return REDIS_OK;
+}
+
+/* Processes items from r->buf until a reply is complete or more input is
+ * needed. */
+static int redisReaderProcessItems(redisReader *r) {
     /* Set first item to process when the stack is empty. */
     if (r->ridx == -1) {
         r->task[0]->type = -1;
@@ -760,19 +1049,10 @@ int redisReaderGetReply(redisReader *r, void **reply) {
         if (processItem(r) != REDIS_OK)
             break;
 
-    /* Return ASAP when an error occurred. */
-    if (r->err)
-        return REDIS_ERR;
-
-    /* Discard part of the buffer when we've consumed at least 1k, to avoid
-     * doing unnecessary calls to memmove() in sds.c. */
-    if (r->pos >= 1024) {
-        if (sdsrange(r->buf,r->pos,-1) < 0) return REDIS_ERR;
-        r->pos = 0;
-        r->len = sdslen(r->buf);
-    }
+    return r->err ? REDIS_ERR : REDIS_OK;
+}
 
-    /* Emit a reply when there is one. */
+static void redisReaderEmitReply(redisReader *r, void **reply) {
     if (r->ridx == -1) {
         if (reply != NULL) {
             *reply = r->reply;
@@ -781,5 +1061,96 @@ int redisReaderGetReply(redisReader *r, void **reply) {
         }
         r->reply = NULL;
     }
+}
+
+int redisReaderGetReply(redisReader *r, void **reply) {
+    /* Default target pointer to NULL. */
+    if (reply != NULL)
+        *reply = NULL;
+
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return REDIS_ERR;
+
+    if (redisReaderSlicesDone(r) != REDIS_OK)
+        return REDIS_ERR;
+
+    /* When the buffer is empty, there will never be a reply. */
+    if (r->len == 0)
+        return REDIS_OK;
+
+    /* Return ASAP when an error occurred. */
+    if (redisReaderProcessItems(r) != REDIS_OK)
+        return REDIS_ERR;
+
+    /* Discard part of the buffer when we've consumed at least 1k, and no less
+     * than is left to parse, so a deep pipeline of buffered replies is moved
+     * a bounded number of times per byte. Not while strings are borrowed from
+     * it, the next call does. */
+    if (r->pos >= 1024 && r->pos >= r->len - r->pos && !r->pinned) {
+        if (redisReaderCompact(r) != REDIS_OK) return REDIS_ERR;
+    }
+
+    /* Emit a reply when there is one. */
+    redisReaderEmitReply(r,reply);
+    return REDIS_OK;
+}
+
+int redisReaderGetReplyFromBuffer(redisReader *r, const char *buf, size_t len,
+                                  size_t *consumed, void **reply) {
+    char *own;
+
+    /* Default target pointer to NULL. */
+    if (reply != NULL)
+        *reply = NULL;
+    *consumed = 0;
+
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return REDIS_ERR;
+
+    if (redisReaderSlicesDone(r) != REDIS_OK)
+        return REDIS_ERR;
+
+    /* Buffered input comes first, so parse behind it from a copy. Strings a
+     * reply in progress borrows from the buffer also keep it from being
+     * cleared. */
+    if (r->pos < r->len || r->pinned) {
+        if (redisReaderFeed(r,buf,len) != REDIS_OK)
+            return REDIS_ERR;
+        *consumed = len;
+        return redisReaderGetReply(r,reply);
+    }
+
+    if (len == 0)
+        return REDIS_OK;
+
+    /* Point the reader at buf for the duration of the parse. */
+    own = r->buf;
+    r->buf = (char*)buf;
+    r->pos = 0;
+    r->len = len;
+    r->borrowed = 1;
+    if (redisReaderProcessItems(r) != REDIS_OK) {
+        /* The error cleared the reader but left our buffer alone. */
+        r->borrowed = 0;
+        sdsfree(own);
+        return REDIS_ERR;
+    }
+    r->borrowed = 0;
+    *consumed = r->pos;
+    r->buf = own;
+    sdsclear(r->buf);
+    r->pos = r->len = 0;
+
+    /* What was parsed of an incomplete reply is already materialized, so only
+     * the rest needs to be kept. */
+    if (r->ridx != -1) {
+        if (redisReaderFeed(r,buf+*consumed,len-*consumed) != REDIS_OK)
+            return REDIS_ERR;
+        *consumed = len;
+    }
+
+    redisReaderEmitReply(r,reply);
     return REDIS_OK;
 }
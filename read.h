@@ -82,6 +82,12 @@ typedef struct redisReadTask {
     void *privdata; /* user-settable arbitrary field */
 } redisReadTask;
 
+/* Keeps the memory a borrowed reply string points into alive, until released
+ * by the reply's free function. */
+typedef struct redisLease {
+    void (*release)(struct redisLease *lease);
+} redisLease;
+
 typedef struct redisReplyObjectFunctions {
     void *(*createString)(const redisReadTask*, char*, size_t);
     void *(*createArray)(const redisReadTask*, size_t);
@@ -90,6 +96,10 @@ typedef struct redisReplyObjectFunctions {
     void *(*createNil)(const redisReadTask*);
     void *(*createBool)(const redisReadTask*, int);
     void (*freeObject)(void*);
+    /* Optional. Creates a string pointing into memory held by the lease
+     * instead of copying it. Without it, strings are copied by createString
+     * and the lease is released right away. */
+    void *(*createBorrowedString)(const redisReadTask*, char*, size_t, redisLease*);
 } redisReplyObjectFunctions;
 
 typedef struct redisReader {
@@ -110,14 +120,70 @@ typedef struct redisReader {
 
     redisReplyObjectFunctions *fn;
     void *privdata;
+
+    /* Resolves '&<offset>,<len>,<generation>' out-of-band strings, which are
+     * a protocol error without it. Returns 0 with *str and *lease set, or a
+     * REDIS_ERR_xxx type. Set for shared memory slabs, see shm.c. */
+    int (*oob)(void *oobdata, size_t offset, size_t len, unsigned long long generation,
+               char **str, redisLease **lease);
+    void *oobdata;
+
+    /* Lends a bulk string parsed in place out of a caller buffer, see
+     * redisReaderGetReplyFromBuffer, instead of having it copied. Returns a
+     * lease keeping str valid, or NULL to copy it. The hook may overwrite the
+     * '\r' after the string with a NUL. Only used with createBorrowedString,
+     * set for shared memory rings, see shm.c. */
+    redisLease *(*lend)(void *lenddata, char *str, size_t len);
+    void *lenddata;
+
+    /* Bulk strings point into buf instead of being copied, with the '\r'
+     * after them overwritten by a NUL. They are only valid until the next
+     * redisReaderFeed or redisReaderGetReply, which leave buf alone as long
+     * as the reply in progress borrows from it. Only used with
+     * createBorrowedString. */
+    int slices;
+
+    /* Streams bulk strings of at least stream_min bytes, and not empty,
+     * instead of buffering them whole. Called with each part of the string
+     * as it arrives and the bytes still to come after it, so 0 the last
+     * time. The string's reply is then created empty. Returns REDIS_OK, or
+     * REDIS_ERR to fail the reader. */
+    int (*stream)(void *streamdata, const redisReadTask *task, const char *chunk,
+                  size_t len, size_t left);
+    void *streamdata;
+    size_t stream_min;
+    int streaming; /* Within a streamed string, stream_left bytes to go. */
+    size_t stream_left;
+
+    int pinned; /* Strings borrowed from buf are still in use. */
+    char **retired; /* Earlier buffers the reply in progress borrows from. */
+    size_t retired_len;
+    size_t retired_cap;
+    int borrowed; /* buf is owned by the caller, see redisReaderGetReplyFromBuffer */
+    unsigned long long compactions; /* Times unparsed data moved to the front of buf */
 } redisReader;
 
 /* Public API for the protocol parser. */
 redisReader *redisReaderCreateWithFunctions(redisReplyObjectFunctions *fn);
 void redisReaderFree(redisReader *r);
 int redisReaderFeed(redisReader *r, const char *buf, size_t len);
+
+/* Feeds the reader without an intermediate copy: returns room for len bytes
+ * at the end of its buffer, or NULL on errors, and redisReaderCommit then
+ * adds the first len of them to the input. Reading from a socket straight
+ * into the reader this way is what redisBufferRead does. */
+char *redisReaderReserve(redisReader *r, size_t len);
+void redisReaderCommit(redisReader *r, size_t len);
 int redisReaderGetReply(redisReader *r, void **reply);
 
+/* Parses a reply straight out of buf instead of a copy fed to the reader, and
+ * sets *consumed to the bytes of buf used up. When buf ends inside a reply,
+ * the rest of buf is copied into the reader and *consumed is len, so the reply
+ * completes through redisReaderFeed and redisReaderGetReply. Input already
+ * buffered in the reader is parsed first, the same way. */
+int redisReaderGetReplyFromBuffer(redisReader *r, const char *buf, size_t len,
+                                  size_t *consumed, void **reply);
+
 #define redisReaderSetPrivdata(_r, _p) (int)(((redisReader*)(_r))->privdata = (_p))
 #define redisReaderGetObject(_r) (((redisReader*)(_r))->reply)
 #define redisReaderGetError(_r) (((redisReader*)(_r))->errstr)
@@ -0,0 +1,1020 @@
+/* A stand-in for Redis with redis-module-shm, so that the shared memory
+ * transport can be tested and benchmarked without either. It listens on a
+ * unix socket, opens the shared memory on SHM.OPEN the way the module does,
+ * in version 1 or 2 of the handshake, and serves PING, ECHO, GET, SET, DEL,
+ * INCR, RPUSH, LRANGE, KEYS and FLUSHALL out of an in-memory table.
+ *
+ * The server is single threaded. It polls the rings of all its clients in a
+ * loop, which spins while any of them has traffic, yielding now and then, and
+ * only checks the sockets every SERVER_POLL_SPINS rounds. Once no ring moved
+ * for SERVER_IDLE_NS, it sleeps in poll() for up to a millisecond between
+ * rounds, so an idle server costs little.
+ *
+ * Usage: hiredis-shm-server [--max-version <n>] <unix socket path>
+ *
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2011, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* syscall() for futexes, SCM_RIGHTS */
+#endif
+#include "fmacros.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "hiredis.h"
+#include "sds.h"
+#include "dict.c"
+#include "lockless-char-fifo/charfifo.h"
+#include "lockless-char-fifo/charfifo2.h"
+
+/* Polling policy, see the top of the file. */
+#define SERVER_POLL_SPINS 1024
+#define SERVER_IDLE_NS 100000000LL
+#define SERVER_IDLE_POLL_MS 1
+
+/* Bytes taken out of a ring at a time. */
+#define SERVER_CHUNK (1024*16)
+
+/* Capabilities of SHM.OPEN 2, as in shm.c. All are supported. */
+#define CAP_RING_V2 0x01
+#define CAP_ALIGN 0x02
+#define CAP_MEMFD 0x04
+#define CAP_FUTEX 0x08
+#define CAP_DOORBELL 0x10
+#define CAP_HEARTBEAT 0x20
+#define CAP_SLAB 0x40
+
+/* The control block and the slab blocks, laid out as in shm.c. */
+typedef struct serverDoorbell {
+    uint32_t seq;
+    uint32_t waiting;
+    char pad[56];
+} serverDoorbell;
+
+typedef struct serverLiveness {
+    uint32_t heartbeat;
+    uint32_t server_closed;
+    uint32_t client_closed;
+    char pad[52];
+} serverLiveness;
+
+typedef struct serverControl {
+    serverDoorbell to_server;
+    serverDoorbell to_client;
+    serverLiveness liveness;
+} serverControl;
+
+typedef struct serverSlabBlock {
+    uint32_t generation;
+    uint32_t in_use;
+    uint64_t size;
+} serverSlabBlock;
+
+#define SLAB_BLOCK_ALIGN 64
+
+/* Blocks are handed out in address order, wrapping at the end of the slab.
+ * The client frees them in any order, but space is only reclaimed from the
+ * oldest block on, which is good enough for replies freed soon. */
+typedef struct serverSlab {
+    char *mem;
+    size_t size;
+    size_t head; /* Where the next block goes. */
+    uint32_t generation;
+    size_t *live; /* Offsets of the blocks not reclaimed yet, oldest first. */
+    size_t first, count, cap;
+} serverSlab;
+
+typedef struct serverClient {
+    int fd;
+    redisReader *reader;
+    sds obuf; /* Replies for the socket. */
+    sds rbuf; /* Replies for the to_client ring. */
+    int fds[4]; /* Descriptors received with SHM.OPEN, in order. */
+    int nfds;
+    /* Set once SHM.OPEN succeeded. */
+    char *mem;
+    size_t mem_size;
+    int ring_version;
+    volatile void *to_server;
+    volatile void *to_client;
+    size_t to_client_size;
+    serverControl *control;
+    int doorbell_fd;
+    long long heartbeat_ns;
+    long long next_beat;
+    serverSlab slab;
+    struct serverClient *next;
+} serverClient;
+
+typedef struct serverValue {
+    sds str; /* A string, or NULL for a list. */
+    sds *items;
+    size_t len, cap;
+} serverValue;
+
+static struct {
+    int max_version;
+    dict *db;
+    serverClient *clients;
+} server;
+
+static long long monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* ------------------------------- Keyspace ---------------------------------*/
+
+static unsigned int keyHash(const void *key) {
+    return dictGenHashFunction((const unsigned char *)key, sdslen((const sds)key));
+}
+
+static int keyCompare(void *privdata, const void *key1, const void *key2) {
+    (void)privdata;
+    return sdslen((const sds)key1) == sdslen((const sds)key2) &&
+           memcmp(key1, key2, sdslen((const sds)key1)) == 0;
+}
+
+static void keyDestructor(void *privdata, void *key) {
+    (void)privdata;
+    sdsfree(key);
+}
+
+static void valueDestructor(void *privdata, void *val) {
+    serverValue *v = val;
+    size_t i;
+
+    (void)privdata;
+    sdsfree(v->str);
+    for (i = 0; i < v->len; i++)
+        sdsfree(v->items[i]);
+    free(v->items);
+    free(v);
+}
+
+static dictType keyspaceDict = {
+    keyHash, NULL, NULL, keyCompare, keyDestructor, valueDestructor
+};
+
+static serverValue *lookupKey(redisReply *key) {
+    dictEntry *de;
+    sds k = sdsnewlen(key->str, key->len);
+
+    de = dictFind(server.db, k);
+    sdsfree(k);
+    return de ? dictGetEntryVal(de) : NULL;
+}
+
+/* Replaces whatever the key held. */
+static serverValue *createKey(redisReply *key, sds str) {
+    serverValue *v = calloc(1, sizeof(*v));
+    sds k = sdsnewlen(key->str, key->len);
+
+    v->str = str;
+    if (!dictReplace(server.db, k, v))
+        sdsfree(k); /* The key was there already. */
+    return v;
+}
+
+/* --------------------------------- Slab -----------------------------------*/
+
+/* Places 'len' bytes of 'str' in the slab and returns the descriptor the
+ * ring carries instead, or NULL when the slab is full. */
+static sds slabPut(serverSlab *slab, const char *str, size_t len) {
+    size_t need = (sizeof(serverSlabBlock) + len + 1 + SLAB_BLOCK_ALIGN - 1) &
+                  ~(size_t)(SLAB_BLOCK_ALIGN - 1);
+    size_t at, oldest;
+    serverSlabBlock *block;
+
+    while (slab->count > 0) {
+        block = (serverSlabBlock*)(slab->mem + slab->live[slab->first]);
+        if (atomic_load_explicit(&block->in_use, memory_order_acquire))
+            break;
+        slab->first++;
+        slab->count--;
+    }
+    if (slab->count == 0) {
+        slab->first = 0;
+        slab->head = 0;
+    }
+
+    /* Free are the bytes from head up to the oldest block, wrapping. */
+    oldest = slab->count ? slab->live[slab->first] : slab->size;
+    if (slab->count == 0 || slab->head > oldest) {
+        if (slab->head + need <= slab->size)
+            at = slab->head;
+        else if (need <= oldest && slab->count > 0)
+            at = 0;
+        else if (slab->count == 0 && need <= slab->size)
+            at = 0;
+        else
+            return NULL;
+    } else if (slab->head + need <= oldest) {
+        at = slab->head;
+    } else {
+        return NULL;
+    }
+
+    if (slab->first + slab->count == slab->cap) {
+        if (slab->first > 0) {
+            memmove(slab->live, slab->live + slab->first, slab->count * sizeof(size_t));
+            slab->first = 0;
+        } else {
+            slab->cap = slab->cap ? slab->cap * 2 : 64;
+            slab->live = realloc(slab->live, slab->cap * sizeof(size_t));
+        }
+    }
+    slab->live[slab->first + slab->count++] = at;
+    slab->head = at + need;
+
+    if (++slab->generation == 0)
+        slab->generation = 1;
+    block = (serverSlabBlock*)(slab->mem + at);
+    block->generation = slab->generation;
+    block->size = need;
+    memcpy(block + 1, str, len);
+    ((char*)(block + 1))[len] = '\0';
+    atomic_store_explicit(&block->in_use, 1, memory_order_release);
+    return sdscatprintf(sdsempty(), "&%zu,%zu,%u\r\n", at, len, slab->generation);
+}
+
+/* -------------------------------- Commands --------------------------------*/
+
+static sds addBulk(sds out, const char *str, size_t len) {
+    out = sdscatprintf(out, "$%zu\r\n", len);
+    out = sdscatlen(out, str, len);
+    return sdscatlen(out, "\r\n", 2);
+}
+
+static int argToLongLong(redisReply *arg, long long *value) {
+    char buf[32], *end;
+
+    if (arg->len == 0 || arg->len >= sizeof(buf))
+        return 0;
+    memcpy(buf, arg->str, arg->len);
+    buf[arg->len] = '\0';
+    errno = 0;
+    *value = strtoll(buf, &end, 10);
+    return errno == 0 && *end == '\0';
+}
+
+#define WRONGTYPE "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n"
+
+static sds commandGet(serverClient *c, redisReply **argv, sds out) {
+    serverValue *v = lookupKey(argv[1]);
+    sds oob;
+
+    if (v == NULL)
+        return sdscat(out, "$-1\r\n");
+    if (v->str == NULL)
+        return sdscat(out, WRONGTYPE);
+    /* Values that would cross the ring in several passes go to the slab. */
+    if (c->slab.mem != NULL && sdslen(v->str) > c->to_client_size / 4 &&
+        (oob = slabPut(&c->slab, v->str, sdslen(v->str))) != NULL)
+    {
+        out = sdscatsds(out, oob);
+        sdsfree(oob);
+        return out;
+    }
+    return addBulk(out, v->str, sdslen(v->str));
+}
+
+static sds commandIncr(redisReply **argv, sds out) {
+    serverValue *v = lookupKey(argv[1]);
+    long long value = 0;
+    redisReply arg;
+
+    if (v != NULL && v->str == NULL)
+        return sdscat(out, WRONGTYPE);
+    if (v != NULL) {
+        arg.str = v->str;
+        arg.len = sdslen(v->str);
+        if (!argToLongLong(&arg, &value) || value == LLONG_MAX)
+            return sdscat(out, "-ERR value is not an integer or out of range\r\n");
+    }
+    value++;
+    if (v == NULL)
+        v = createKey(argv[1], sdsempty());
+    sdsclear(v->str);
+    v->str = sdscatprintf(v->str, "%lld", value);
+    return sdscatprintf(out, ":%lld\r\n", value);
+}
+
+static sds commandRpush(redisReply **argv, size_t argc, sds out) {
+    serverValue *v = lookupKey(argv[1]);
+    size_t i;
+
+    if (v != NULL && v->str != NULL)
+        return sdscat(out, WRONGTYPE);
+    if (v == NULL)
+        v = createKey(argv[1], NULL);
+    for (i = 2; i < argc; i++) {
+        if (v->len == v->cap) {
+            v->cap = v->cap ? v->cap * 2 : 4;
+            v->items = realloc(v->items, v->cap * sizeof(sds));
+        }
+        v->items[v->len++] = sdsnewlen(argv[i]->str, argv[i]->len);
+    }
+    return sdscatprintf(out, ":%zu\r\n", v->len);
+}
+
+static sds commandLrange(redisReply **argv, sds out) {
+    serverValue *v = lookupKey(argv[1]);
+    long long start, stop, len, i;
+
+    if (!argToLongLong(argv[2], &start) || !argToLongLong(argv[3], &stop))
+        return sdscat(out, "-ERR value is not an integer or out of range\r\n");
+    if (v == NULL)
+        return sdscat(out, "*0\r\n");
+    if (v->str != NULL)
+        return sdscat(out, WRONGTYPE);
+
+    len = (long long)v->len;
+    if (start < 0) start = len + start;
+    if (stop < 0) stop = len + stop;
+    if (start < 0) start = 0;
+    if (stop >= len) stop = len - 1;
+    if (start > stop)
+        return sdscat(out, "*0\r\n");
+
+    out = sdscatprintf(out, "*%lld\r\n", stop - start + 1);
+    for (i = start; i <= stop; i++)
+        out = addBulk(out, v->items[i], sdslen(v->items[i]));
+    return out;
+}
+
+static sds commandDel(redisReply **argv, size_t argc, sds out) {
+    long long deleted = 0;
+    size_t i;
+    sds k;
+
+    for (i = 1; i < argc; i++) {
+        k = sdsnewlen(argv[i]->str, argv[i]->len);
+        if (dictDelete(server.db, k) == DICT_OK)
+            deleted++;
+        sdsfree(k);
+    }
+    return sdscatprintf(out, ":%lld\r\n", deleted);
+}
+
+static sds commandKeys(redisReply **argv, sds out) {
+    dictIterator it;
+    dictEntry *de;
+    sds keys = sdsempty();
+    size_t n = 0;
+
+    dictInitIterator(&it, server.db);
+    while ((de = dictNext(&it)) != NULL) {
+        if (fnmatch(argv[1]->str, dictGetEntryKey(de), 0) == 0) {
+            keys = addBulk(keys, dictGetEntryKey(de), sdslen(dictGetEntryKey(de)));
+            n++;
+        }
+    }
+    out = sdscatprintf(out, "*%zu\r\n", n);
+    out = sdscatsds(out, keys);
+    sdsfree(keys);
+    return out;
+}
+
+/* Appends the reply to the command to 'out'. */
+static sds executeCommand(serverClient *c, redisReply **argv, size_t argc, sds out) {
+    const char *name = argv[0]->str;
+
+#define ARITY(min, max) \
+    if (argc < (min) || argc > (max)) \
+        return sdscatprintf(out, "-ERR wrong number of arguments for '%s' command\r\n", name);
+
+    if (!strcasecmp(name, "PING")) {
+        ARITY(1, 2);
+        return argc == 2 ? addBulk(out, argv[1]->str, argv[1]->len) : sdscat(out, "+PONG\r\n");
+    } else if (!strcasecmp(name, "ECHO")) {
+        ARITY(2, 2);
+        return addBulk(out, argv[1]->str, argv[1]->len);
+    } else if (!strcasecmp(name, "GET")) {
+        ARITY(2, 2);
+        return commandGet(c, argv, out);
+    } else if (!strcasecmp(name, "SET")) {
+        ARITY(3, 3);
+        createKey(argv[1], sdsnewlen(argv[2]->str, argv[2]->len));
+        return sdscat(out, "+OK\r\n");
+    } else if (!strcasecmp(name, "DEL")) {
+        ARITY(2, SIZE_MAX);
+        return commandDel(argv, argc, out);
+    } else if (!strcasecmp(name, "INCR")) {
+        ARITY(2, 2);
+        return commandIncr(argv, out);
+    } else if (!strcasecmp(name, "RPUSH")) {
+        ARITY(3, SIZE_MAX);
+        return commandRpush(argv, argc, out);
+    } else if (!strcasecmp(name, "LRANGE")) {
+        ARITY(4, 4);
+        return commandLrange(argv, out);
+    } else if (!strcasecmp(name, "KEYS")) {
+        ARITY(2, 2);
+        return commandKeys(argv, out);
+    } else if (!strcasecmp(name, "DEBUG")) {
+        ARITY(3, 3);
+        if (strcasecmp(argv[1]->str, "SLEEP"))
+            return sdscatprintf(out, "-ERR unknown DEBUG subcommand '%s'\r\n", argv[1]->str);
+        /* Stalls every client, as in Redis. */
+        usleep((useconds_t)(strtod(argv[2]->str, NULL) * 1000000));
+        return sdscat(out, "+OK\r\n");
+    } else if (!strcasecmp(name, "FLUSHALL")) {
+        ARITY(1, 1);
+        dictRelease(server.db);
+        server.db = dictCreate(&keyspaceDict, NULL);
+        return sdscat(out, "+OK\r\n");
+    }
+#undef ARITY
+    return sdscatprintf(out, "-ERR unknown command '%s'\r\n", name);
+}
+
+/* ----------------------------- Shared memory ------------------------------*/
+
+static void futexWake(uint32_t *addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)addr;
+#endif
+}
+
+/* As sharedMemoryRing in shm.c, but the to_client doorbell also signals the
+ * eventfd, clearing 'waiting' so the client's event loop is woken once. */
+static void ringDoorbell(serverClient *c, serverDoorbell *bell, int force) {
+    uint64_t one = 1;
+    ssize_t nwritten;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!force && !atomic_load_explicit(&bell->waiting, memory_order_relaxed))
+        return;
+    if (bell == &c->control->to_client && c->doorbell_fd != -1) {
+        atomic_store_explicit(&bell->waiting, 0, memory_order_relaxed);
+        nwritten = write(c->doorbell_fd, &one, sizeof(one));
+        (void)nwritten;
+    }
+    atomic_fetch_add_explicit(&bell->seq, 1, memory_order_release);
+    futexWake(&bell->seq);
+}
+
+static size_t fifoFootprint(int version, size_t size) {
+    return version == 2 ? CharFifo2_Footprint(size) : CharFifo_Footprint(size);
+}
+
+static size_t fifoHeaderSize(int version) {
+    return version == 2 ? sizeof(charfifo2_header_t) : sizeof(charfifo_header_t);
+}
+
+/* As sharedMemoryPlaceRing in shm.c. */
+static size_t placeRing(int version, size_t align, size_t end) {
+    size_t header = fifoHeaderSize(version);
+    if (align == 0)
+        return end;
+    return ((end + header + align - 1) & ~(align - 1)) - header;
+}
+
+/* The options of SHM.OPEN, in either version. */
+typedef struct shmOpenArgs {
+    int version;
+    int caps;
+    const char *name;
+    size_t to_server_size, to_client_size;
+    int ring_version;
+    size_t align;
+    int futex, doorbell;
+    long long heartbeat_ms;
+    size_t slab_offset, slab_size;
+} shmOpenArgs;
+
+static int parseShmOpen(redisReply **argv, size_t argc, shmOpenArgs *args, const char **err) {
+    long long v[2];
+    size_t i, n;
+    const char *kw;
+
+    memset(args, 0, sizeof(*args));
+    args->to_server_size = args->to_client_size = 1024*16;
+    args->ring_version = 1;
+    if (argc < 3 || !argToLongLong(argv[1], &v[0])) {
+        *err = "-ERR wrong number of arguments for 'shm.open' command\r\n";
+        return 0;
+    }
+    args->version = (int)v[0];
+    if (args->version < 1 || args->version > server.max_version) {
+        *err = "-ERR unsupported SHM.OPEN version\r\n";
+        return 0;
+    }
+    args->name = argv[2]->str;
+
+    for (i = 3; i < argc; i += 1 + n) {
+        kw = argv[i]->str;
+        n = !strcasecmp(kw, "BUFFERS") || !strcasecmp(kw, "SLAB") ? 2 : 1;
+        if (i + n >= argc)
+            goto syntax;
+        if (!strcasecmp(kw, "WAKEUP") && args->version == 1) {
+            args->futex = 1;
+        } else if (!strcasecmp(kw, "DOORBELL") && args->version == 1) {
+            args->doorbell = 1;
+        } else if (!strcasecmp(kw, "RING") && args->version == 1) {
+            if (!argToLongLong(argv[i+1], &v[0]) || (v[0] != 1 && v[0] != 2))
+                goto syntax;
+            args->ring_version = (int)v[0];
+        } else if (!strcasecmp(kw, "CAPS") && args->version == 2) {
+            if (!argToLongLong(argv[i+1], &v[0]))
+                goto syntax;
+            args->caps = (int)v[0];
+        } else if (!strcasecmp(kw, "HEARTBEAT") && args->version == 2) {
+            if (!argToLongLong(argv[i+1], &args->heartbeat_ms) || args->heartbeat_ms <= 0)
+                goto syntax;
+        } else if (!strcasecmp(kw, "ALIGN")) {
+            if (!argToLongLong(argv[i+1], &v[0]) || v[0] <= 0 || (v[0] & (v[0] - 1)))
+                goto syntax;
+            args->align = (size_t)v[0];
+        } else if (!strcasecmp(kw, "BUFFERS") || !strcasecmp(kw, "SLAB")) {
+            if (!argToLongLong(argv[i+1], &v[0]) || !argToLongLong(argv[i+2], &v[1]) ||
+                v[0] < 0 || v[1] <= 0)
+                goto syntax;
+            if (!strcasecmp(kw, "BUFFERS")) {
+                args->to_server_size = (size_t)v[0];
+                args->to_client_size = (size_t)v[1];
+            } else {
+                args->slab_offset = (size_t)v[0];
+                args->slab_size = (size_t)v[1];
+            }
+        } else {
+            goto syntax;
+        }
+    }
+
+    if (args->version == 2) {
+        /* Capabilities stand for the keywords of version 1. */
+        if (args->caps & CAP_RING_V2) args->ring_version = 2;
+        if (args->caps & CAP_FUTEX) args->futex = 1;
+        if (args->caps & CAP_DOORBELL) args->doorbell = 1;
+        if (!(args->caps & CAP_HEARTBEAT)) args->heartbeat_ms = 0;
+        if (!(args->caps & CAP_SLAB)) args->slab_size = 0;
+    }
+    return 1;
+
+syntax:
+    *err = "-ERR syntax error\r\n";
+    return 0;
+}
+
+static void closeReceivedFds(serverClient *c) {
+    while (c->nfds > 0)
+        close(c->fds[--c->nfds]);
+}
+
+/* Takes the oldest descriptor received, or -1. */
+static int takeReceivedFd(serverClient *c) {
+    int fd;
+
+    if (c->nfds == 0)
+        return -1;
+    fd = c->fds[0];
+    memmove(c->fds, c->fds + 1, --c->nfds * sizeof(int));
+    return fd;
+}
+
+static sds shmOpen(serverClient *c, redisReply **argv, size_t argc, sds out) {
+    shmOpenArgs args;
+    const char *err = "-ERR can't open the shared memory\r\n";
+    size_t to_server, to_client, end, control = 0;
+    struct stat st;
+    int fd = -1;
+
+    if (c->mem != NULL) {
+        closeReceivedFds(c);
+        return sdscat(out, "-ERR shared memory already open\r\n");
+    }
+    if (!parseShmOpen(argv, argc, &args, &err))
+        goto fail;
+
+    if (!strcmp(args.name, "FD"))
+        fd = takeReceivedFd(c);
+    else
+        fd = shm_open(args.name, O_RDWR, 0);
+    if (fd == -1 || fstat(fd, &st) == -1)
+        goto fail;
+    if (args.doorbell && (c->doorbell_fd = takeReceivedFd(c)) == -1)
+        goto fail;
+
+    to_server = placeRing(args.ring_version, args.align, 0);
+    end = to_server + fifoFootprint(args.ring_version, args.to_server_size);
+    to_client = placeRing(args.ring_version, args.align, end);
+    end = to_client + fifoFootprint(args.ring_version, args.to_client_size);
+    if (args.futex || args.doorbell || args.heartbeat_ms ||
+        (args.version == 2 && (args.caps & (CAP_FUTEX|CAP_DOORBELL|CAP_HEARTBEAT))))
+    {
+        control = (end + 63) & ~(size_t)63;
+        end = control + sizeof(serverControl);
+    }
+    if (args.slab_size && (args.slab_offset < end || args.slab_offset + args.slab_size < end))
+        goto fail;
+    if (args.slab_size)
+        end = args.slab_offset + args.slab_size;
+    if ((size_t)st.st_size < end)
+        goto fail;
+
+    c->mem_size = st.st_size;
+    c->mem = mmap(NULL, c->mem_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (c->mem == MAP_FAILED) {
+        c->mem = NULL;
+        goto fail;
+    }
+    close(fd);
+    closeReceivedFds(c);
+
+    c->ring_version = args.ring_version;
+    c->to_server = c->mem + to_server;
+    c->to_client = c->mem + to_client;
+    c->to_client_size = args.to_client_size;
+    c->control = control ? (serverControl*)(c->mem + control) : NULL;
+    c->heartbeat_ns = args.heartbeat_ms * 1000000;
+    c->next_beat = monotonicNs() + c->heartbeat_ns;
+    if (args.slab_size) {
+        c->slab.mem = c->mem + args.slab_offset;
+        c->slab.size = args.slab_size;
+    }
+
+    if (args.version == 1)
+        return sdscat(out, ":1\r\n");
+    if (args.heartbeat_ms)
+        return sdscatprintf(out, "*4\r\n:2\r\n:%d\r\n$9\r\nHEARTBEAT\r\n:%lld\r\n",
+                            args.caps, args.heartbeat_ms);
+    return sdscatprintf(out, "*2\r\n:2\r\n:%d\r\n", args.caps);
+
+fail:
+    if (fd != -1)
+        close(fd);
+    if (c->doorbell_fd != -1) {
+        close(c->doorbell_fd);
+        c->doorbell_fd = -1;
+    }
+    closeReceivedFds(c);
+    return sdscat(out, err);
+}
+
+/* Executes the complete commands buffered in the reader. Returns 0 when the
+ * client has to be dropped. */
+static int processCommands(serverClient *c) {
+    redisReply *cmd;
+    size_t i;
+
+    for (;;) {
+        if (redisReaderGetReply(c->reader, (void**)&cmd) != REDIS_OK)
+            return 0;
+        if (cmd == NULL)
+            return 1;
+        if (cmd->type != REDIS_REPLY_ARRAY || cmd->elements == 0) {
+            freeReplyObject(cmd);
+            return 0;
+        }
+        for (i = 0; i < cmd->elements; i++) {
+            if (cmd->element[i]->type != REDIS_REPLY_STRING) {
+                freeReplyObject(cmd);
+                return 0;
+            }
+        }
+        /* The reply to SHM.OPEN still goes through the socket. */
+        if (c->mem == NULL && !strcasecmp(cmd->element[0]->str, "SHM.OPEN"))
+            c->obuf = shmOpen(c, cmd->element, cmd->elements, c->obuf);
+        else if (c->mem == NULL)
+            c->obuf = executeCommand(c, cmd->element, cmd->elements, c->obuf);
+        else
+            c->rbuf = executeCommand(c, cmd->element, cmd->elements, c->rbuf);
+        freeReplyObject(cmd);
+    }
+}
+
+/* Moves commands and replies through the rings. Returns 1 if anything moved,
+ * 0 if nothing did, and -1 when the client has to be dropped. */
+static int serviceRings(serverClient *c, long long now) {
+    char buf[SERVER_CHUNK];
+    size_t used, free, n;
+    int moved = 0;
+
+    if (c->control != NULL) {
+        if (atomic_load_explicit(&c->control->liveness.client_closed, memory_order_acquire))
+            return -1;
+        if (c->heartbeat_ns && now >= c->next_beat) {
+            atomic_fetch_add_explicit(&c->control->liveness.heartbeat, 1, memory_order_release);
+            c->next_beat = now + c->heartbeat_ns;
+        }
+    }
+
+    used = c->ring_version == 2 ? CharFifo2_UsedSpace(c->to_server, sizeof(buf))
+                                : CharFifo_UsedSpace(c->to_server);
+    if (used > 0) {
+        n = used < sizeof(buf) ? used : sizeof(buf);
+        if (c->ring_version == 2)
+            CharFifo2_Read(c->to_server, buf, n);
+        else
+            CharFifo_Read(c->to_server, buf, n);
+        if (c->control != NULL)
+            ringDoorbell(c, &c->control->to_server, 0);
+        if (redisReaderFeed(c->reader, buf, n) != REDIS_OK || !processCommands(c))
+            return -1;
+        moved = 1;
+    }
+
+    if (sdslen(c->rbuf) > 0) {
+        free = c->ring_version == 2 ? CharFifo2_FreeSpace(c->to_client, sdslen(c->rbuf))
+                                    : CharFifo_FreeSpace(c->to_client);
+        n = free < sdslen(c->rbuf) ? free : sdslen(c->rbuf);
+        if (n > 0) {
+            if (c->ring_version == 2)
+                CharFifo2_Write(c->to_client, c->rbuf, n);
+            else
+                CharFifo_Write(c->to_client, c->rbuf, n);
+            sdsrange(c->rbuf, n, -1);
+            if (c->control != NULL)
+                ringDoorbell(c, &c->control->to_client, 0);
+            moved = 1;
+        }
+    }
+    return moved;
+}
+
+/* -------------------------------- Clients ---------------------------------*/
+
+static void freeClient(serverClient *c) {
+    serverClient **p;
+
+    for (p = &server.clients; *p != c; p = &(*p)->next);
+    *p = c->next;
+
+    if (c->control != NULL) {
+        /* Lets a waiting client notice right away. */
+        atomic_store_explicit(&c->control->liveness.server_closed, 1, memory_order_release);
+        ringDoorbell(c, &c->control->to_server, 1);
+        ringDoorbell(c, &c->control->to_client, 1);
+    }
+    if (c->mem != NULL)
+        munmap(c->mem, c->mem_size);
+    if (c->doorbell_fd != -1)
+        close(c->doorbell_fd);
+    closeReceivedFds(c);
+    close(c->fd);
+    redisReaderFree(c->reader);
+    sdsfree(c->obuf);
+    sdsfree(c->rbuf);
+    free(c->slab.live);
+    free(c);
+}
+
+static void acceptClient(int listen_fd) {
+    serverClient *c;
+    int fd;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1)
+        return;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    c = calloc(1, sizeof(*c));
+    c->fd = fd;
+    c->reader = redisReaderCreate();
+    c->obuf = sdsempty();
+    c->rbuf = sdsempty();
+    c->doorbell_fd = -1;
+    c->next = server.clients;
+    server.clients = c;
+}
+
+/* Reads commands and the descriptors passed along from the socket. Returns
+ * 0 when the client has to be dropped. */
+static int readFromSocket(serverClient *c) {
+    char buf[SERVER_CHUNK];
+    union {
+        char buf[CMSG_SPACE(4*sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    ssize_t nread;
+    int fd;
+    size_t i, n;
+
+    iov.iov_base = buf;
+    iov.iov_len = sizeof(buf);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    nread = recvmsg(c->fd, &msg, 0);
+    if (nread == -1)
+        return errno == EAGAIN || errno == EINTR;
+    if (nread == 0)
+        return 0;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < n; i++) {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (c->nfds < (int)(sizeof(c->fds) / sizeof(c->fds[0])))
+                c->fds[c->nfds++] = fd;
+            else
+                close(fd);
+        }
+    }
+
+    /* Once on shared memory, the socket only tells when the client is gone. */
+    if (c->mem != NULL)
+        return 1;
+    return redisReaderFeed(c->reader, buf, nread) == REDIS_OK && processCommands(c);
+}
+
+static int writeToSocket(serverClient *c) {
+    ssize_t nwritten = write(c->fd, c->obuf, sdslen(c->obuf));
+
+    if (nwritten == -1)
+        return errno == EAGAIN || errno == EINTR;
+    sdsrange(c->obuf, nwritten, -1);
+    return 1;
+}
+
+/* ---------------------------------- Main ----------------------------------*/
+
+static int listenUnix(const char *path) {
+    struct sockaddr_un sa;
+    int fd;
+
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    strcpy(sa.sun_path, path);
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 || listen(fd, 128) == -1) {
+        perror("Can't listen");
+        return -1;
+    }
+    return fd;
+}
+
+static void serve(int listen_fd) {
+    struct pollfd *pfds = NULL;
+    serverClient *c, *next;
+    long long now, last_moved = 0;
+    unsigned long spins = 0;
+    size_t npfds, cap = 0, i;
+    int shm_clients, moved, timeout, ok;
+
+    for (;;) {
+        now = monotonicNs();
+        shm_clients = 0;
+        moved = 0;
+        for (c = server.clients; c != NULL; c = next) {
+            next = c->next;
+            if (c->mem == NULL)
+                continue;
+            shm_clients = 1;
+            switch (serviceRings(c, now)) {
+            case -1: freeClient(c); break;
+            case 1: moved = 1; break;
+            }
+        }
+        if (moved)
+            last_moved = now;
+
+        /* Spin on busy rings, checking the sockets now and then. */
+        if (shm_clients && now - last_moved < SERVER_IDLE_NS &&
+            ++spins % SERVER_POLL_SPINS != 0)
+        {
+            if (!moved && spins % 64 == 0)
+                sched_yield();
+            continue;
+        }
+
+        npfds = 0;
+        for (c = server.clients; c != NULL; c = c->next)
+            npfds++;
+        if (npfds + 1 > cap) {
+            cap = (npfds + 1) * 2;
+            pfds = realloc(pfds, cap * sizeof(*pfds));
+        }
+        pfds[0].fd = listen_fd;
+        pfds[0].events = POLLIN;
+        for (i = 1, c = server.clients; c != NULL; c = c->next, i++) {
+            pfds[i].fd = c->fd;
+            pfds[i].events = POLLIN;
+            if (sdslen(c->obuf) > 0)
+                pfds[i].events |= POLLOUT;
+        }
+
+        if (!shm_clients)
+            timeout = -1;
+        else if (now - last_moved < SERVER_IDLE_NS)
+            timeout = 0;
+        else
+            timeout = SERVER_IDLE_POLL_MS;
+        if (poll(pfds, npfds + 1, timeout) <= 0)
+            continue;
+
+        /* Clients accepted below are at the head, so the indexes still
+         * match the list from its old head on. */
+        c = server.clients;
+        for (i = 1; i <= npfds; i++, c = next) {
+            next = c->next;
+            ok = 1;
+            if (pfds[i].revents & (POLLIN|POLLHUP|POLLERR))
+                ok = readFromSocket(c);
+            if (ok && sdslen(c->obuf) > 0)
+                ok = writeToSocket(c);
+            if (!ok)
+                freeClient(c);
+        }
+        if (pfds[0].revents & POLLIN)
+            acceptClient(listen_fd);
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    int listen_fd, i;
+
+    server.max_version = 2;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--max-version") && i + 1 < argc) {
+            server.max_version = atoi(argv[++i]);
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "Usage: %s [--max-version <n>] <unix socket path>\n", argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    server.db = dictCreate(&keyspaceDict, NULL);
+    listen_fd = listenUnix(path);
+    if (listen_fd == -1)
+        return 1;
+    serve(listen_fd);
+    return 0;
+}
@@ -32,47 +32,307 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* syscall() for futexes, SCM_RIGHTS */
+#endif
+
 #include <sys/mman.h>
 #include <string.h>
+#include <strings.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <limits.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "shm.h"
 #include "hiredis.h"
+#include "stats_private.h"
 
 #include "lockless-char-fifo/charfifo.h"
+#include "lockless-char-fifo/charfifo2.h"
 
 void __redisSetError(redisContext *c, int type, const char *str);
 
-#define SHARED_MEMORY_PROTO_VERSION 1
+/* SHM.OPEN is first sent in the latest version, and again in the previous
+ * one if the server rejects it. */
+#define SHARED_MEMORY_PROTO_VERSION 2
+
+/* Capabilities of SHM.OPEN 2, requested by the client and granted by the
+ * server. A server not granting one of SHARED_MEMORY_CAPS_REQUIRED, which
+ * shape the shared memory, fails the handshake. The others are turned off 
+ * when not granted. */
+#define SHARED_MEMORY_CAP_RING_V2 0x01
+#define SHARED_MEMORY_CAP_ALIGN 0x02
+#define SHARED_MEMORY_CAP_MEMFD 0x04
+#define SHARED_MEMORY_CAP_FUTEX 0x08
+#define SHARED_MEMORY_CAP_DOORBELL 0x10
+#define SHARED_MEMORY_CAP_HEARTBEAT 0x20
+#define SHARED_MEMORY_CAP_SLAB 0x40
+#define SHARED_MEMORY_CAPS_REQUIRED \
+    (SHARED_MEMORY_CAP_RING_V2|SHARED_MEMORY_CAP_ALIGN|SHARED_MEMORY_CAP_MEMFD)
+
+typedef struct sharedMemoryDoorbell sharedMemoryDoorbell;
+static void sharedMemoryRing(redisContext *c, sharedMemoryDoorbell *bell);
+struct redisSharedMemoryContext;
+static int sharedMemoryPeerClosed(struct redisSharedMemoryContext *ctx);
 
 #define X(...)
 /*#define X printf*/
 
 
-/* redisBufferRead thinks 16k is best for a temporary buffer reading replies.
- * A good guess is this will do well with shared memory buffer size too. */
-#define SHARED_MEMORY_BUF_SIZE (1024*16)
+/* A sleeping side parks on 'seq' after setting 'waiting'. The other side
+ * bumps 'seq' and wakes it up after moving an index of the ring, but only
+ * when 'waiting' is set, so a busy peer costs no syscalls. A ring only ever
+ * has one side waiting: the reader when empty, or the writer when full.
+ * With an eventfd doorbell, the server also signals it, clearing 'waiting',
+ * so an event loop gets a single wakeup per arming. */
+struct sharedMemoryDoorbell {
+    uint32_t seq; /* futex word */
+    uint32_t waiting;
+    char pad[56]; /* keep doorbells on separate cache lines */
+};
+
+/* With SHARED_MEMORY_OPT_HEARTBEAT, the server bumps 'heartbeat' every
+ * period and sets 'server_closed' when it drops the client, ringing both 
+ * doorbells after. The client sets 'client_closed' when it goes away. Either
+ * flag only ever goes from 0 to 1. */
+typedef struct sharedMemoryLiveness {
+    uint32_t heartbeat;
+    uint32_t server_closed;
+    uint32_t client_closed;
+    char pad[52];
+} sharedMemoryLiveness;
+
+typedef struct sharedMemoryControl {
+    sharedMemoryDoorbell to_server;
+    sharedMemoryDoorbell to_client;
+    sharedMemoryLiveness liveness;
+} sharedMemoryControl;
+
+/* With SHARED_MEMORY_OPT_SLAB, the server places large bulk strings in blocks
+ * of the slab, and sends '&<offset>,<len>,<generation>' in the to_client ring
+ * instead. A block starts on a 64 byte boundary with this header, followed by
+ * the string and a NUL. The server sets 'in_use' last, and the client clears
+ * it when the reply borrowing the string is freed. How the server hands out
+ * blocks is its own business, only blocks with 'in_use' clear can be reused. */
+typedef struct sharedMemorySlabBlock {
+    uint32_t generation; /* Nonzero, as in the descriptor. */
+    uint32_t in_use;
+    uint64_t size; /* Of the whole block, header included. */
+} sharedMemorySlabBlock;
 
-typedef CHARFIFO(SHARED_MEMORY_BUF_SIZE) sharedMemoryBuffer;
+#define SHARED_MEMORY_SLAB_BLOCK_ALIGN 64
 
-typedef volatile struct sharedMemory {
-    sharedMemoryBuffer to_server;
-    sharedMemoryBuffer to_client;
-} sharedMemory;
+/* Reply strings borrowed from the slab keep the mapping alive, so they may
+ * outlive the context. */
+typedef struct sharedMemoryMapping {
+    uint32_t refs;
+    void *mem;
+    size_t size;
+} sharedMemoryMapping;
 
+typedef struct sharedMemoryLease {
+    redisLease base;
+    sharedMemoryMapping *mapping;
+    uint32_t *in_use;
+} sharedMemoryLease;
+
+/* With SHARED_MEMORY_OPT_LEASED_READ, a reply string in the to_client ring
+ * holds the ring from 'start' on, a position counted in bytes ever consumed.
+ * The context queues its leases in ring order, and only consumes up to the 
+ * first one still held. Both the reply and the queue hold a reference, so 
+ * whoever lets go last frees it. */
+typedef struct sharedMemoryRingLease {
+    redisLease base;
+    sharedMemoryMapping *mapping;
+    uint32_t refs;
+    size_t start;
+    struct sharedMemoryRingLease *next;
+} sharedMemoryRingLease;
+
+/* Strings shorter than this are copied, which costs no more than a lease. At
+ * most a quarter of the to_client ring is held by the leases given out, so
+ * the server keeps room for the replies following them. */
+#define SHARED_MEMORY_LEASE_MIN_LEN 256
+#define SHARED_MEMORY_LEASE_DIVISOR 4
+
+/* The shared memory holds the two ring buffers, one after the other:
+ *
+ *   [ to_server: CHARFIFO(to_server_size) ][ to_client: CHARFIFO(to_client_size) ]
+ *
+ * Both sizes default to SHARED_MEMORY_DEFAULT_BUF_SIZE, which is the layout
+ * every version 1 server expects. Other sizes are announced in SHM.OPEN.
+ * With SHARED_MEMORY_OPT_RING_V2, the rings are charfifo2 ones instead.
+ * With SHARED_MEMORY_OPT_MIRROR, padding moves the data of each ring onto a
+ * page boundary, and the client maps it twice back to back, see 
+ * sharedMemoryMapMirrored.
+ * With SHARED_MEMORY_OPT_ADAPTIVE_WAIT, SHARED_MEMORY_OPT_DOORBELL or 
+ * SHARED_MEMORY_OPT_HEARTBEAT, a sharedMemoryControl follows at the next 64
+ * byte boundary. With SHARED_MEMORY_OPT_SLAB, the slab comes last, on the 
+ * next page boundary. */
 typedef struct redisSharedMemoryContext {
-    char name[38]; /* Shared memory file name. */
+    char name[38]; /* Shared memory file name, empty once unlinked or with a memfd. */
+    int open_pending; /* SHM.OPEN sent, its reply not processed yet. */
+    int proto_version; /* Of the SHM.OPEN last sent. */
     mode_t mode;
-    struct sharedMemory *mem;
+    int flags; /* SHARED_MEMORY_OPT_xxx */
+    int ring_version; /* 1 for charfifo.h, 2 for charfifo2.h rings. */
+    long long spin_ns; /* Wait policy */
+    long long yield_ns;
+    long long heartbeat_ns; /* Period of the server's heartbeat, or 0. */
+    size_t to_server_size; /* Ring buffer sizes. */
+    size_t to_client_size;
+    size_t mem_size; /* Size of the whole mapping. */
+    size_t align; /* Page size ring data is aligned to and mirrored with, or 0. */
+    void *mem;
+    sharedMemoryMapping *mapping; /* mem, once the context is done with it */
+    volatile void *to_server;
+    volatile void *to_client;
+    sharedMemoryControl *control; /* NULL unless waking up is supported */
+    char *slab; /* NULL unless the server may use it */
+    size_t slab_offset;
+    size_t slab_size;
+    int segment_fd; /* memfd until passed to the server, or -1 */
+    int doorbell_fd; /* eventfd the server signals, or -1 */
+    int fds_pending; /* segment_fd and doorbell_fd not yet passed to the server */
+    size_t uncommitted; /* Written past the to_server write index, unpublished. */
+    size_t unconsumed; /* Parsed past the to_client read index, unreleased. */
+    size_t consumed; /* Ever consumed from the to_client ring. */
+    char *parse_base; /* Where the reader parses in place from, at... */
+    size_t parse_pos; /* ...this position, counted as 'consumed'. */
+    sharedMemoryRingLease *leases; /* Oldest first, NULL when none. */
+    sharedMemoryRingLease *last_lease;
+    /* Serving the context, or NULL. Both atomic, a poller may be removed
+     * from another thread than the event loop's. */
+    struct redisSharedMemoryPoller *poller;
+    int poller_direct; /* The poller reads and writes, not the event loop. */
+    uint32_t poller_detaching; /* sharedMemoryPollerDetach still uses the context. */
+    uint32_t poll_armed; /* The event loop waits for the to_client write... */
+    size_t poll_seen; /* ...index to move past this, see sharedMemoryPollerNotify. */
 } redisSharedMemoryContext;
 
+/* A sleeping call wakes up at least this often, to check the connection. */
+#define SHARED_MEMORY_PARK_TIMEOUT_NS 100000000LL
+
+/* Ring access for either layout. 'want' lets a version 2 ring skip loading
+ * the server's index while its cached copy already satisfies the caller. */
+static size_t fifoFootprint(int version, size_t size) {
+    return version == 2 ? CharFifo2_Footprint(size) : CharFifo_Footprint(size);
+}
+
+static size_t fifoHeaderSize(int version) {
+    return version == 2 ? sizeof(charfifo2_header_t) : sizeof(charfifo_header_t);
+}
+
+static void fifoInit(int version, volatile void *ring, size_t size) {
+    if (version == 2) {
+        CharFifo2_Init(ring,size);
+    } else {
+        CharFifo_Init(ring,size);
+    }
+}
+
+static size_t fifoFreeSpace(redisSharedMemoryContext *ctx, volatile void *ring, size_t want) {
+    return ctx->ring_version == 2 ? CharFifo2_FreeSpace(ring,want) : CharFifo_FreeSpace(ring);
+}
+
+static size_t fifoUsedSpace(redisSharedMemoryContext *ctx, volatile void *ring, size_t want) {
+    return ctx->ring_version == 2 ? CharFifo2_UsedSpace(ring,want) : CharFifo_UsedSpace(ring);
+}
+
+static void fifoConsume(redisSharedMemoryContext *ctx, volatile void *ring, size_t btr) {
+    if (ctx->ring_version == 2) {
+        CharFifo2_Consume(ring,btr);
+    } else {
+        CharFifo_Consume(ring,btr);
+    }
+}
+
+static void fifoCommit(redisSharedMemoryContext *ctx, volatile void *ring, size_t btw) {
+    if (ctx->ring_version == 2) {
+        CharFifo2_Commit(ring,btw);
+    } else {
+        CharFifo_Commit(ring,btw);
+    }
+}
+
+/* The write index as published by the producer, bypassing the cached copy of
+ * a version 2 ring, so that a thread other than the consumer may load it. */
+static size_t fifoWriteIndex(redisSharedMemoryContext *ctx, volatile void *ring) {
+    if (ctx->ring_version == 2) {
+        return atomic_load_explicit(&((charfifo2_header_t*)ring)->write_idx, memory_order_acquire);
+    }
+    return atomic_load_explicit(&((charfifo_header_t*)ring)->write_idx, memory_order_acquire);
+}
+
+static size_t fifoPeekSpans(redisSharedMemoryContext *ctx, volatile void *ring, 
+        size_t offset, charfifo_span_t spans[2]) {
+    size_t len = ctx->ring_version == 2 ? CharFifo2_PeekSpans(ring,offset,spans) 
+                                        : CharFifo_PeekSpans(ring,offset,spans);
+    if (ctx->align) {
+        /* The mirror continues the first span with the wrapped part. */
+        spans[0].len = len;
+        spans[1].len = 0;
+    }
+    return len;
+}
+
+static size_t fifoReserveSpans(redisSharedMemoryContext *ctx, volatile void *ring, 
+        size_t offset, size_t want, charfifo_span_t spans[2]) {
+    size_t len = ctx->ring_version == 2 ? CharFifo2_ReserveSpans(ring,offset,want,spans) 
+                                        : CharFifo_ReserveSpans(ring,offset,spans);
+    if (ctx->align) {
+        spans[0].len = len;
+        spans[1].len = 0;
+    }
+    return len;
+}
 
-static void sharedMemoryBufferInit(sharedMemoryBuffer *b) {
-    CharFifo_Init(b, SHARED_MEMORY_BUF_SIZE);
+static void fifoWrite(redisSharedMemoryContext *ctx, volatile void *ring, const char *buf, size_t btw) {
+    charfifo_span_t spans[2];
+    
+    if (ctx->align) {
+        /* A single copy, with nothing batched. */
+        fifoReserveSpans(ctx,ring,0,btw,spans);
+        memcpy(spans[0].buf,buf,btw);
+        fifoCommit(ctx,ring,btw);
+    } else if (ctx->ring_version == 2) {
+        CharFifo2_Write(ring,buf,btw);
+    } else {
+        CharFifo_Write(ring,buf,btw);
+    }
+}
+
+static void fifoRead(redisSharedMemoryContext *ctx, volatile void *ring, char *buf, size_t btr) {
+    charfifo_span_t spans[2];
+    
+    if (ctx->align) {
+        fifoPeekSpans(ctx,ring,0,spans);
+        memcpy(buf,spans[0].buf,btr);
+        fifoConsume(ctx,ring,btr);
+    } else if (ctx->ring_version == 2) {
+        CharFifo2_Read(ring,buf,btr);
+    } else {
+        CharFifo_Read(ring,buf,btr);
+    }
+}
+
+
+static int sharedMemoryValidBufSize(size_t size) {
+    /* A ring holds size-1 bytes, and must fit a PIPE_BUF atomic write. */
+    return size > PIPE_BUF && size <= SHARED_MEMORY_MAX_BUF_SIZE;
 }
 
 static int getRandomUUID(redisContext *c, char* buf, size_t size) {
@@ -97,99 +357,744 @@ static int getRandomUUID(redisContext *c, char* buf, size_t size) {
     return 1;
 }
 
-static int sharedMemoryContextInit(redisContext *c, mode_t mode) {
-    int fd;
+/* Offsets of the ring headers and the control block in the file. */
+typedef struct sharedMemoryLayout {
+    size_t to_server;
+    size_t to_client;
+    size_t control; /* 0 without a control block */
+    size_t slab; /* 0 without a slab */
+    size_t size;
+} sharedMemoryLayout;
+
+/* Where a ring goes after 'end': right there, or with align set, so that its
+ * data starts on the next 'align' boundary. */
+static size_t sharedMemoryPlaceRing(redisSharedMemoryContext *ctx, size_t end) {
+    size_t header = fifoHeaderSize(ctx->ring_version);
+    if (ctx->align == 0) {
+        return end;
+    }
+    return ((end + header + ctx->align - 1) & ~(ctx->align - 1)) - header;
+}
+
+static void sharedMemoryGetLayout(redisSharedMemoryContext *ctx, sharedMemoryLayout *layout) {
+    size_t end, page;
+    
+    layout->to_server = sharedMemoryPlaceRing(ctx,0);
+    end = layout->to_server + fifoFootprint(ctx->ring_version,ctx->to_server_size);
+    layout->to_client = sharedMemoryPlaceRing(ctx,end);
+    end = layout->to_client + fifoFootprint(ctx->ring_version,ctx->to_client_size);
+    layout->control = 0;
+    layout->size = end;
+    if (ctx->flags & (SHARED_MEMORY_OPT_ADAPTIVE_WAIT|SHARED_MEMORY_OPT_DOORBELL|
+                      SHARED_MEMORY_OPT_HEARTBEAT)) {
+        layout->control = (end + 63) & ~(size_t)63;
+        layout->size = layout->control + sizeof(sharedMemoryControl);
+    }
+    layout->slab = 0;
+    if (ctx->slab_size) {
+        page = sysconf(_SC_PAGESIZE);
+        layout->slab = (layout->size + page - 1) & ~(page - 1);
+        layout->size = layout->slab + ctx->slab_size;
+    }
+}
+
+/* Maps the page before a ring's data, holding its header, then the data 
+ * twice in a row, so that a span running over the end of the data goes on 
+ * from its beginning. 'at' has page+2*size reserved bytes. */
+static volatile void *sharedMemoryMapRing(redisSharedMemoryContext *ctx, char *at, 
+        int fd, size_t offset, size_t size) {
+    size_t data = offset + fifoHeaderSize(ctx->ring_version);
+    size_t page = ctx->align;
+    
+    if (mmap(at,page+size,(PROT_READ|PROT_WRITE),MAP_SHARED|MAP_FIXED,fd,data-page) == MAP_FAILED ||
+            mmap(at+page+size,size,(PROT_READ|PROT_WRITE),MAP_SHARED|MAP_FIXED,fd,data) == MAP_FAILED) {
+        return NULL;
+    }
+    return at + page - fifoHeaderSize(ctx->ring_version);
+}
+
+/* With SHARED_MEMORY_OPT_MIRROR, the pieces of the file are laid out in a
+ * reserved range of addresses: each ring as by sharedMemoryMapRing, then the
+ * pages holding the control block, then the slab. */
+static int sharedMemoryMapMirrored(redisSharedMemoryContext *ctx, int fd, 
+        const sharedMemoryLayout *layout) {
+    size_t page = ctx->align;
+    size_t control_start = layout->control & ~(page - 1);
+    size_t control_len = layout->control ? 
+            ((layout->control + sizeof(sharedMemoryControl) - control_start + page - 1) & ~(page - 1)) : 0;
+    char *at;
+    
+#ifdef MAP_ANONYMOUS
+    ctx->mem_size = page + 2*ctx->to_server_size + page + 2*ctx->to_client_size + control_len + ctx->slab_size;
+    ctx->mem = mmap(NULL,ctx->mem_size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+#endif
+    if (ctx->mem == MAP_FAILED) {
+        return 0;
+    }
+    at = ctx->mem;
+    ctx->to_server = sharedMemoryMapRing(ctx,at,fd,layout->to_server,ctx->to_server_size);
+    at += page + 2*ctx->to_server_size;
+    ctx->to_client = sharedMemoryMapRing(ctx,at,fd,layout->to_client,ctx->to_client_size);
+    at += page + 2*ctx->to_client_size;
+    if (ctx->to_server == NULL || ctx->to_client == NULL) {
+        return 0;
+    }
+    if (layout->control) {
+        if (mmap(at,control_len,(PROT_READ|PROT_WRITE),MAP_SHARED|MAP_FIXED,fd,control_start) == MAP_FAILED) {
+            return 0;
+        }
+        ctx->control = (sharedMemoryControl*)(at + layout->control - control_start);
+        at += control_len;
+    }
+    if (layout->slab) {
+        if (mmap(at,ctx->slab_size,(PROT_READ|PROT_WRITE),MAP_SHARED|MAP_FIXED,fd,layout->slab) == MAP_FAILED) {
+            return 0;
+        }
+        ctx->slab = at;
+    }
+    return 1;
+}
+
+static int sharedMemoryMap(redisSharedMemoryContext *ctx, int fd, const sharedMemoryLayout *layout) {
+    if (ctx->align) {
+        return sharedMemoryMapMirrored(ctx,fd,layout);
+    }
+    ctx->mem_size = layout->size;
+    ctx->mem = mmap(NULL,ctx->mem_size,(PROT_READ|PROT_WRITE),MAP_SHARED,fd,0);
+    if (ctx->mem == MAP_FAILED) {
+        return 0;
+    }
+    ctx->to_server = (char*)ctx->mem + layout->to_server;
+    ctx->to_client = (char*)ctx->mem + layout->to_client;
+    if (layout->control) {
+        ctx->control = (sharedMemoryControl*)((char*)ctx->mem + layout->control);
+    }
+    if (layout->slab) {
+        ctx->slab = (char*)ctx->mem + layout->slab;
+    }
+    return 1;
+}
+
+/* Applies the placement options to the fresh mapping. The NUMA policy goes
+ * first, since it only steers pages not faulted in yet. It is kept by the 
+ * shared memory object, so it holds for the server's accesses too. */
+static int sharedMemoryPlace(redisContext *c, const redisSharedMemoryOptions *options) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    size_t page = sysconf(_SC_PAGESIZE);
+    volatile char *p = ctx->mem;
+    size_t i;
+    
+    if (options->flags & SHARED_MEMORY_OPT_NUMA_BIND) {
+#if defined(__linux__) && defined(SYS_mbind)
+        unsigned long nodemask[1024 / (8*sizeof(unsigned long))];
+        size_t bits = 8*sizeof(unsigned long);
+        
+        if (options->numa_node < 0 || (size_t)options->numa_node >= 8*sizeof(nodemask)) {
+            __redisSetError(c,REDIS_ERR_OTHER,"Invalid NUMA node");
+            return 0;
+        }
+        memset(nodemask,0,sizeof(nodemask));
+        nodemask[options->numa_node / bits] |= 1UL << (options->numa_node % bits);
+        if (syscall(SYS_mbind,ctx->mem,ctx->mem_size,MPOL_BIND,nodemask,
+                    8*sizeof(nodemask),MPOL_MF_MOVE) != 0) {
+            __redisSetError(c,REDIS_ERR_OTHER,"Can't bind shared memory to the NUMA node");
+            return 0;
+        }
+#else
+        __redisSetError(c,REDIS_ERR_OTHER,"NUMA binding is not supported");
+        return 0;
+#endif
+    }
+    if (options->flags & SHARED_MEMORY_OPT_HUGEPAGES) {
+#ifdef MADV_HUGEPAGE
+        if (madvise(ctx->mem,ctx->mem_size,MADV_HUGEPAGE) != 0) {
+            __redisSetError(c,REDIS_ERR_OTHER,"Can't use huge pages for shared memory");
+            return 0;
+        }
+#else
+        __redisSetError(c,REDIS_ERR_OTHER,"Huge pages are not supported");
+        return 0;
+#endif
+    }
+    if (options->flags & SHARED_MEMORY_OPT_PREFAULT) {
+        /* Writing, since a read may only map the zero page. Nothing else 
+         * uses the memory yet. */
+        for (i = 0; i < ctx->mem_size; i += page) {
+            p[i] = 0;
+        }
+    }
+    if ((options->flags & SHARED_MEMORY_OPT_LOCK) && mlock(ctx->mem,ctx->mem_size) != 0) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Can't lock shared memory");
+        return 0;
+    }
+    return 1;
+}
+
+static int sharedMemoryContextInit(redisContext *c, const redisSharedMemoryOptions *options) {
+    int fd, version;
+    mode_t mode;
+    size_t to_server_size, to_client_size, align = 0, page;
+    sharedMemoryLayout layout;
+    
+    mode = options->mode ? options->mode : SHARED_MEMORY_DEFAULT_MODE;
+    to_server_size = options->to_server_size ? options->to_server_size 
+                                             : SHARED_MEMORY_DEFAULT_BUF_SIZE;
+    to_client_size = options->to_client_size ? options->to_client_size 
+                                             : SHARED_MEMORY_DEFAULT_BUF_SIZE;
+    if (options->flags & SHARED_MEMORY_OPT_MIRROR) {
+        /* A mirror needs whole pages. */
+        align = sysconf(_SC_PAGESIZE);
+        to_server_size = (to_server_size + align - 1) & ~(align - 1);
+        to_client_size = (to_client_size + align - 1) & ~(align - 1);
+    }
+    if (!sharedMemoryValidBufSize(to_server_size) || 
+            !sharedMemoryValidBufSize(to_client_size)) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Invalid shared memory buffer size");
+        return 0;
+    }
+    if ((options->flags & SHARED_MEMORY_OPT_DOORBELL) && 
+            c->connection_type != REDIS_CONN_UNIX) {
+        /* The eventfd is passed as SCM_RIGHTS. */
+        __redisSetError(c,REDIS_ERR_OTHER,
+                        "Shared memory doorbell needs a unix socket connection");
+        return 0;
+    }
+    if ((options->flags & SHARED_MEMORY_OPT_SLAB) && options->slab_size > SHARED_MEMORY_MAX_BUF_SIZE) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Invalid shared memory slab size");
+        return 0;
+    }
+    if ((options->flags & SHARED_MEMORY_OPT_MEMFD) && 
+            c->connection_type != REDIS_CONN_UNIX) {
+        __redisSetError(c,REDIS_ERR_OTHER,
+                        "Shared memory descriptors need a unix socket connection");
+        return 0;
+    }
     
     c->shm_context = malloc(sizeof(redisSharedMemoryContext));
     if (c->shm_context == NULL) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return 0;
     }
+    c->shm_context->mapping = malloc(sizeof(sharedMemoryMapping));
+    if (c->shm_context->mapping == NULL) {
+        free(c->shm_context);
+        c->shm_context = NULL;
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return 0;
+    }
+    c->shm_context->mapping->refs = 1;
     
     c->shm_context->mem = MAP_FAILED;
     c->shm_context->name[0] = '\0';
+    c->shm_context->open_pending = 1;
+    c->shm_context->proto_version = SHARED_MEMORY_PROTO_VERSION;
+    c->shm_context->segment_fd = -1;
+    c->shm_context->doorbell_fd = -1;
+    c->shm_context->fds_pending = 0;
     c->shm_context->mode = SHARED_MEMORY_DEFAULT_MODE;
-    
-    /* Use standard UUID to distinguish among clients. */
-    if (!getRandomUUID(c, c->shm_context->name+1, sizeof(c->shm_context->name)-2)) {
-        return 0;
+    c->shm_context->flags = options->flags;
+    if (options->flags & SHARED_MEMORY_OPT_LEASED_READ) {
+        c->shm_context->flags |= SHARED_MEMORY_OPT_ZERO_COPY_READ;
+    }
+    c->shm_context->ring_version = version = 
+            (options->flags & SHARED_MEMORY_OPT_RING_V2) ? 2 : 1;
+    c->shm_context->spin_ns = options->spin_ns ? options->spin_ns 
+                                               : SHARED_MEMORY_DEFAULT_SPIN_NS;
+    c->shm_context->yield_ns = options->yield_ns ? options->yield_ns 
+                                                 : SHARED_MEMORY_DEFAULT_YIELD_NS;
+    c->shm_context->heartbeat_ns = 0;
+    if (options->flags & SHARED_MEMORY_OPT_HEARTBEAT) {
+        /* Whole milliseconds, as sent to the server. */
+        c->shm_context->heartbeat_ns = options->heartbeat_ns ? options->heartbeat_ns 
+                                                             : SHARED_MEMORY_DEFAULT_HEARTBEAT_NS;
+        c->shm_context->heartbeat_ns = (c->shm_context->heartbeat_ns + 999999) / 1000000 * 1000000;
+    }
+    c->shm_context->to_server_size = to_server_size;
+    c->shm_context->to_client_size = to_client_size;
+    c->shm_context->align = align;
+    c->shm_context->control = NULL;
+    c->shm_context->slab = NULL;
+    c->shm_context->slab_size = 0;
+    if (options->flags & SHARED_MEMORY_OPT_SLAB) {
+        c->shm_context->slab_size = options->slab_size ? options->slab_size 
+                                                       : SHARED_MEMORY_DEFAULT_SLAB_SIZE;
+        page = sysconf(_SC_PAGESIZE);
+        c->shm_context->slab_size = (c->shm_context->slab_size + page - 1) & ~(page - 1);
     }
-    c->shm_context->name[0] = '/';
-    c->shm_context->name[sizeof(c->shm_context->name)-1] = '\0';
+    c->shm_context->uncommitted = 0;
+    c->shm_context->unconsumed = 0;
+    c->shm_context->consumed = 0;
+    c->shm_context->parse_base = NULL;
+    c->shm_context->parse_pos = 0;
+    c->shm_context->leases = NULL;
+    c->shm_context->last_lease = NULL;
+    c->shm_context->poller = NULL;
+    c->shm_context->poller_direct = 0;
+    c->shm_context->poller_detaching = 0;
+    c->shm_context->poll_armed = 0;
+    c->shm_context->poll_seen = 0;
+    sharedMemoryGetLayout(c->shm_context,&layout);
+    c->shm_context->slab_offset = layout.slab;
     c->shm_context->mode = mode;
     
-    /* Get that shared memory up and running! */
-    shm_unlink(c->shm_context->name);
-    fd = shm_open(c->shm_context->name,(O_RDWR|O_CREAT|O_EXCL),mode);
-    if (fd < 0) {
-        sharedMemoryFree(c);
-        __redisSetError(c,REDIS_ERR_OTHER,
-                        "Can't create shared memory file");
-        return 0;
+    if (options->flags & SHARED_MEMORY_OPT_MEMFD) {
+        /* Anonymous, so nothing is left behind on a crash. The descriptor
+         * is kept until it's passed to the server. */
+#ifdef MFD_CLOEXEC
+        fd = memfd_create("hiredis-shm",MFD_CLOEXEC);
+#else
+        fd = -1;
+#endif
+        if (fd < 0) {
+            sharedMemoryFree(c);
+            __redisSetError(c,REDIS_ERR_OTHER,
+                            "Can't create shared memory descriptor");
+            return 0;
+        }
+        c->shm_context->segment_fd = fd;
+        c->shm_context->fds_pending = 1;
+    } else {
+        /* Use standard UUID to distinguish among clients. */
+        if (!getRandomUUID(c, c->shm_context->name+1, sizeof(c->shm_context->name)-2)) {
+            return 0;
+        }
+        c->shm_context->name[0] = '/';
+        c->shm_context->name[sizeof(c->shm_context->name)-1] = '\0';
+        
+        /* Get that shared memory up and running! */
+        shm_unlink(c->shm_context->name);
+        fd = shm_open(c->shm_context->name,(O_RDWR|O_CREAT|O_EXCL),mode);
+        if (fd < 0) {
+            sharedMemoryFree(c);
+            __redisSetError(c,REDIS_ERR_OTHER,
+                            "Can't create shared memory file");
+            return 0;
+        }
     }
-    if (ftruncate(fd,sizeof(sharedMemory)) != 0) {
+    if (ftruncate(fd,layout.size) != 0) {
+        if (fd != c->shm_context->segment_fd) {
+            close(fd);
+        }
         sharedMemoryFree(c);
         __redisSetError(c,REDIS_ERR_OOM,"Out of shared memory");
         return 0;
     }
-    c->shm_context->mem = mmap(NULL,sizeof(sharedMemory),
-                            (PROT_READ|PROT_WRITE),MAP_SHARED,fd,0);
-    if (c->shm_context->mem == MAP_FAILED) {
+    if (!sharedMemoryMap(c->shm_context,fd,&layout)) {
+        if (fd != c->shm_context->segment_fd) {
+            close(fd);
+        }
         sharedMemoryFree(c);
         __redisSetError(c,REDIS_ERR_OTHER,
                         "Can't mmap the shared memory file");
         return 0;
     }
-    close(fd);
+    if (fd != c->shm_context->segment_fd) {
+        close(fd);
+    }
+    if (!sharedMemoryPlace(c,options)) {
+        sharedMemoryFree(c);
+        return 0;
+    }
+    
+    /* ftruncate zero-filled the control block, which is its initial state. */
+    fifoInit(version, c->shm_context->to_server, to_server_size);
+    fifoInit(version, c->shm_context->to_client, to_client_size);
+    
+    if (options->flags & SHARED_MEMORY_OPT_DOORBELL) {
+#ifdef __linux__
+        c->shm_context->doorbell_fd = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+#endif
+        if (c->shm_context->doorbell_fd == -1) {
+            sharedMemoryFree(c);
+            __redisSetError(c,REDIS_ERR_OTHER,
+                            "Can't create the shared memory doorbell");
+            return 0;
+        }
+        c->shm_context->fds_pending = 1;
+    }
+    
+    return 1;
+}
+
+static void sharedMemoryUnref(sharedMemoryMapping *mapping) {
+    if (atomic_fetch_sub_explicit(&mapping->refs, 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+    if (mapping->mem != MAP_FAILED) {
+        munmap(mapping->mem,mapping->size);
+    }
+    free(mapping);
+}
+
+/* Runs wherever the reply is freed, possibly in another thread, and after
+ * the context is gone. */
+static void sharedMemoryReleaseLease(redisLease *base) {
+    sharedMemoryLease *lease = (sharedMemoryLease*)base;
+    
+    atomic_store_explicit(lease->in_use, 0, memory_order_release);
+    sharedMemoryUnref(lease->mapping);
+    free(lease);
+}
+
+/* The redisReader oob hook, lending out a string of the slab. The block is
+ * checked against the descriptor, so a confused server can't make a reply 
+ * point outside the slab. */
+static int sharedMemoryBorrow(void *oobdata, size_t offset, size_t len, 
+        unsigned long long generation, char **str, redisLease **lease) {
+    redisSharedMemoryContext *ctx = oobdata;
+    sharedMemorySlabBlock *block;
+    sharedMemoryLease *l;
+    uint64_t size;
+    
+    if (offset % SHARED_MEMORY_SLAB_BLOCK_ALIGN != 0 || 
+            offset > ctx->slab_size - sizeof(sharedMemorySlabBlock)) {
+        return REDIS_ERR_PROTOCOL;
+    }
+    block = (sharedMemorySlabBlock*)(ctx->slab + offset);
+    if (!atomic_load_explicit(&block->in_use, memory_order_acquire) || 
+            block->generation != generation) {
+        return REDIS_ERR_PROTOCOL;
+    }
+    size = block->size;
+    if (size <= sizeof(sharedMemorySlabBlock) || size > ctx->slab_size - offset || 
+            len >= size - sizeof(sharedMemorySlabBlock) ||
+            ((char*)(block + 1))[len] != '\0') {
+        return REDIS_ERR_PROTOCOL;
+    }
+    
+    l = malloc(sizeof(*l));
+    if (l == NULL) {
+        return REDIS_ERR_OOM;
+    }
+    l->base.release = sharedMemoryReleaseLease;
+    l->mapping = ctx->mapping;
+    l->in_use = &block->in_use;
+    atomic_fetch_add_explicit(&ctx->mapping->refs, 1, memory_order_relaxed);
+    *str = (char*)(block + 1);
+    *lease = &l->base;
+    return 0;
+}
+
+/* Drops a reference to a ring lease, freeing it with the last one. */
+static void sharedMemoryUnrefRingLease(sharedMemoryRingLease *lease) {
+    if (atomic_fetch_sub_explicit(&lease->refs, 1, memory_order_acq_rel) == 1) {
+        free(lease);
+    }
+}
+
+/* Like sharedMemoryReleaseLease, the context may be gone or busy in another
+ * thread, so only the reply's reference is dropped. The context notices the
+ * lease is released next time it consumes. */
+static void sharedMemoryReleaseRingLease(redisLease *base) {
+    sharedMemoryRingLease *lease = (sharedMemoryRingLease*)base;
+    sharedMemoryMapping *mapping = lease->mapping;
+    
+    sharedMemoryUnrefRingLease(lease);
+    sharedMemoryUnref(mapping);
+}
+
+/* Drops the released leases at the front of the queue. */
+static void sharedMemoryCollectLeases(redisSharedMemoryContext *ctx) {
+    sharedMemoryRingLease *lease;
+    
+    while ((lease = ctx->leases) != NULL && 
+            atomic_load_explicit(&lease->refs, memory_order_acquire) == 1) {
+        ctx->leases = lease->next;
+        sharedMemoryUnrefRingLease(lease);
+    }
+    if (ctx->leases == NULL) {
+        ctx->last_lease = NULL;
+    }
+}
+
+/* The redisReader lend hook, lending out a string parsed in place out of
+ * the to_client ring. */
+static redisLease *sharedMemoryLend(void *lenddata, char *str, size_t len) {
+    redisSharedMemoryContext *ctx = lenddata;
+    sharedMemoryRingLease *lease;
+    size_t start, held_from;
+    
+    if (len < SHARED_MEMORY_LEASE_MIN_LEN) {
+        return NULL;
+    }
+    sharedMemoryCollectLeases(ctx);
+    start = ctx->parse_pos + (size_t)(str - ctx->parse_base);
+    held_from = ctx->leases != NULL ? ctx->leases->start : start;
+    if (start + len + 2 - held_from > ctx->to_client_size / SHARED_MEMORY_LEASE_DIVISOR) {
+        return NULL;
+    }
     
-    sharedMemoryBufferInit(&c->shm_context->mem->to_server);
-    sharedMemoryBufferInit(&c->shm_context->mem->to_client);
+    lease = malloc(sizeof(*lease));
+    if (lease == NULL) {
+        return NULL;
+    }
+    lease->base.release = sharedMemoryReleaseRingLease;
+    lease->mapping = ctx->mapping;
+    lease->refs = 2;
+    lease->start = start;
+    lease->next = NULL;
+    atomic_fetch_add_explicit(&ctx->mapping->refs, 1, memory_order_relaxed);
+    if (ctx->last_lease != NULL) {
+        ctx->last_lease->next = lease;
+    } else {
+        ctx->leases = lease;
+    }
+    ctx->last_lease = lease;
+    /* The '\r' is ours until the lease lets go of the ring. */
+    str[len] = '\0';
+    return &lease->base;
+}
+
+/* Capabilities requested by the options. */
+static int sharedMemoryCaps(redisSharedMemoryContext *ctx) {
+    int caps = 0;
     
+    if (ctx->ring_version == 2) {
+        caps |= SHARED_MEMORY_CAP_RING_V2;
+    }
+    if (ctx->align) {
+        caps |= SHARED_MEMORY_CAP_ALIGN;
+    }
+    if (ctx->flags & SHARED_MEMORY_OPT_MEMFD) {
+        caps |= SHARED_MEMORY_CAP_MEMFD;
+    }
+    if (ctx->flags & SHARED_MEMORY_OPT_ADAPTIVE_WAIT) {
+        caps |= SHARED_MEMORY_CAP_FUTEX;
+    }
+    if (ctx->doorbell_fd != -1) {
+        caps |= SHARED_MEMORY_CAP_DOORBELL;
+    }
+    if (ctx->heartbeat_ns) {
+        caps |= SHARED_MEMORY_CAP_HEARTBEAT;
+    }
+    if (ctx->slab != NULL) {
+        caps |= SHARED_MEMORY_CAP_SLAB;
+    }
+    return caps;
+}
+
+/* A version 2 acknowledgement is an array of the version, the granted 
+ * capabilities, then pairs of a parameter name and an integer. Unknown 
+ * parameters are skipped, so servers may add some. */
+static int sharedMemoryApplyGrant(redisContext *c, redisReply *reply) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    int requested = sharedMemoryCaps(ctx);
+    long long granted;
+    redisReply *name, *value;
+    size_t i;
+    
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements < 2 ||
+            reply->element[0]->type != REDIS_REPLY_INTEGER || reply->element[0]->integer != 2 ||
+            reply->element[1]->type != REDIS_REPLY_INTEGER) {
+        return 0;
+    }
+    granted = reply->element[1]->integer;
+    if ((requested & SHARED_MEMORY_CAPS_REQUIRED) & ~granted) {
+        return 0;
+    }
+    
+    if (!(granted & SHARED_MEMORY_CAP_FUTEX)) {
+        ctx->flags &= ~SHARED_MEMORY_OPT_ADAPTIVE_WAIT;
+    }
+    if (!(granted & SHARED_MEMORY_CAP_DOORBELL) && ctx->doorbell_fd != -1) {
+        close(ctx->doorbell_fd);
+        ctx->doorbell_fd = -1;
+        ctx->flags &= ~SHARED_MEMORY_OPT_DOORBELL;
+    }
+    if (!(granted & SHARED_MEMORY_CAP_HEARTBEAT)) {
+        ctx->heartbeat_ns = 0;
+    }
+    if (!(granted & SHARED_MEMORY_CAP_SLAB)) {
+        ctx->slab = NULL;
+    }
+    for (i = 2; i + 1 < reply->elements; i += 2) {
+        name = reply->element[i];
+        value = reply->element[i+1];
+        if (name->type != REDIS_REPLY_STRING && name->type != REDIS_REPLY_STATUS) {
+            return 0;
+        }
+        if (value->type != REDIS_REPLY_INTEGER) {
+            continue;
+        }
+        if (!strcasecmp(name->str,"HEARTBEAT") && ctx->heartbeat_ns && value->integer > 0) {
+            /* The period the server actually beats at. */
+            ctx->heartbeat_ns = value->integer * 1000000;
+        }
+    }
     return 1;
 }
 
+static int sharedMemoryAccepted(redisContext *c, redisReply *reply) {
+    if (reply == NULL) {
+        return 0;
+    }
+    if (c->shm_context->proto_version == 1) {
+        return reply->type == REDIS_REPLY_INTEGER && reply->integer == 1;
+    }
+    return sharedMemoryApplyGrant(c,reply);
+}
+
 static void sharedMemoryProcessShmOpenReply(redisContext *c, redisReply *reply)
 {
     /* Unlink the shared memory file now. This limits the possibility to leak 
      * an shm file on crash. */
-    shm_unlink(c->shm_context->name);
-    c->shm_context->name[0] = '\0';
+    if (c->shm_context->name[0] != '\0') {
+        shm_unlink(c->shm_context->name);
+        c->shm_context->name[0] = '\0';
+    }
+    /* The mapping and the server's copy keep the memory alive. */
+    if (c->shm_context->segment_fd != -1) {
+        close(c->shm_context->segment_fd);
+        c->shm_context->segment_fd = -1;
+    }
+    c->shm_context->open_pending = 0;
 
-    if (reply != NULL && reply->type == REDIS_REPLY_INTEGER && reply->integer == 1) {
-        /* We got ourselves a shared memory! */
+    if (sharedMemoryAccepted(c, reply)) {
+        /* We got ourselves a shared memory! Arm the doorbell for the first 
+         * reply, later reads rearm it. */
+        if (c->shm_context->slab != NULL) {
+            c->reader->oob = sharedMemoryBorrow;
+            c->reader->oobdata = c->shm_context;
+        }
+        if (c->shm_context->flags & SHARED_MEMORY_OPT_LEASED_READ) {
+            c->reader->lend = sharedMemoryLend;
+            c->reader->lenddata = c->shm_context;
+        }
+        if (c->shm_context->doorbell_fd != -1) {
+            atomic_store_explicit(&c->shm_context->control->to_client.waiting, 1, 
+                                  memory_order_seq_cst);
+        }
     } else {
         sharedMemoryFree(c);
     }
 }
 
-static int formatCommand(char **cmd, const char *format, ...) {
-    int len;
-
-    va_list ap;
-    va_start(ap, format);
-    len = redisvFormatCommand(cmd, format, ap);
-    va_end(ap);
+/* A server rejecting SHM.OPEN 2 may still speak version 1, so the command is
+ * queued again in that version, without the heartbeat it doesn't know of. 
+ * Returns 1 when it was, the reply to that one then stands for 'reply'. */
+static int sharedMemoryFallBack(redisContext *c, redisReply *reply) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    char *cmd;
+    int len, status;
     
-    return len;
+    if (ctx->proto_version == 1 || reply == NULL || reply->type != REDIS_REPLY_ERROR) {
+        return 0;
+    }
+    ctx->proto_version = 1;
+    ctx->heartbeat_ns = 0;
+    ctx->slab = NULL;
+    /* The server has dropped the descriptors along with the command. */
+    ctx->fds_pending = ctx->segment_fd != -1 || ctx->doorbell_fd != -1;
+    
+    len = sharedMemoryFormatShmOpen(c,&cmd);
+    if (len < 0) {
+        return 0;
+    }
+    status = redisAppendFormattedCommand(c,cmd,len);
+    redisFreeCommand(cmd);
+    return status == REDIS_OK;
 }
 
 int sharedMemoryFormatShmOpen(redisContext *c, char **cmd) {
-    return formatCommand(cmd,"SHM.OPEN %d %s",SHARED_MEMORY_PROTO_VERSION,c->shm_context->name);
+    redisSharedMemoryContext *ctx = c->shm_context;
+    const char *argv[19];
+    char version[16], caps[16], to_server_size[32], to_client_size[32], align[32], heartbeat[32];
+    char slab_offset[32], slab_size[32];
+    int argc = 0;
+    
+    snprintf(version,sizeof(version),"%d",ctx->proto_version);
+    argv[argc++] = "SHM.OPEN";
+    argv[argc++] = version;
+    /* A memfd travels with the command instead of being named. */
+    argv[argc++] = (ctx->flags & SHARED_MEMORY_OPT_MEMFD) ? "FD" : ctx->name;
+    snprintf(to_server_size,sizeof(to_server_size),"%zu",ctx->to_server_size);
+    snprintf(to_client_size,sizeof(to_client_size),"%zu",ctx->to_client_size);
+    snprintf(align,sizeof(align),"%zu",ctx->align);
+    
+    if (ctx->proto_version == 2) {
+        /* Features are capabilities, parameters are always sent. */
+        snprintf(caps,sizeof(caps),"%d",sharedMemoryCaps(ctx));
+        argv[argc++] = "CAPS";
+        argv[argc++] = caps;
+        argv[argc++] = "BUFFERS";
+        argv[argc++] = to_server_size;
+        argv[argc++] = to_client_size;
+        if (ctx->align) {
+            argv[argc++] = "ALIGN";
+            argv[argc++] = align;
+        }
+        if (ctx->heartbeat_ns) {
+            snprintf(heartbeat,sizeof(heartbeat),"%lld",ctx->heartbeat_ns / 1000000);
+            argv[argc++] = "HEARTBEAT";
+            argv[argc++] = heartbeat;
+        }
+        if (ctx->slab != NULL) {
+            snprintf(slab_offset,sizeof(slab_offset),"%zu",ctx->slab_offset);
+            snprintf(slab_size,sizeof(slab_size),"%zu",ctx->slab_size);
+            argv[argc++] = "SLAB";
+            argv[argc++] = slab_offset;
+            argv[argc++] = slab_size;
+        }
+        return (int)redisFormatCommandArgv(cmd,argc,argv,NULL);
+    }
+    
+    /* Any server understands the default layout, so options are only 
+     * sent when used. */
+    if (ctx->to_server_size != SHARED_MEMORY_DEFAULT_BUF_SIZE ||
+            ctx->to_client_size != SHARED_MEMORY_DEFAULT_BUF_SIZE) {
+        argv[argc++] = "BUFFERS";
+        argv[argc++] = to_server_size;
+        argv[argc++] = to_client_size;
+    }
+    if (ctx->ring_version == 2) {
+        argv[argc++] = "RING";
+        argv[argc++] = "2";
+    }
+    if (ctx->align) {
+        argv[argc++] = "ALIGN";
+        argv[argc++] = align;
+    }
+    if (ctx->flags & SHARED_MEMORY_OPT_ADAPTIVE_WAIT) {
+        argv[argc++] = "WAKEUP";
+        argv[argc++] = "FUTEX";
+    }
+    if (ctx->doorbell_fd != -1) {
+        argv[argc++] = "DOORBELL";
+        argv[argc++] = "EVENTFD";
+    }
+    
+    return (int)redisFormatCommandArgv(cmd,argc,argv,NULL);
 }
 
 /*TODO?: Allow the user to communicate through user's channels, not require TCP or socket? 
  * ^ Complicates the API and implementation, but does it solve any real world issue? */
 static redisReply *sharedMemoryEstablishCommunication(redisContext *c) {
     
-    redisReply *reply;
-    redisSharedMemoryContext *tmp;
+    redisReply *reply = NULL;
+    char *cmd;
+    int len;
     
-    /* Temporarily disabling the shm context, so the command does not attempt to
-     * be sent through the shared memory. */
-    tmp = c->shm_context;
-    c->shm_context = NULL;
-    reply = redisCommand(c,"SHM.OPEN %d %s",SHARED_MEMORY_PROTO_VERSION,tmp->name);
-    c->shm_context = tmp;
+    len = sharedMemoryFormatShmOpen(c,&cmd);
+    if (len < 0) {
+        sharedMemoryFree(c);
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return NULL;
+    }
+    
+    /* Until the reply is processed, sharedMemoryIsInitialized is false, so 
+     * the command goes through the socket, with the doorbell attached. */
+    if (redisAppendFormattedCommand(c,cmd,len) == REDIS_OK && (c->flags & REDIS_BLOCK)) {
+        if (redisGetReply(c,(void**)&reply) != REDIS_OK) {
+            reply = NULL;
+        }
+        if (sharedMemoryFallBack(c,reply)) {
+            freeReplyObject(reply);
+            if (redisGetReply(c,(void**)&reply) != REDIS_OK) {
+                reply = NULL;
+            }
+        }
+    }
+    redisFreeCommand(cmd);
 
     if (c->flags & REDIS_BLOCK) {
         sharedMemoryProcessShmOpenReply(c, reply);
@@ -201,13 +1106,13 @@ static redisReply *sharedMemoryEstablishCommunication(redisContext *c) {
     return reply;
 }
 
-redisReply *sharedMemoryInit(redisContext *c, mode_t mode) {
+redisReply *sharedMemoryInit(redisContext *c, const redisSharedMemoryOptions *options) {
     /* In a non-blocking context, NULL is always returned, so to recognize
      * and error from success, the old context error needs to be nullified. */ 
     c->err = 0;
     memset(c->errstr, '\0', strlen(c->errstr));
 
-    int ok = sharedMemoryContextInit(c,mode);
+    int ok = sharedMemoryContextInit(c,options);
     if (!ok) {
         return NULL;
     }
@@ -217,35 +1122,294 @@ redisReply *sharedMemoryInit(redisContext *c, mode_t mode) {
 int sharedMemoryIsInitialized(struct redisContext *c) {
     /* Until sharedMemoryProcessShmOpenReply is called, the context is only
      * partially initialized. */
-    return c->shm_context != NULL && c->shm_context->name[0] == '\0';
+    return c->shm_context != NULL && !c->shm_context->open_pending;
 }
 
-void sharedMemoryInitAfterReply(struct redisContext *c, redisReply *reply)
+int sharedMemoryInitAfterReply(struct redisContext *c, redisReply *reply)
 {
     if (!(c->flags & REDIS_BLOCK) 
-            && c->shm_context != NULL && c->shm_context->name[0] != '\0') {
+            && c->shm_context != NULL && c->shm_context->open_pending) {
+        if (sharedMemoryFallBack(c, reply)) {
+            return 1;
+        }
         /* A non-blocking context has received the acknowledgement
          * that the shared memory communication was successful or failed. */
         sharedMemoryProcessShmOpenReply(c, reply);
     }
+    return 0;
+}
+
+/* Takes a context being freed off its poller. The poller is freed with the
+ * last context leaving it, so it is still there to be locked. When the poller
+ * detaches the context meanwhile, waits until it is done with it. */
+static void sharedMemoryLeavePoller(redisSharedMemoryContext *ctx, redisContext *c) {
+    struct redisSharedMemoryPoller *poller;
+    
+    poller = atomic_exchange_explicit(&ctx->poller, NULL, memory_order_seq_cst);
+    if (poller != NULL) {
+        sharedMemoryPollerForget(poller, c);
+        sharedMemoryPollerRelease(poller);
+        return;
+    }
+    while (atomic_load_explicit(&ctx->poller_detaching, memory_order_acquire)) {
+        sched_yield();
+    }
 }
 
 void sharedMemoryFree(redisContext *c) {
+    sharedMemoryRingLease *lease;
+    
     if (c->shm_context == NULL) {
         return;
     }
     
-    if (c->shm_context->mem != MAP_FAILED) {
-        munmap(c->shm_context->mem,sizeof(sharedMemory));
+    sharedMemoryLeavePoller(c->shm_context, c);
+    if (c->shm_context->heartbeat_ns && !c->shm_context->open_pending && 
+            c->shm_context->control != NULL) {
+        /* Lets the server drop us without waiting for the socket. */
+        atomic_store_explicit(&c->shm_context->control->liveness.client_closed, 1,
+                              memory_order_release);
+        sharedMemoryRing(c,&c->shm_context->control->to_server);
+        sharedMemoryRing(c,&c->shm_context->control->to_client);
+    }
+    if (c->reader != NULL && c->reader->oobdata == c->shm_context) {
+        c->reader->oob = NULL;
+        c->reader->oobdata = NULL;
     }
+    if (c->reader != NULL && c->reader->lenddata == c->shm_context) {
+        c->reader->lend = NULL;
+        c->reader->lenddata = NULL;
+    }
+    while ((lease = c->shm_context->leases) != NULL) {
+        c->shm_context->leases = lease->next;
+        sharedMemoryUnrefRingLease(lease);
+    }
+    c->shm_context->mapping->mem = c->shm_context->mem;
+    c->shm_context->mapping->size = c->shm_context->mem_size;
+    sharedMemoryUnref(c->shm_context->mapping);
     if (c->shm_context->name[0] != '\0') {
         shm_unlink(c->shm_context->name);
     }
+    if (c->shm_context->segment_fd != -1) {
+        close(c->shm_context->segment_fd);
+    }
+    if (c->shm_context->doorbell_fd != -1) {
+        close(c->shm_context->doorbell_fd);
+    }
     
     free(c->shm_context);
     c->shm_context = NULL;
 }
 
+int sharedMemoryIsLoopPolled(redisContext *c) {
+    return sharedMemoryIsInitialized(c) && (c->shm_context->flags & SHARED_MEMORY_OPT_LOOP_POLL);
+}
+
+int sharedMemoryDoorbellFd(redisContext *c) {
+    if (!sharedMemoryIsInitialized(c)) {
+        return -1;
+    }
+    return c->shm_context->doorbell_fd;
+}
+
+int sharedMemoryHasPendingFds(redisContext *c) {
+    return c->shm_context != NULL && c->shm_context->fds_pending;
+}
+
+ssize_t sharedMemoryWriteWithFds(redisContext *c) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        char buf[CMSG_SPACE(2*sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    int fds[2], nfds = 0;
+    ssize_t nwritten;
+    
+    /* In this order, as the server expects them. */
+    if (c->shm_context->segment_fd != -1) {
+        fds[nfds++] = c->shm_context->segment_fd;
+    }
+    if (c->shm_context->doorbell_fd != -1) {
+        fds[nfds++] = c->shm_context->doorbell_fd;
+    }
+    
+    iov.iov_base = c->obuf;
+    iov.iov_len = sdslen(c->obuf);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds*sizeof(int));
+    
+    /* Same rules as redisNetWrite. The descriptors travel with the first 
+     * byte written, so they are sent once. */
+    nwritten = sendmsg(c->fd, &msg, 0);
+    if (nwritten < 0) {
+        if ((errno == EWOULDBLOCK && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
+            /* Try again later */
+        } else {
+            __redisSetError(c, REDIS_ERR_IO, NULL);
+            return -1;
+        }
+    } else if (nwritten > 0) {
+        c->shm_context->fds_pending = 0;
+    }
+    return nwritten;
+}
+
+/* With a direct poller or SHARED_MEMORY_OPT_LOOP_POLL, the to_client ring is
+ * read as soon as replies land, and the doorbell is neither armed nor drained. */
+static int sharedMemoryIsPolled(redisSharedMemoryContext *ctx) {
+    return atomic_load_explicit(&ctx->poller_direct, memory_order_relaxed) ||
+           (ctx->flags & SHARED_MEMORY_OPT_LOOP_POLL);
+}
+
+/* The server clears the waiting flag when it signals the doorbell, so it is 
+ * rearmed after each non-blocking read. When data is left over, the event 
+ * loop is woken right away instead. Bytes held by leased replies were seen
+ * already, and do not count as left over. With a poller, the poller thread
+ * watches the ring in place of the server, or reads it itself. The poller can
+ * be removed meanwhile, from another thread: either it sees poll_armed and
+ * rings, or we see it gone, and ring so the next read arms the server. */
+static void sharedMemoryArmDoorbell(redisContext *c) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    sharedMemoryDoorbell *bell = &ctx->control->to_client;
+    size_t held = ctx->unconsumed;
+    uint64_t one = 1;
+    
+    if (sharedMemoryIsPolled(ctx)) {
+        return;
+    }
+    if (fifoUsedSpace(ctx, ctx->to_client, held + 1) <= held) {
+        if (atomic_load_explicit(&ctx->poller, memory_order_relaxed) != NULL) {
+            atomic_store_explicit(&ctx->poll_seen, fifoWriteIndex(ctx, ctx->to_client),
+                                  memory_order_relaxed);
+            atomic_store_explicit(&ctx->poll_armed, 1, memory_order_seq_cst);
+            if (atomic_load_explicit(&ctx->poller, memory_order_seq_cst) == NULL) {
+                atomic_store_explicit(&ctx->poll_armed, 0, memory_order_relaxed);
+                goto ring;
+            }
+        } else {
+            atomic_store_explicit(&bell->waiting, 1, memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_seq_cst);
+        if (fifoUsedSpace(ctx, ctx->to_client, held + 1) <= held) {
+            return;
+        }
+    }
+ring:
+    if (write(c->shm_context->doorbell_fd, &one, sizeof(one)) < 0) {
+        /* Only fails when the counter is about to overflow, i.e. the event
+         * loop is going to wake up anyway. */
+    }
+}
+
+static void sharedMemoryDrainDoorbell(redisContext *c) {
+    uint64_t count;
+    if (read(c->shm_context->doorbell_fd, &count, sizeof(count)) < 0) {
+        /* EAGAIN, nothing to drain. */
+    }
+}
+
+int sharedMemoryPollerAttach(redisContext *c, struct redisSharedMemoryPoller *poller, int direct) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    
+    if (ctx == NULL || atomic_load_explicit(&ctx->poller, memory_order_relaxed) != NULL ||
+            (!direct && ctx->doorbell_fd == -1)) {
+        return REDIS_ERR;
+    }
+    atomic_store_explicit(&ctx->poller_direct, direct, memory_order_relaxed);
+    atomic_store_explicit(&ctx->poller, poller, memory_order_release);
+    return REDIS_OK;
+}
+
+void sharedMemoryPollerDetach(redisContext *c) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    struct redisSharedMemoryPoller *poller;
+    uint64_t one = 1;
+    int direct;
+    
+    if (ctx == NULL || atomic_load_explicit(&ctx->poller, memory_order_relaxed) == NULL) {
+        return;
+    }
+    /* The context may be freed on another thread as soon as the poller is
+     * gone, see sharedMemoryLeavePoller. */
+    atomic_store_explicit(&ctx->poller_detaching, 1, memory_order_seq_cst);
+    direct = atomic_load_explicit(&ctx->poller_direct, memory_order_relaxed);
+    /* Pairs with sharedMemoryArmDoorbell, see there. */
+    poller = atomic_exchange_explicit(&ctx->poller, NULL, memory_order_seq_cst);
+    if (poller != NULL) {
+        atomic_store_explicit(&ctx->poller_direct, 0, memory_order_relaxed);
+        if (ctx->doorbell_fd != -1 && (direct ||
+                atomic_exchange_explicit(&ctx->poll_armed, 0, memory_order_seq_cst))) {
+            /* The event loop arms the server's doorbell on its next read. */
+            if (write(ctx->doorbell_fd, &one, sizeof(one)) < 0) {
+                /* About to overflow, the event loop wakes up anyway. */
+            }
+        }
+    }
+    atomic_store_explicit(&ctx->poller_detaching, 0, memory_order_release);
+    if (poller != NULL) {
+        sharedMemoryPollerRelease(poller);
+    }
+}
+
+struct redisSharedMemoryPoller *sharedMemoryPoller(redisContext *c) {
+    return c->shm_context != NULL ?
+        atomic_load_explicit(&c->shm_context->poller, memory_order_relaxed) : NULL;
+}
+
+int sharedMemoryPollerIsDirect(redisContext *c) {
+    return c->shm_context != NULL &&
+           atomic_load_explicit(&c->shm_context->poller_direct, memory_order_relaxed);
+}
+
+int sharedMemoryPollerNotify(redisContext *c) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    uint64_t one = 1;
+    
+    if (!atomic_load_explicit(&ctx->poll_armed, memory_order_acquire)) {
+        return 0;
+    }
+    if (fifoWriteIndex(ctx, ctx->to_client) == 
+            atomic_load_explicit(&ctx->poll_seen, memory_order_relaxed) &&
+            !sharedMemoryPeerClosed(ctx)) {
+        return 0;
+    }
+    /* The event loop may be rearming concurrently, only one of us rings. */
+    if (!atomic_exchange_explicit(&ctx->poll_armed, 0, memory_order_acq_rel)) {
+        return 0;
+    }
+    if (write(ctx->doorbell_fd, &one, sizeof(one)) < 0) {
+        /* About to overflow, the event loop wakes up anyway. */
+    }
+    return 1;
+}
+
+int sharedMemoryHasReplies(redisContext *c) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    size_t held;
+
+    if (!sharedMemoryIsInitialized(c)) {
+        return 0;
+    }
+    held = ctx->unconsumed;
+    return fifoUsedSpace(ctx, ctx->to_client, held + 1) > held || sharedMemoryPeerClosed(ctx);
+}
+
+int sharedMemoryPollerHasCommands(redisContext *c) {
+    return sharedMemoryIsInitialized(c) &&
+           (sdslen(c->obuf) > 0 || c->shm_context->uncommitted > 0);
+}
+
+#ifndef MSG_DONTWAIT
 static int fdSetBlocking(int fd, int blocking) {
     int flags;
 
@@ -263,21 +1427,171 @@ static int fdSetBlocking(int fd, int blocking) {
     }
     return 1;
 }
+#endif
+
+
+/* State of a blocking call waiting for the server. */
+typedef struct sharedMemoryWaitState {
+    size_t iteration;
+    long long start; /* Monotonic ns when waiting began, 0 if not yet. */
+    unsigned pauses; /* Length of the next pause burst while backing off. */
+    int parked; /* Slept since the last connection check. */
+    uint32_t heartbeat; /* Last heartbeat seen, */
+    long long heartbeat_seen; /* and monotonic ns when it was, 0 if not yet. */
+    long long deadline; /* Coarse monotonic ns the command timeout ends, or 0. */
+    int timed_out;
+} sharedMemoryWaitState;
+
+static long long monotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Within a clock tick, which is plenty for command timeouts, but cheaper
+ * than the precise clock. */
+static long long coarseMonotonicNs(void) {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Sleeps while *addr == val, at most ns nanoseconds. Spurious wakeups are 
+ * fine, the caller rechecks the ring. */
+static void sharedMemoryFutexWait(uint32_t *addr, uint32_t val, long long ns) {
+    struct timespec ts;
+    ts.tv_sec = ns / 1000000000LL;
+    ts.tv_nsec = ns % 1000000000LL;
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, &ts, NULL, 0);
+#else
+    /* No portable way to sleep on a shared address, so poll coarsely. */
+    (void)addr; (void)val;
+    ts.tv_sec = 0;
+    ts.tv_nsec = 50000;
+    nanosleep(&ts, NULL);
+#endif
+}
+
+static void sharedMemoryFutexWake(uint32_t *addr) {
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#else
+    (void)addr;
+#endif
+}
+
+/* Called after moving an index of the ring the doorbell belongs to. The 
+ * fence pairs with the one in sharedMemoryWait: either the waiter sees the 
+ * new index when rechecking the ring, or we see its waiting flag. */
+static void sharedMemoryRing(redisContext *c, sharedMemoryDoorbell *bell) {
+    if (!(c->shm_context->flags & (SHARED_MEMORY_OPT_ADAPTIVE_WAIT|SHARED_MEMORY_OPT_DOORBELL))) {
+        return;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&bell->waiting, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&bell->seq, 1, memory_order_release);
+        sharedMemoryFutexWake(&bell->seq);
+    }
+}
 
+/* Condition a blocking call waits for. */
+typedef int (sharedMemoryReadyFn)(redisSharedMemoryContext *ctx, volatile void *ring, size_t need);
 
-static int isConnectionBroken(redisContext *c, size_t iteration) {
+static int sharedMemoryHasSpace(redisSharedMemoryContext *ctx, volatile void *ring, size_t need) {
+    return fifoFreeSpace(ctx, ring, need) >= need;
+}
+
+static int sharedMemoryHasData(redisSharedMemoryContext *ctx, volatile void *ring, size_t need) {
+    return fifoUsedSpace(ctx, ring, need) >= need;
+}
+
+/* One step of waiting for the server. Without SHARED_MEMORY_OPT_ADAPTIVE_WAIT
+ * the caller simply spins. Otherwise it spins for spin_ns, then backs off with
+ * growing bursts of pause and sched_yield() for yield_ns, then parks on the
+ * doorbell until the server rings it. The clock is only read every 64 spins, 
+ * so the hot path stays as cheap as plain spinning. */
+static void sharedMemoryWait(redisContext *c, sharedMemoryWaitState *ws,
+        sharedMemoryDoorbell *bell, sharedMemoryReadyFn *ready, 
+        volatile void *ring, size_t need) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    long long waited;
+    uint32_t seq;
+    unsigned i;
+    
+    if (!(ctx->flags & (SHARED_MEMORY_OPT_ADAPTIVE_WAIT|SHARED_MEMORY_OPT_DOORBELL))) {
+        return;
+    }
+    if (ws->start == 0) {
+        ws->start = monotonicNs();
+        return;
+    }
+    if (ws->pauses == 0 && (ws->iteration % 64) != 0) {
+        cpuRelax();
+        return;
+    }
+    
+    waited = monotonicNs() - ws->start;
+    if (waited < ctx->spin_ns) {
+        cpuRelax();
+        return;
+    }
+    if (waited < ctx->spin_ns + ctx->yield_ns) {
+        if (ws->pauses == 0) {
+            ws->pauses = 1;
+        }
+        for (i = 0; i < ws->pauses; i++) {
+            cpuRelax();
+        }
+        if (ws->pauses < 1024) {
+            ws->pauses *= 2;
+        }
+        sched_yield();
+        return;
+    }
+    
+    /* Announce the wait before the final recheck, so that a server moving 
+     * the index concurrently either is seen here or sees the flag. */
+    atomic_store_explicit(&bell->waiting, 1, memory_order_relaxed);
+    seq = atomic_load_explicit(&bell->seq, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ready(ctx, ring, need)) {
+        long long park_ns = SHARED_MEMORY_PARK_TIMEOUT_NS, left;
+        if (ws->deadline != 0 && (left = ws->deadline - coarseMonotonicNs()) < park_ns) {
+            /* Past the deadline by a tick of the coarse clock at most. */
+            park_ns = left > 0 ? left + 4000000LL : 1;
+        }
+        sharedMemoryFutexWait(&bell->seq, seq, park_ns);
+        ws->parked = 1;
+        REDIS_STATS_ADD(c, shm_parks, 1);
+    }
+    atomic_store_explicit(&bell->waiting, 0, memory_order_relaxed);
+}
+
+/* Whether the socket reached EOF or failed. Data on it counts as broken too,
+ * the server never sends any once shared memory is in use. */
+static int sharedMemorySocketClosed(redisContext *c) {
+    ssize_t readret;
+    char tmp;
+#ifdef MSG_DONTWAIT
+    /* A single syscall, leaving the blocking mode of the socket alone. */
+    readret = recv(c->fd, &tmp, 1, MSG_PEEK|MSG_DONTWAIT);
+#else
     fd_set rfds;
     struct timeval tv;
     int selret;
-    ssize_t readret;
-    char tmp;
-    
-    /* select() is relatively slow, and even gettimeofday() is. Just skip iterations 
-     * on count, delaying the recognition of broken connections, but keeping normal
-     * latency good. On my reference computer, an iteration takes ~5ns. */
-    if (iteration == 0 || iteration % 10000 != 0) {
-        return 0;
-    }
     
     /* Checking for connection failure with select(). */
     FD_ZERO(&rfds);
@@ -302,34 +1616,155 @@ static int isConnectionBroken(redisContext *c, size_t iteration) {
     if (c->flags & REDIS_BLOCK) {
         fdSetBlocking(c->fd, 1);
     }
+#endif
     
     /* Check for EOF and unexpected behaviour. */
     return (readret >= 0 || (readret == -1 && errno != EAGAIN && errno != EINTR)); 
 }
 
+static int sharedMemoryPeerClosed(redisSharedMemoryContext *ctx) {
+    return ctx->heartbeat_ns && 
+           atomic_load_explicit(&ctx->control->liveness.server_closed, memory_order_acquire);
+}
+
+/* With SHARED_MEMORY_OPT_HEARTBEAT, the closed flag is loaded on every
+ * iteration, and the heartbeat every 64, like the clock in sharedMemoryWait.
+ * The socket is only checked when the heartbeat stalls for two periods, which
+ * also happens while the server runs a slow command, so a stalled heartbeat
+ * alone does not count as broken. */
+static int sharedMemoryHeartbeatBroken(redisContext *c, sharedMemoryWaitState *ws) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    uint32_t heartbeat;
+    long long now;
+    
+    if (sharedMemoryPeerClosed(ctx)) {
+        return 1;
+    }
+    if (ws->parked) {
+        ws->parked = 0;
+    } else if (ws->iteration % 64 != 0) {
+        return 0;
+    }
+    
+    now = monotonicNs();
+    heartbeat = atomic_load_explicit(&ctx->control->liveness.heartbeat, memory_order_relaxed);
+    if (ws->heartbeat_seen == 0 || heartbeat != ws->heartbeat) {
+        ws->heartbeat = heartbeat;
+        ws->heartbeat_seen = now;
+        return 0;
+    }
+    if (now - ws->heartbeat_seen < 2*ctx->heartbeat_ns) {
+        return 0;
+    }
+    ws->heartbeat_seen = now;
+    return sharedMemorySocketClosed(c);
+}
+
+/* With a command timeout, a blocking call gives up once it has waited that
+ * long. The clock is only read from the second iteration on, when the call 
+ * actually waits, and then every 1024 iterations or after a sleep. */
+static int sharedMemoryTimedOut(redisContext *c, sharedMemoryWaitState *ws) {
+    const struct timeval *tv = c->command_timeout;
+    
+    if (ws->iteration == 2 && (c->flags & REDIS_BLOCK) && 
+            tv != NULL && (tv->tv_sec != 0 || tv->tv_usec != 0)) {
+        ws->deadline = coarseMonotonicNs() + 
+                       (long long)tv->tv_sec*1000000000LL + (long long)tv->tv_usec*1000LL;
+        return 0;
+    }
+    if (ws->deadline == 0 || (!ws->parked && ws->iteration % 1024 != 0)) {
+        return 0;
+    }
+    return coarseMonotonicNs() >= ws->deadline;
+}
+
+/* Also true once the command timeout passed, with ws->timed_out set. */
+static int isConnectionBroken(redisContext *c, sharedMemoryWaitState *ws) {
+    ws->iteration++;
+    if (sharedMemoryTimedOut(c, ws)) {
+        ws->timed_out = 1;
+        return 1;
+    }
+    if (c->shm_context->heartbeat_ns) {
+        return sharedMemoryHeartbeatBroken(c, ws);
+    }
+    
+    /* Checking the socket is relatively slow, and even gettimeofday() is. Just skip
+     * iterations on count, delaying the recognition of broken connections, but 
+     * keeping normal latency good. On my reference computer, an iteration takes
+     * ~5ns. After sleeping, latency no longer matters, so check right away. */
+    if (ws->parked) {
+        ws->parked = 0;
+    } else if (ws->iteration == 1 || ws->iteration % 10000 != 0) {
+        return 0;
+    }
+    return sharedMemorySocketClosed(c);
+}
+
+/* Commands and replies are handled in batches. Appended commands are only
+ * published by sharedMemoryFlush, and parsed replies are only released once 
+ * the reader runs out of them, so a pipeline moves each index once. Either
+ * also happens when a quarter of the ring is pending, so the server is not
+ * kept waiting on a long batch. */
+#define SHARED_MEMORY_BATCH_DIVISOR 4
+
+void sharedMemoryFlush(redisContext *c) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    
+    if (ctx->uncommitted == 0) {
+        return;
+    }
+    fifoCommit(ctx,ctx->to_server,ctx->uncommitted);
+    REDIS_STATS_ADD(c, bytes_written, ctx->uncommitted);
+    ctx->uncommitted = 0;
+    sharedMemoryRing(c,ctx->control ? &ctx->control->to_server : NULL);
+}
+
+static void sharedMemoryRelease(redisContext *c) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    size_t release = ctx->unconsumed;
+    
+    if (ctx->leases != NULL) {
+        sharedMemoryCollectLeases(ctx);
+        if (ctx->leases != NULL) {
+            release = ctx->leases->start - ctx->consumed;
+        }
+    }
+    if (release == 0) {
+        return;
+    }
+    fifoConsume(ctx,ctx->to_client,release);
+    ctx->consumed += release;
+    ctx->unconsumed -= release;
+    sharedMemoryRing(c,ctx->control ? &ctx->control->to_client : NULL);
+}
+
 /* PIPE_BUF is usually 4k, but there are no guarantees, therefore I'm being 
  * slightly paranoid. Attempting to comply with POSIX atomic writes needs this.
  * I don't really need those atomic writes because hiredis uses a single writer,
  * but pretty code and stuff. */ 
-#if PIPE_BUF > SHARED_MEMORY_BUF_SIZE
-#error "PIPE_BUF > SHARED_MEMORY_BUF_SIZE"
+#if PIPE_BUF > SHARED_MEMORY_DEFAULT_BUF_SIZE
+#error "PIPE_BUF > SHARED_MEMORY_DEFAULT_BUF_SIZE"
 #endif
 
 ssize_t sharedMemoryWrite(redisContext *c, char *buf, size_t btw) {
-    size_t iteration = 0;
+    sharedMemoryWaitState ws = {0, 0, 0, 0, 0, 0, 0, 0};
     int btw_chunk;
     size_t bw = 0;
     int conn_broken = 0;
-    sharedMemoryBuffer *target = &c->shm_context->mem->to_server;
+    volatile void *target = c->shm_context->to_server;
+    sharedMemoryDoorbell *bell = c->shm_context->control ? &c->shm_context->control->to_server : NULL;
     size_t free;
     do {
-        conn_broken = isConnectionBroken(c, iteration++);
+        conn_broken = isConnectionBroken(c, &ws);
         if (conn_broken) {
             break;
         }
-        free = CharFifo_FreeSpace(target);
+        free = fifoFreeSpace(c->shm_context, target, btw-bw);
         if (btw <= PIPE_BUF && free < btw) { /* POSIX atomic write incomplete? */
             if (c->flags & REDIS_BLOCK) {
+                REDIS_STATS_ADD(c, shm_write_spins, 1);
+                sharedMemoryWait(c, &ws, bell, sharedMemoryHasSpace, target, btw);
                 continue;
             } else {
                 break;
@@ -337,55 +1772,185 @@ ssize_t sharedMemoryWrite(redisContext *c, char *buf, size_t btw) {
         }
         if (free > 0) {
             btw_chunk = (free < btw-bw ? free : btw-bw);
-            CharFifo_Write(target,buf+bw,btw_chunk);
+            fifoWrite(c->shm_context,target,buf+bw,btw_chunk);
             bw += btw_chunk;
+            sharedMemoryRing(c, bell);
+        } else if (c->flags & REDIS_BLOCK) {
+            /* Spinning gives the best latency, since the server will likely
+             * free some space soon. SHARED_MEMORY_OPT_ADAPTIVE_WAIT stops
+             * hogging the CPU when it does not. */
+            REDIS_STATS_ADD(c, shm_write_spins, 1);
+            sharedMemoryWait(c, &ws, bell, sharedMemoryHasSpace, target, 1);
         }
-        /* This hogs up CPU when no free space and REDIS_BLOCK is on, but 
-         * latency is best if done this way, and the server will likely
-         * free some space soon. */ 
     } while (bw < btw && (c->flags & REDIS_BLOCK));
     
-    if (bw != 0 || btw == 0) {
-        /* Return written bytes even if conn_broken, as write() would due to SIGPIPE. */
+    if (bw != 0 || !conn_broken) {
+        /* Return written bytes even if conn_broken, as write() would due to SIGPIPE.
+         * A non-blocking context tries again later when the ring is full. */
+        if (c->stats != NULL) {
+            c->stats->stats.bytes_written += bw;
+            c->stats->stats.write_would_block += bw == 0;
+        }
         return bw;
+    } else if (ws.timed_out) {
+        __redisSetError(c,REDIS_ERR_TIMEOUT,"send timeout");
+        return -1;
     } else {
-        if (conn_broken) {
-            errno = EPIPE;
-        } else {
-            errno = EAGAIN;
-        }
+        __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
         return -1;
     }
 }
 
 ssize_t sharedMemoryRead(redisContext *c, char *buf, size_t btr) {
-    size_t iteration = 0;
-    size_t br;
+    sharedMemoryWaitState ws = {0, 0, 0, 0, 0, 0, 0, 0};
+    size_t br = 0;
     int conn_broken = 0;
-    sharedMemoryBuffer *source = &c->shm_context->mem->to_client;
-    size_t used;
+    volatile void *source = c->shm_context->to_client;
+    sharedMemoryDoorbell *bell = c->shm_context->control ? &c->shm_context->control->to_client : NULL;
+    charfifo_span_t spans[2];
+    size_t used, held;
+    /* Zero-copy replies are parsed out of the ring by sharedMemoryGetReply,
+     * so only wait for them here, unless the reader buffered a partial one. */
+    int in_place = (c->shm_context->flags & SHARED_MEMORY_OPT_ZERO_COPY_READ) &&
+                   c->reader->pos == c->reader->len;
+    sharedMemoryRelease(c);
+    /* What is left unconsumed is held by leased replies. */
+    held = c->shm_context->unconsumed;
+    if (held >= c->shm_context->to_client_size - 1) {
+        __redisSetError(c,REDIS_ERR_OTHER,
+                        "Shared memory ring is full of leased replies");
+        return -1;
+    }
+    if (c->shm_context->doorbell_fd != -1 && !sharedMemoryIsPolled(c->shm_context)) {
+        sharedMemoryDrainDoorbell(c);
+    }
     do {
-        conn_broken = isConnectionBroken(c, iteration++);
+        conn_broken = isConnectionBroken(c, &ws);
         if (conn_broken) {
             break;
         }
-        used = CharFifo_UsedSpace(source);
-        if (used > 0) {
+        used = fifoUsedSpace(c->shm_context, source, held + 1) - held;
+        if (used > 0 && in_place) {
+            return 0;
+        } else if (used > 0 && held > 0) {
+            /* Read past the leases, they are consumed together. */
+            br = (used < btr ? used : btr);
+            fifoPeekSpans(c->shm_context,source,held,spans);
+            if (br <= spans[0].len) {
+                memcpy(buf,spans[0].buf,br);
+            } else {
+                memcpy(buf,spans[0].buf,spans[0].len);
+                memcpy(buf+spans[0].len,spans[1].buf,br-spans[0].len);
+            }
+            c->shm_context->unconsumed += br;
+        } else if (used > 0) {
             br = (used < btr ? used : btr);
-            CharFifo_Read(source,buf,br);
+            fifoRead(c->shm_context,source,buf,br);
+            c->shm_context->consumed += br;
+            sharedMemoryRing(c, bell);
+        } else if (c->flags & REDIS_BLOCK) {
+            /* Spinning gives the best latency, since the server will likely
+             * send a reply soon. SHARED_MEMORY_OPT_ADAPTIVE_WAIT stops
+             * hogging the CPU when it does not. */
+            REDIS_STATS_ADD(c, shm_read_spins, 1);
+            sharedMemoryWait(c, &ws, bell, sharedMemoryHasData, source, held + 1);
         }
-        /* This hogs up CPU when no free space and REDIS_BLOCK is on, but 
-         * latency is best if done this way, and the server will likely
-         * send a reply soon. */ 
     } while (br == 0 && (c->flags & REDIS_BLOCK));
-    if (br != 0) {
-        return br;
+    
+    if (br == 0 && !conn_broken) {
+        /* Non-blocking and nothing to read. Event loops also wake us up 
+         * when the socket closes, so check it now. */
+        conn_broken = sharedMemoryPeerClosed(c->shm_context) || sharedMemorySocketClosed(c);
+    }
+    if (conn_broken && br == 0 && ws.timed_out) {
+        __redisSetError(c,REDIS_ERR_TIMEOUT,"recv timeout");
+        return -1;
+    }
+    if (conn_broken && br == 0) {
+        __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
+        return -1;
+    }
+    if (c->stats != NULL) {
+        c->stats->stats.bytes_read += br;
+        c->stats->stats.read_would_block += br == 0;
+    }
+    if (c->shm_context->doorbell_fd != -1 && !(c->flags & REDIS_BLOCK) && !in_place) {
+        sharedMemoryArmDoorbell(c);
+    }
+    return br;
+}
+
+int sharedMemoryAppend(redisContext *c, const char *buf, size_t len) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    charfifo_span_t spans[2];
+    
+    if (fifoReserveSpans(ctx,ctx->to_server,ctx->uncommitted,len,spans) < len) {
+        return 0;
+    }
+    if (len <= spans[0].len) {
+        memcpy(spans[0].buf,buf,len);
     } else {
-        if (conn_broken) {
-            return 0;
-        } else {
-            errno = EAGAIN;
-            return -1;
-        }
+        memcpy(spans[0].buf,buf,spans[0].len);
+        memcpy(spans[1].buf,buf+spans[0].len,len-spans[0].len);
+    }
+    sharedMemoryCommit(c,len);
+    return 1;
+}
+
+char *sharedMemoryReserve(redisContext *c, size_t len) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    charfifo_span_t spans[2];
+    
+    fifoReserveSpans(ctx,ctx->to_server,ctx->uncommitted,len,spans);
+    if (spans[0].len < len) {
+        return NULL;
+    }
+    return spans[0].buf;
+}
+
+void sharedMemoryCommit(redisContext *c, size_t len) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    
+    ctx->uncommitted += len;
+    if (ctx->uncommitted >= ctx->to_server_size / SHARED_MEMORY_BATCH_DIVISOR) {
+        sharedMemoryFlush(c);
+    }
+}
+
+int sharedMemoryGetReply(redisContext *c, void **reply) {
+    redisSharedMemoryContext *ctx = c->shm_context;
+    charfifo_span_t spans[2];
+    size_t consumed;
+    void *aux = NULL;
+    int status;
+    
+    if (!(c->shm_context->flags & SHARED_MEMORY_OPT_ZERO_COPY_READ)) {
+        return redisReaderGetReply(c->reader,reply);
+    }
+    
+    /* A reply wrapping around the ring end is incomplete in the first span, 
+     * so the reader copies it and completes it from sharedMemoryRead. With
+     * SHARED_MEMORY_OPT_MIRROR, the first span holds all of it. */
+    fifoPeekSpans(ctx,ctx->to_client,ctx->unconsumed,spans);
+    ctx->parse_base = spans[0].buf;
+    ctx->parse_pos = ctx->consumed + ctx->unconsumed;
+    status = redisReaderGetReplyFromBuffer(c->reader,spans[0].buf,spans[0].len,&consumed,&aux);
+    ctx->unconsumed += consumed;
+    REDIS_STATS_ADD(c, bytes_read, consumed);
+    if (aux == NULL || 
+            ctx->unconsumed >= ctx->to_client_size / SHARED_MEMORY_BATCH_DIVISOR) {
+        sharedMemoryRelease(c);
+    }
+    if (status == REDIS_OK && aux == NULL && 
+            c->shm_context->doorbell_fd != -1 && !(c->flags & REDIS_BLOCK)) {
+        /* Out of replies, wait for the doorbell. */
+        sharedMemoryArmDoorbell(c);
+    }
+    
+    if (reply != NULL) {
+        *reply = aux;
+    } else if (aux != NULL && c->reader->fn && c->reader->fn->freeObject) {
+        c->reader->fn->freeObject(aux);
     }
+    return status;
 }
@@ -44,11 +44,127 @@ struct redisReply;
 /* The shared memory file is created with these permissions, by default. */
 #define SHARED_MEMORY_DEFAULT_MODE 00700
 
+/* Default and maximum size of each of the two ring buffers. The default
+ * matches the 16k redisBufferRead uses as a temporary buffer. A ring must
+ * be larger than PIPE_BUF, so small writes stay atomic. */
+#define SHARED_MEMORY_DEFAULT_BUF_SIZE (1024*16)
+#define SHARED_MEMORY_MAX_BUF_SIZE ((size_t)1024*1024*1024)
+
+/* Blocking reads and writes wait adaptively instead of spinning until the
+ * server makes progress. See spin_ns and yield_ns below. The server needs
+ * to support waking up sleeping clients. */
+#define SHARED_MEMORY_OPT_ADAPTIVE_WAIT 0x01
+
+/* The server signals an eventfd when replies arrive, so event loops can wait
+ * for it. See redisGetSharedMemoryDoorbellFd. Needs a unix socket connection,
+ * and is set by redisAsyncUseSharedMemory on those. Linux only. */
+#define SHARED_MEMORY_OPT_DOORBELL 0x02
+
+/* Replies are parsed in place out of the to_client ring, skipping the copies
+ * into the read buffer. Only the client changes, any server supports it. */
+#define SHARED_MEMORY_OPT_ZERO_COPY_READ 0x04
+
+/* Lays the rings out as lockless-char-fifo/charfifo2.h, keeping the client's
+ * and the server's indexes on separate cache lines. The server needs to
+ * support it. */
+#define SHARED_MEMORY_OPT_RING_V2 0x08
+
+/* Maps the data of each ring twice back to back, so that anything in a ring
+ * is contiguous in memory. Commands are then always built in place, and with
+ * SHARED_MEMORY_OPT_ZERO_COPY_READ, replies always parsed in place. Ring 
+ * sizes are rounded up to whole pages, and the server needs to support the
+ * page aligned layout. */
+#define SHARED_MEMORY_OPT_MIRROR 0x10
+
+/* Backs the shared memory with an anonymous memfd, passed to the server over
+ * the unix socket, instead of a named file in /dev/shm. Nothing can leak on
+ * a crash, and connecting skips the file system. Needs a unix socket 
+ * connection, and the server needs to support it. Linux only. */
+#define SHARED_MEMORY_OPT_MEMFD 0x20
+
+/* Placement of the shared memory, applied by the client before the server 
+ * opens it. PREFAULT touches every page up front, so that no request takes
+ * the page faults. HUGEPAGES advises transparent huge pages, which pays off
+ * with rings of a few megabytes. LOCK mlock()s the pages, which needs a high
+ * enough RLIMIT_MEMLOCK. NUMA_BIND allocates the pages on numa_node, for 
+ * both sides. HUGEPAGES and NUMA_BIND are Linux only. */
+#define SHARED_MEMORY_OPT_PREFAULT 0x40
+#define SHARED_MEMORY_OPT_HUGEPAGES 0x80
+#define SHARED_MEMORY_OPT_LOCK 0x100
+#define SHARED_MEMORY_OPT_NUMA_BIND 0x200
+
+/* The server bumps a heartbeat counter in the shared memory every 
+ * heartbeat_ns, and sets a closed flag before dropping the client. A waiting
+ * call then notices a closed server with a memory load, and only checks the
+ * socket once the heartbeat has stalled for two periods. The server needs to
+ * support it. */
+#define SHARED_MEMORY_OPT_HEARTBEAT 0x400
+
+/* Adds a slab of slab_size bytes to the shared memory, where the server can
+ * place bulk strings too large for the to_client ring. The ring then only
+ * carries where the string is, and the reply borrows it from the slab until
+ * freeReplyObject. The server needs to support it. */
+#define SHARED_MEMORY_OPT_SLAB 0x800
+
+/* Bulk strings parsed in place out of the to_client ring are borrowed by the
+ * reply instead of copied, see redisReply.lease. The ring is not handed back
+ * to the server past such a string until freeReplyObject. Implies 
+ * SHARED_MEMORY_OPT_ZERO_COPY_READ, only the client changes. */
+#define SHARED_MEMORY_OPT_LEASED_READ 0x1000
+
+/* Event loop adapters poll the to_client ring on every iteration of the loop,
+ * from an idle hook, instead of waiting for the doorbell. Replies then reach
+ * their callbacks without a syscall on either side, but the loop never 
+ * sleeps. See redisAsyncPollSharedMemory. Only the client changes. */
+#define SHARED_MEMORY_OPT_LOOP_POLL 0x2000
+
+/* Default wait policy of SHARED_MEMORY_OPT_ADAPTIVE_WAIT. */
+#define SHARED_MEMORY_DEFAULT_SPIN_NS 50000LL
+#define SHARED_MEMORY_DEFAULT_YIELD_NS 1000000LL
+
+/* Default size of the SHARED_MEMORY_OPT_SLAB slab. Its pages only take memory
+ * once the server writes to them. */
+#define SHARED_MEMORY_DEFAULT_SLAB_SIZE ((size_t)64*1024*1024)
+
+/* Default period of SHARED_MEMORY_OPT_HEARTBEAT. */
+#define SHARED_MEMORY_DEFAULT_HEARTBEAT_NS 100000000LL
+
+/* Options for redisUseSharedMemoryWithOptions. Fields left zero select
+ * the defaults. */
+typedef struct redisSharedMemoryOptions {
+    /* Bit field of SHARED_MEMORY_OPT_xxx. */
+    int flags;
+    /* Permissions of the shared memory file. */
+    mode_t mode;
+    /* Ring buffer sizes in bytes, for commands sent to the server and for
+     * replies sent to the client. Non-default sizes are sent to the server
+     * in SHM.OPEN, so the server needs to support them. */
+    size_t to_server_size;
+    size_t to_client_size;
+    /* With SHARED_MEMORY_OPT_ADAPTIVE_WAIT, a blocking call waiting for the
+     * server busy-spins for spin_ns, then backs off with pause and
+     * sched_yield() until yield_ns more have passed, then sleeps until the
+     * server wakes it up. */
+    long long spin_ns;
+    long long yield_ns;
+    /* With SHARED_MEMORY_OPT_HEARTBEAT, the period the server beats at, sent
+     * in whole milliseconds. */
+    long long heartbeat_ns;
+    /* With SHARED_MEMORY_OPT_SLAB, the size of the slab, at most
+     * SHARED_MEMORY_MAX_BUF_SIZE. */
+    size_t slab_size;
+    /* With SHARED_MEMORY_OPT_NUMA_BIND, the node holding the pages. */
+    int numa_node;
+} redisSharedMemoryOptions;
+
 /* Initializes the shared memory communication. In a non-blocking context,
  * this only partially initializes, and needs to be completed by a call
- * to sharedMemoryInitAfterReply. This call is implicit in a blocking context. */
-struct redisReply *sharedMemoryInit(struct redisContext *c, mode_t mode);
-void sharedMemoryInitAfterReply(struct redisContext *c, struct redisReply *reply);
+ * to sharedMemoryInitAfterReply. This call is implicit in a blocking context. 
+ * SHM.OPEN is sent in version 2 first. When the server rejects it, 
+ * sharedMemoryInitAfterReply queues it again in version 1 and returns 1. 
+ * The reply is then dropped, the next one stands for it. */
+struct redisReply *sharedMemoryInit(struct redisContext *c, const redisSharedMemoryOptions *options);
+int sharedMemoryInitAfterReply(struct redisContext *c, struct redisReply *reply);
 
 /* Formats the command sent by sharedMemoryInit. Only works after a successful
  * call to sharedMemoryInit! */
@@ -57,11 +173,66 @@ int sharedMemoryFormatShmOpen(struct redisContext *c, char **cmd);
 /* Returns true if the shared memory communication is completely initialized. */
 int sharedMemoryIsInitialized(struct redisContext *c);
 
+/* Returns the doorbell eventfd once initialized, or -1. */
+int sharedMemoryDoorbellFd(struct redisContext *c);
+
+/* Returns true once initialized with SHARED_MEMORY_OPT_LOOP_POLL. */
+int sharedMemoryIsLoopPolled(struct redisContext *c);
+
+/* Whether replies wait in the to_client ring, or the server closed it, as a
+ * few memory loads. */
+int sharedMemoryHasReplies(struct redisContext *c);
+
+/* While descriptors for the server are pending, the output buffer is written
+ * with sharedMemoryWriteWithFds instead of redisNetWrite, which it mirrors. */
+int sharedMemoryHasPendingFds(struct redisContext *c);
+ssize_t sharedMemoryWriteWithFds(struct redisContext *c);
+
 void sharedMemoryFree(struct redisContext *c);
 
-/* These act as write()/read(), with the same rules and returns and errno. */
+/* These act as redisNetWrite()/redisNetRead(), with the same rules and 
+ * returns: 0 when a non-blocking call would block, -1 with the context
+ * error set on failure. With SHARED_MEMORY_OPT_ZERO_COPY_READ, a read may
+ * also return 0 after waiting, leaving the data for sharedMemoryGetReply. */
 ssize_t sharedMemoryWrite(struct redisContext *c, char *buf, size_t btw);
 ssize_t sharedMemoryRead(struct redisContext *c, char *buf, size_t btr);
 
+/* Commands appended while c->obuf is empty skip it and go straight into the 
+ * to_server ring. sharedMemoryAppend copies a formatted command, returning 0
+ * when it does not fit. sharedMemoryReserve returns contiguous space for len
+ * bytes, or NULL, to build the command in, and sharedMemoryCommit adds it to
+ * the batch. sharedMemoryFlush makes the batch visible to the server, and is
+ * called before writing c->obuf. */
+int sharedMemoryAppend(struct redisContext *c, const char *buf, size_t len);
+char *sharedMemoryReserve(struct redisContext *c, size_t len);
+void sharedMemoryCommit(struct redisContext *c, size_t len);
+void sharedMemoryFlush(struct redisContext *c);
+
+/* Replaces redisReaderGetReply for initialized shared memory contexts. */
+int sharedMemoryGetReply(struct redisContext *c, void **reply);
+
+/* Hooks for redisSharedMemoryPoller, see poller.c. Attaching fails without a
+ * doorbell, unless the poller is direct. A detached event loop gets a doorbell
+ * signal, so it arms the server's doorbell again. */
+struct redisSharedMemoryPoller;
+int sharedMemoryPollerAttach(struct redisContext *c, struct redisSharedMemoryPoller *poller, int direct);
+void sharedMemoryPollerDetach(struct redisContext *c);
+struct redisSharedMemoryPoller *sharedMemoryPoller(struct redisContext *c);
+int sharedMemoryPollerIsDirect(struct redisContext *c);
+
+/* Signals the doorbell in place of the server, once replies arrived after the
+ * event loop armed it. Returns 1 when it did. Called by the poller thread. */
+int sharedMemoryPollerNotify(struct redisContext *c);
+
+/* Whether a direct poller has commands to flush. */
+int sharedMemoryPollerHasCommands(struct redisContext *c);
+
+/* Defined in poller.c, drops a context being freed from its poller. */
+void sharedMemoryPollerForget(struct redisSharedMemoryPoller *poller, struct redisContext *c);
+
+/* Defined in poller.c, drops the reference an attached context holds, taken
+ * by redisSharedMemoryPollerAdd. The poller is freed with the last one. */
+void sharedMemoryPollerRelease(struct redisSharedMemoryPoller *poller);
+
 
 #endif /* __SHM_H */
@@ -0,0 +1,185 @@
+/* Opt-in per context counters and round trip latencies for hiredis.
+ *
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2014, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <string.h>
+#include <time.h>
+
+#include "alloc.h"
+#include "hiredis.h"
+#include "stats_private.h"
+
+#define SUB_BUCKETS (1 << REDIS_STATS_SUB_BUCKET_BITS)
+
+static long long statsNowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static int statsHighestBit(unsigned long long v) {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(v);
+#else
+    int bit = 0;
+    while (v >>= 1)
+        bit++;
+    return bit;
+#endif
+}
+
+/* Bucket of a latency, see REDIS_STATS_SUB_BUCKET_BITS. */
+static size_t statsBucket(long long ns) {
+    unsigned long long v = ns > 0 ? (unsigned long long)ns : 0;
+    int bit;
+
+    if (v < SUB_BUCKETS)
+        return v;
+    bit = statsHighestBit(v);
+    if (bit >= REDIS_STATS_MAX_BITS)
+        return REDIS_STATS_BUCKETS - 1;
+    return ((size_t)(bit - REDIS_STATS_SUB_BUCKET_BITS + 1) << REDIS_STATS_SUB_BUCKET_BITS) +
+           ((v >> (bit - REDIS_STATS_SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* Highest latency a bucket holds. */
+static long long statsBucketEnd(size_t bucket) {
+    size_t range = bucket >> REDIS_STATS_SUB_BUCKET_BITS;
+    int shift;
+
+    if (range == 0)
+        return (long long)bucket;
+    shift = (int)range - 1;
+    return (long long)(((unsigned long long)(SUB_BUCKETS + (bucket & (SUB_BUCKETS - 1))) << shift) +
+                       ((1ULL << shift) - 1));
+}
+
+long long redisStatsPercentile(const redisStats *stats, double percentage) {
+    unsigned long long rank, seen = 0;
+    size_t i;
+
+    if (stats->round_trips == 0)
+        return 0;
+    if (percentage <= 0)
+        return stats->latency_min;
+    if (percentage >= 100)
+        return stats->latency_max;
+
+    /* Nearest rank, the smallest latency with at least that many below. */
+    rank = (unsigned long long)(percentage / 100 * stats->round_trips);
+    if ((double)rank < percentage / 100 * stats->round_trips)
+        rank++;
+    for (i = 0; i < REDIS_STATS_BUCKETS; i++) {
+        seen += stats->latency[i];
+        if (seen >= rank) {
+            long long end = statsBucketEnd(i);
+            return end < stats->latency_max ? end : stats->latency_max;
+        }
+    }
+    return stats->latency_max;
+}
+
+redisStatsContext *redisStatsCreate(void) {
+    return hi_calloc(1, sizeof(redisStatsContext));
+}
+
+void redisStatsFree(redisStatsContext *stats) {
+    if (stats == NULL)
+        return;
+    hi_free(stats->sent);
+    hi_free(stats);
+}
+
+/* Commands in flight stay timestamped, their replies count after a reset. */
+void redisStatsReset(redisContext *c) {
+    memset(&c->stats->stats, 0, sizeof(c->stats->stats));
+    c->stats->compactions_base = c->reader->compactions;
+}
+
+void redisStatsSnapshot(redisContext *c, redisStats *stats) {
+    *stats = c->stats->stats;
+    stats->reader_compactions += c->reader->compactions - c->stats->compactions_base;
+}
+
+/* Before redisReconnect replaces the reader and drops the replies to the
+ * commands in flight. */
+void redisStatsReconnect(redisContext *c) {
+    c->stats->stats.reader_compactions += c->reader->compactions - c->stats->compactions_base;
+    c->stats->compactions_base = 0;
+    c->stats->sent_len = 0;
+}
+
+void redisStatsCommandSent(redisContext *c) {
+    redisStatsContext *s = c->stats;
+    long long *sent;
+    size_t cap, i;
+
+    if (s->sent_len == s->sent_cap) {
+        /* Unwrap into a larger ring. Without memory the command just goes
+         * untimed, and the oldest reply is matched to a newer command. */
+        cap = s->sent_cap ? s->sent_cap * 2 : 16;
+        sent = hi_malloc(cap * sizeof(*sent));
+        if (sent == NULL)
+            return;
+        for (i = 0; i < s->sent_len; i++)
+            sent[i] = s->sent[(s->sent_head + i) % s->sent_cap];
+        hi_free(s->sent);
+        s->sent = sent;
+        s->sent_cap = cap;
+        s->sent_head = 0;
+    }
+    s->sent[(s->sent_head + s->sent_len) % s->sent_cap] = statsNowNs();
+    s->sent_len++;
+}
+
+void redisStatsCommandDropped(redisContext *c) {
+    if (c->stats->sent_len > 0)
+        c->stats->sent_len--;
+}
+
+void redisStatsReplyReceived(redisContext *c) {
+    redisStatsContext *s = c->stats;
+    long long latency;
+
+    if (s->sent_len == 0)
+        return;
+    latency = statsNowNs() - s->sent[s->sent_head];
+    s->sent_head = (s->sent_head + 1) % s->sent_cap;
+    s->sent_len--;
+
+    if (s->stats.round_trips == 0 || latency < s->stats.latency_min)
+        s->stats.latency_min = latency;
+    if (latency > s->stats.latency_max)
+        s->stats.latency_max = latency;
+    s->stats.round_trips++;
+    s->stats.latency[statsBucket(latency)]++;
+}
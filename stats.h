@@ -0,0 +1,79 @@
+/* Opt-in per context counters and round trip latencies for hiredis.
+ *
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2014, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_STATS_H
+#define __HIREDIS_STATS_H
+
+/* The latency histogram is log-linear, as in HdrHistogram: latencies below
+ * 2^REDIS_STATS_SUB_BUCKET_BITS ns have a bucket each, and every power of two
+ * above is split into 2^REDIS_STATS_SUB_BUCKET_BITS buckets, so a bucket is
+ * within about 3% of any latency it holds. Latencies from 2^REDIS_STATS_MAX_BITS
+ * ns (about 18 minutes) on share the last bucket. */
+#define REDIS_STATS_SUB_BUCKET_BITS 5
+#define REDIS_STATS_MAX_BITS 40
+#define REDIS_STATS_BUCKETS \
+    ((REDIS_STATS_MAX_BITS - REDIS_STATS_SUB_BUCKET_BITS + 1) << REDIS_STATS_SUB_BUCKET_BITS)
+
+/* Snapshot of the counters of a context, see redisGetStats. Bytes and calls
+ * count both the socket and the shared memory rings, whichever carries the
+ * traffic. */
+typedef struct redisStats {
+    /* Bytes sent to and received from the server. */
+    unsigned long long bytes_written;
+    unsigned long long bytes_read;
+    /* Transport calls that moved nothing because they would have blocked:
+     * EAGAIN on the socket, or a full or empty ring in a non-blocking
+     * context. */
+    unsigned long long write_would_block;
+    unsigned long long read_would_block;
+    /* redisBufferWrite calls that left part of the output buffer behind. */
+    unsigned long long partial_writes;
+    /* Times the reader moved unparsed data to the front of its buffer. */
+    unsigned long long reader_compactions;
+    /* Rounds blocking calls spent waiting for space in the to_server ring or
+     * for data in the to_client ring, and sleeps on a doorbell among them. */
+    unsigned long long shm_write_spins;
+    unsigned long long shm_read_spins;
+    unsigned long long shm_parks;
+    /* Round trips, from appending a command to returning its reply, in ns. */
+    unsigned long long round_trips;
+    long long latency_min;
+    long long latency_max;
+    unsigned long long latency[REDIS_STATS_BUCKETS];
+} redisStats;
+
+/* The latency below which the given percentage (0 to 100) of the round trips
+ * in stats fall, in ns, rounded up to the end of its bucket. 0 without
+ * round trips. */
+long long redisStatsPercentile(const redisStats *stats, double percentage);
+
+#endif /* __HIREDIS_STATS_H */
@@ -0,0 +1,76 @@
+/* Private state behind the opt-in per context counters of hiredis.
+ *
+ * Copyright (c) 2009-2011, Salvatore Sanfilippo <antirez at gmail dot com>
+ * Copyright (c) 2010-2014, Pieter Noordhuis <pcnoordhuis at gmail dot com>
+ *
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __HIREDIS_STATS_PRIVATE_H
+#define __HIREDIS_STATS_PRIVATE_H
+
+#include <stddef.h>
+
+#include "stats.h"
+
+struct redisContext;
+
+/* Private state behind redisContext.stats. */
+typedef struct redisStatsContext {
+    redisStats stats;
+    /* When each command still waiting for a reply was appended, a ring of
+     * sent_cap, growing as needed. */
+    long long *sent;
+    size_t sent_head;
+    size_t sent_len;
+    size_t sent_cap;
+    /* redisReader.compactions when the counters were last reset, those of
+     * earlier readers are in stats.reader_compactions. */
+    unsigned long long compactions_base;
+} redisStatsContext;
+
+/* Cheap enough for hot paths, a single branch when stats are disabled. */
+#define REDIS_STATS_ADD(c, field, n) do { \
+    if ((c)->stats != NULL) (c)->stats->stats.field += (n); \
+} while (0)
+
+redisStatsContext *redisStatsCreate(void);
+void redisStatsFree(redisStatsContext *stats);
+void redisStatsReset(struct redisContext *c);
+void redisStatsSnapshot(struct redisContext *c, redisStats *stats);
+void redisStatsReconnect(struct redisContext *c);
+
+/* Timestamps an appended command, and times the reply answering the oldest
+ * one. Replies with no command left waiting, such as pub/sub messages, are
+ * not timed. */
+void redisStatsCommandSent(struct redisContext *c);
+void redisStatsReplyReceived(struct redisContext *c);
+
+/* Forgets the command timestamped last, when it is not sent after all. */
+void redisStatsCommandDropped(struct redisContext *c);
+
+#endif /* __HIREDIS_STATS_PRIVATE_H */
@@ -0,0 +1,25 @@
+#!/bin/sh -ue
+
+# Runs the shared memory tests against hiredis-shm-server, which needs no
+# Redis or module, so they can run anywhere.
+
+SHM_SERVER=${SHM_SERVER:-./hiredis-shm-server}
+
+tmpdir=$(mktemp -d)
+SOCK_FILE=${tmpdir}/hiredis-shm-server.sock
+SERVER_PID=
+
+cleanup() {
+  set +e
+  [ -n "${SERVER_PID}" ] && kill ${SERVER_PID}
+  rm -rf ${tmpdir}
+}
+trap cleanup INT TERM EXIT
+
+${SHM_SERVER} ${SOCK_FILE} &
+SERVER_PID=$!
+
+# Wait until we detect the unix socket
+while [ ! -S "${SOCK_FILE}" ]; do sleep 0.1; done
+
+${TEST_PREFIX:-} ./hiredis-test --skip-redis --shm ${SOCK_FILE}
@@ -21,6 +21,8 @@
 #ifdef HIREDIS_TEST_ASYNC
 #include "adapters/libevent.h"
 #include <event2/event.h>
+#include <pthread.h>
+#include <sched.h>
 #endif
 #include "net.h"
 #include "alloc.h"
@@ -46,6 +48,10 @@ struct config {
         const char *path;
     } unix_sock;
 
+    struct {
+        const char *path;
+    } shm;
+
     struct {
         const char *host;
         int port;
@@ -392,6 +398,60 @@ static void test_append_formatted_commands(struct config config) {
     disconnect(c, 0);
 }
 
+/* Stands in for a shared memory slab in the out-of-band string tests. */
+static char oob_slab[] = "....hello\0";
+static int oob_released;
+
+static void oobRelease(redisLease *lease) {
+    (void)lease;
+    oob_released++;
+}
+
+static redisLease oob_lease = {oobRelease};
+
+static int oobResolve(void *oobdata, size_t offset, size_t len, unsigned long long generation,
+                      char **str, redisLease **lease) {
+    (void)oobdata;
+    if (generation != 7 || offset + len >= sizeof(oob_slab))
+        return REDIS_ERR_PROTOCOL;
+    *str = oob_slab + offset;
+    *lease = &oob_lease;
+    return 0;
+}
+
+/* Lends strings out of the caller buffer in the lent string test. */
+static redisLease *lendString(void *lenddata, char *str, size_t len) {
+    (void)lenddata;
+    str[len] = '\0';
+    return &oob_lease;
+}
+
+/* Collects streamed strings in the streaming tests. */
+typedef struct streamSink {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int chunks;
+    int done;
+    int fail;
+} streamSink;
+
+static int streamCollect(void *streamdata, const redisReadTask *task, const char *chunk,
+                         size_t len, size_t left) {
+    streamSink *sink = streamdata;
+
+    (void)task;
+    if (sink->fail)
+        return REDIS_ERR;
+    if (sink->len + len > sink->cap)
+        return REDIS_ERR;
+    memcpy(sink->buf + sink->len, chunk, len);
+    sink->len += len;
+    sink->chunks++;
+    sink->done += left == 0;
+    return REDIS_OK;
+}
+
 static void test_reply_reader(void) {
     redisReader *reader;
     void *reply, *root;
@@ -580,6 +640,293 @@ static void test_reply_reader(void) {
     freeReplyObject(reply);
     redisReaderFree(reader);
 
+    test("Can parse integers of every width: ");
+    {
+        static const long long values[] = {
+            0, 7, -1, 42, -4096, 999999999999999999LL, -999999999999999999LL,
+            1000000000000000000LL, LLONG_MAX, LLONG_MIN
+        };
+        char buf[32];
+        size_t n;
+
+        reader = redisReaderCreate();
+        for (i = 0, ret = REDIS_OK; i < (int)(sizeof(values)/sizeof(values[0])); i++) {
+            n = (size_t)snprintf(buf,sizeof(buf),":%lld\r\n",values[i]);
+            redisReaderFeed(reader,buf,n);
+            if (redisReaderGetReply(reader,&reply) != REDIS_OK ||
+                ((redisReply*)reply)->type != REDIS_REPLY_INTEGER ||
+                ((redisReply*)reply)->integer != values[i])
+                ret = REDIS_ERR;
+            freeReplyObject(reply);
+        }
+        test_cond(ret == REDIS_OK);
+        redisReaderFree(reader);
+    }
+
+    test("Set error on malformed integers: ");
+    {
+        static const char *bad[] = {
+            ":\r\n", ":-\r\n", ":-0\r\n", ":01\r\n", ":1a\r\n", ":+1\r\n",
+            ":9223372036854775808\r\n", ":-9223372036854775809\r\n"
+        };
+
+        for (i = 0, ret = REDIS_OK; i < (int)(sizeof(bad)/sizeof(bad[0])); i++) {
+            reader = redisReaderCreate();
+            redisReaderFeed(reader,bad[i],strlen(bad[i]));
+            if (redisReaderGetReply(reader,&reply) != REDIS_ERR ||
+                strcasecmp(reader->errstr,"Bad integer value") != 0)
+                ret = REDIS_ERR;
+            redisReaderFree(reader);
+        }
+        test_cond(ret == REDIS_OK);
+    }
+
+    test("Can parse lengths split across feeds: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"*2\r\n$1",6);
+    ret = redisReaderGetReply(reader,&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    redisReaderFeed(reader,(char*)"2\r",2);
+    ret = redisReaderGetReply(reader,&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    redisReaderFeed(reader,(char*)"\nhello world!\r\n:1",17);
+    ret = redisReaderGetReply(reader,&reply);
+    assert(ret == REDIS_OK && reply == NULL);
+    redisReaderFeed(reader,(char*)"23\r\n",4);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_OK &&
+        ((redisReply*)reply)->type == REDIS_REPLY_ARRAY &&
+        ((redisReply*)reply)->elements == 2 &&
+        ((redisReply*)reply)->element[0]->len == 12 &&
+        !memcmp(((redisReply*)reply)->element[0]->str,"hello world!",12) &&
+        ((redisReply*)reply)->element[1]->integer == 123);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Arena reader builds nested replies of every type: ");
+    {
+        static const char head[] =
+            "*5\r\n+OK\r\n%2\r\n:42\r\n,3.5\r\n#t\r\n_\r\n"
+            "=10\r\ntxt:LOLWUT\r\n*300\r\n";
+        redisReply *r, *e;
+        char *big = hi_malloc(100000);
+        int ok;
+
+        assert(big != NULL);
+        memset(big, 'x', 100000);
+        reader = redisReaderCreateArena();
+        redisReaderFeed(reader,head,sizeof(head)-1);
+        for (i = 0; i < 300; i++)
+            redisReaderFeed(reader,"$5\r\nhello\r\n",11);
+        redisReaderFeed(reader,"$100000\r\n",9);
+        redisReaderFeed(reader,big,100000);
+        redisReaderFeed(reader,"\r\n",2);
+        ret = redisReaderGetReply(reader,&reply);
+        r = reply;
+        ok = ret == REDIS_OK && r->type == REDIS_REPLY_ARRAY && r->elements == 5 &&
+             r->arena != NULL;
+        if (ok) {
+            e = r->element[1];
+            ok = r->element[0]->type == REDIS_REPLY_STATUS && !strcmp(r->element[0]->str,"OK") &&
+                 e->type == REDIS_REPLY_MAP && e->elements == 4 &&
+                 e->element[0]->integer == 42 && e->element[1]->dval == 3.5 &&
+                 !strcmp(e->element[1]->str,"3.5") && e->element[2]->type == REDIS_REPLY_BOOL &&
+                 e->element[2]->integer == 1 && e->element[3]->type == REDIS_REPLY_NIL &&
+                 r->element[2]->type == REDIS_REPLY_VERB && !strcmp(r->element[2]->vtype,"txt") &&
+                 r->element[2]->len == 6 && !strcmp(r->element[2]->str,"LOLWUT") &&
+                 r->element[3]->elements == 300 &&
+                 r->element[4]->len == 100000 && !memcmp(r->element[4]->str,big,100000);
+            for (i = 0; ok && i < 300; i++) {
+                e = r->element[3]->element[i];
+                ok = e->arena == r->arena && e->len == 5 && !strcmp(e->str,"hello");
+            }
+        }
+        test_cond(ok);
+
+        test("Freeing an element of an arena reply does nothing: ");
+        if (ok)
+            freeReplyObject(r->element[3]);
+        test_cond(ok && r->element[3]->elements == 300 &&
+                  !strcmp(r->element[3]->element[299]->str,"hello"));
+        freeReplyObject(reply);
+
+        test("Arena replies borrow slices of the reader buffer: ");
+        reader->slices = 1;
+        redisReaderFeed(reader,(char*)"*2\r\n$5\r\nhello\r\n$5\r\nworld\r\n",26);
+        ret = redisReaderGetReply(reader,&reply);
+        r = reply;
+        test_cond(ret == REDIS_OK && r->arena != NULL &&
+                  r->element[0]->lease != NULL && r->element[0]->arena == r->arena &&
+                  r->element[1]->str > reader->buf && r->element[1]->str < reader->buf+reader->len &&
+                  !strcmp(r->element[0]->str,"hello") && !strcmp(r->element[1]->str,"world"));
+        freeReplyObject(reply);
+
+        test("Arena reader frees partial replies on errors: ");
+        redisReaderFeed(reader,"*3\r\n$3\r\nfoo\r\n*1\r\n@",18);
+        ret = redisReaderGetReply(reader,&reply);
+        test_cond(ret == REDIS_ERR && reply == NULL);
+        redisReaderFree(reader);
+        hi_free(big);
+    }
+
+    test("Bulk strings are slices of the reader buffer: ");
+    reader = redisReaderCreate();
+    reader->slices = 1;
+    redisReaderFeed(reader,(char*)"*2\r\n$5\r\nhello\r\n+OK\r\n",20);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_OK &&
+        ((redisReply*)reply)->element[0]->lease != NULL &&
+        ((redisReply*)reply)->element[0]->str > reader->buf &&
+        ((redisReply*)reply)->element[0]->str < reader->buf+reader->len &&
+        !strcmp(((redisReply*)reply)->element[0]->str,"hello") &&
+        ((redisReply*)reply)->element[1]->lease == NULL);
+    freeReplyObject(reply);
+
+    test("The reader buffer is compacted only once slices are done with: ");
+    {
+        unsigned long long compactions = reader->compactions;
+        char buf[32], want[16];
+        int ok;
+
+        for (i = 0; i < 100; i++) {
+            snprintf(buf,sizeof(buf),"$10\r\nvalue%05d\r\n",i);
+            redisReaderFeed(reader,buf,17);
+        }
+        for (i = 0, ok = 1; i < 100; i++) {
+            snprintf(want,sizeof(want),"value%05d",i);
+            ok &= redisReaderGetReply(reader,&reply) == REDIS_OK &&
+                  !strcmp(((redisReply*)reply)->str,want);
+            freeReplyObject(reply);
+        }
+        test_cond(ok && reader->compactions > compactions);
+    }
+
+    test("The reader buffer stays small with a slice in every reply: ");
+    {
+        size_t most = 0;
+
+        for (i = 0; i < 1000; i++) {
+            redisReaderFeed(reader,(char*)"$10\r\n0123456789\r\n",17);
+            ret = redisReaderGetReply(reader,&reply);
+            assert(ret == REDIS_OK && reply != NULL);
+            freeReplyObject(reply);
+            if (reader->len > most)
+                most = reader->len;
+        }
+        test_cond(most < 2048);
+    }
+
+    test("Slices of a reply in progress survive the buffer growing: ");
+    {
+        char *big = hi_malloc(100000);
+
+        assert(big != NULL);
+        memset(big,'x',100000);
+        redisReaderFeed(reader,(char*)"*3\r\n$5\r\nhello\r\n",15);
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_OK && reply == NULL);
+        redisReaderFeed(reader,(char*)"$100000\r\n",9);
+        redisReaderFeed(reader,big,100000);
+        redisReaderFeed(reader,(char*)"\r\n$5\r\nworld\r\n",13);
+        ret = redisReaderGetReply(reader,&reply);
+        test_cond(ret == REDIS_OK && reader->retired_len > 0 &&
+            !strcmp(((redisReply*)reply)->element[0]->str,"hello") &&
+            ((redisReply*)reply)->element[1]->len == 100000 &&
+            !memcmp(((redisReply*)reply)->element[1]->str,big,100000) &&
+            !strcmp(((redisReply*)reply)->element[2]->str,"world"));
+        freeReplyObject(reply);
+        hi_free(big);
+    }
+    redisReaderFree(reader);
+
+    test("Large bulk strings are streamed as they arrive: ");
+    {
+        streamSink sink = {0};
+        char *big = hi_malloc(20000);
+        size_t most = 0;
+        int ok = 1;
+
+        assert(big != NULL);
+        for (i = 0; i < 20000; i++)
+            big[i] = 'a' + i % 26;
+        sink.buf = hi_malloc(20000);
+        sink.cap = 20000;
+        assert(sink.buf != NULL);
+
+        reader = redisReaderCreate();
+        reader->stream = streamCollect;
+        reader->streamdata = &sink;
+        reader->stream_min = 1000;
+        redisReaderFeed(reader,(char*)"*3\r\n$3\r\nfoo\r\n$20000\r\n",21);
+        for (i = 0; i < 20000; i += 1000) {
+            redisReaderFeed(reader,big+i,1000);
+            ok &= redisReaderGetReply(reader,&reply) == REDIS_OK && reply == NULL;
+            if (reader->len > most)
+                most = reader->len;
+        }
+        redisReaderFeed(reader,(char*)"\r\n:5\r\n",6);
+        ret = redisReaderGetReply(reader,&reply);
+        test_cond(ok && ret == REDIS_OK && most < 4096 &&
+            sink.len == 20000 && !memcmp(sink.buf,big,20000) &&
+            sink.chunks == 20 && sink.done == 1 &&
+            ((redisReply*)reply)->element[0]->len == 3 &&
+            ((redisReply*)reply)->element[1]->type == REDIS_REPLY_STRING &&
+            ((redisReply*)reply)->element[1]->len == 0 &&
+            ((redisReply*)reply)->element[2]->integer == 5);
+        freeReplyObject(reply);
+
+        test("Streaming stops the reader when the hook fails: ");
+        sink.fail = 1;
+        redisReaderFeed(reader,(char*)"$2000\r\n",7);
+        redisReaderFeed(reader,big,2000);
+        ret = redisReaderGetReply(reader,&reply);
+        test_cond(ret == REDIS_ERR &&
+                  strcasecmp(reader->errstr,"Bulk string stream failed") == 0);
+        redisReaderFree(reader);
+        hi_free(sink.buf);
+        hi_free(big);
+    }
+
+    test("A deep pipeline of buffered replies is compacted a few times: ");
+    {
+        sds in = sdsempty();
+        int ok = 1;
+
+        for (i = 0; i < 20000; i++)
+            in = sdscatprintf(in,":%d\r\n",i);
+        reader = redisReaderCreate();
+        redisReaderFeed(reader,in,sdslen(in));
+        for (i = 0; i < 20000; i++) {
+            ok &= redisReaderGetReply(reader,&reply) == REDIS_OK &&
+                  ((redisReply*)reply)->integer == i;
+            freeReplyObject(reply);
+        }
+        test_cond(ok && reader->pos == reader->len && reader->compactions < 20);
+        redisReaderFree(reader);
+        sdsfree(in);
+    }
+
+    test("Input can be read straight into the reader buffer: ");
+    {
+        char *dst;
+
+        reader = redisReaderCreate();
+        dst = redisReaderReserve(reader,64);
+        memcpy(dst,"+OK\r\n:1",7);
+        redisReaderCommit(reader,7);
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_OK && reply != NULL);
+        freeReplyObject(reply);
+        dst = redisReaderReserve(reader,64);
+        memcpy(dst,"\r\n",2);
+        redisReaderCommit(reader,2);
+        ret = redisReaderGetReply(reader,&reply);
+        test_cond(ret == REDIS_OK && reply != NULL &&
+                  ((redisReply*)reply)->integer == 1);
+        freeReplyObject(reply);
+        redisReaderFree(reader);
+    }
+
     /* RESP3 verbatim strings (GitHub issue #802) */
     test("Can parse RESP3 verbatim strings: ");
     reader = redisReaderCreate();
@@ -746,6 +1093,119 @@ static void test_reply_reader(void) {
         !strcmp(((redisReply*)reply)->str,"3492890328409238509324850943850943825024385"));
     freeReplyObject(reply);
     redisReaderFree(reader);
+
+    test("Can parse replies in place from a caller buffer: ");
+    {
+        const char *buf = "$5\r\nhello\r\n:42\r\n";
+        size_t consumed, total = 0;
+        void *reply2;
+        reader = redisReaderCreate();
+        ret = redisReaderGetReplyFromBuffer(reader,buf,strlen(buf),&consumed,&reply);
+        total += consumed;
+        redisReaderGetReplyFromBuffer(reader,buf+total,strlen(buf)-total,&consumed,&reply2);
+        total += consumed;
+        test_cond(ret == REDIS_OK && total == strlen(buf) &&
+            ((redisReply*)reply)->type == REDIS_REPLY_STRING &&
+            !strcmp(((redisReply*)reply)->str,"hello") &&
+            ((redisReply*)reply2)->type == REDIS_REPLY_INTEGER &&
+            ((redisReply*)reply2)->integer == 42);
+        freeReplyObject(reply);
+        freeReplyObject(reply2);
+        redisReaderFree(reader);
+    }
+
+    test("Keeps the rest of a reply split across caller buffers: ");
+    {
+        const char *buf = "*2\r\n$3\r\nfoo\r\n$3\r\nb";
+        size_t consumed;
+        reader = redisReaderCreate();
+        ret = redisReaderGetReplyFromBuffer(reader,buf,strlen(buf),&consumed,&reply);
+        test_cond(ret == REDIS_OK && reply == NULL && consumed == strlen(buf));
+        test("Completes a split reply from the next caller buffer: ");
+        ret = redisReaderGetReplyFromBuffer(reader,"ar\r\n",5,&consumed,&reply);
+        test_cond(ret == REDIS_OK && consumed == 5 && reply != NULL &&
+            ((redisReply*)reply)->elements == 2 &&
+            !strcmp(((redisReply*)reply)->element[0]->str,"foo") &&
+            !strcmp(((redisReply*)reply)->element[1]->str,"bar"));
+        freeReplyObject(reply);
+        redisReaderFree(reader);
+    }
+
+    test("Error in a caller buffer leaves it intact: ");
+    {
+        char buf[] = "*2\r\n:1\r\n@foo\r\n";
+        size_t consumed;
+        reader = redisReaderCreate();
+        ret = redisReaderGetReplyFromBuffer(reader,buf,strlen(buf),&consumed,&reply);
+        test_cond(ret == REDIS_ERR && reply == NULL &&
+            strcasecmp(reader->errstr,"Protocol error, got \"@\" as reply type byte") == 0 &&
+            !strcmp(buf,"*2\r\n:1\r\n@foo\r\n"));
+        redisReaderFree(reader);
+    }
+
+    test("Out-of-band strings are a protocol error without a hook: ");
+    reader = redisReaderCreate();
+    redisReaderFeed(reader,(char*)"&4,5,7\r\n",8);
+    ret = redisReaderGetReply(reader,NULL);
+    test_cond(ret == REDIS_ERR &&
+              strcasecmp(reader->errstr,"Protocol error, got \"&\" as reply type byte") == 0);
+    redisReaderFree(reader);
+
+    test("Borrows out-of-band strings until the reply is freed: ");
+    reader = redisReaderCreate();
+    reader->oob = oobResolve;
+    oob_released = 0;
+    redisReaderFeed(reader,(char*)"*2\r\n&4,5,7\r\n$3\r\nfoo\r\n",21);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_OK &&
+        ((redisReply*)reply)->element[0]->type == REDIS_REPLY_STRING &&
+        ((redisReply*)reply)->element[0]->str == oob_slab + 4 &&
+        ((redisReply*)reply)->element[0]->len == 5 &&
+        ((redisReply*)reply)->element[0]->lease == &oob_lease &&
+        ((redisReply*)reply)->element[1]->lease == NULL &&
+        oob_released == 0);
+    freeReplyObject(reply);
+    test("Releases the lease of a freed out-of-band string: ");
+    test_cond(oob_released == 1);
+    redisReaderFree(reader);
+
+    test("Lends strings parsed in place out of a caller buffer: ");
+    reader = redisReaderCreate();
+    reader->lend = lendString;
+    oob_released = 0;
+    {
+        char buf[] = "*2\r\n$5\r\nhello\r\n:1\r\n";
+        size_t consumed;
+        ret = redisReaderGetReplyFromBuffer(reader,buf,sizeof(buf)-1,&consumed,&reply);
+        test_cond(ret == REDIS_OK && consumed == sizeof(buf)-1 &&
+            ((redisReply*)reply)->element[0]->str == buf+8 &&
+            ((redisReply*)reply)->element[0]->lease == &oob_lease &&
+            !strcmp(((redisReply*)reply)->element[0]->str,"hello"));
+        freeReplyObject(reply);
+    }
+    test("Copies strings fed to the reader instead of lending them: ");
+    redisReaderFeed(reader,(char*)"$5\r\nhello\r\n",11);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_OK && ((redisReply*)reply)->lease == NULL && oob_released == 1);
+    freeReplyObject(reply);
+    redisReaderFree(reader);
+
+    test("Rejects out-of-band strings the hook doesn't resolve: ");
+    reader = redisReaderCreate();
+    reader->oob = oobResolve;
+    redisReaderFeed(reader,(char*)"&4,5,8\r\n",8);
+    ret = redisReaderGetReply(reader,NULL);
+    test_cond(ret == REDIS_ERR &&
+              strcasecmp(reader->errstr,"Invalid out-of-band string") == 0);
+    redisReaderFree(reader);
+
+    test("Polling shared memory of a context without any finds nothing: ");
+    {
+        redisAsyncContext *ac = redisAsyncConnectUnix("/tmp/hiredis-no-such.sock");
+        assert(ac != NULL);
+        test_cond(redisAsyncPollSharedMemory(ac) == 0);
+        redisAsyncFree(ac);
+    }
 }
 
 static void test_free_null(void) {
@@ -1349,6 +1809,445 @@ static void test_throughput(struct config config) {
     disconnect(c, 0);
 }
 
+#ifndef _WIN32
+static redisContext *do_connect_shm(struct config config, const redisSharedMemoryOptions *options) {
+    redisContext *c = redisConnectUnix(config.shm.path);
+    redisReply *reply;
+
+    if (c == NULL || c->err) {
+        printf("Connection error: %s\n", c ? c->errstr : "can't allocate redis context");
+        exit(1);
+    }
+    reply = redisUseSharedMemoryWithOptions(c, options);
+    if (reply == NULL || !redisIsSharedMemoryInitialized(c)) {
+        printf("Shared memory error: %s\n", reply ? reply->str : c->errstr);
+        exit(1);
+    }
+    freeReplyObject(reply);
+
+    reply = redisCommand(c, "FLUSHALL");
+    assert(reply != NULL);
+    freeReplyObject(reply);
+    return c;
+}
+
+/* Runs a few commands of each reply type through the rings, with a pipeline
+ * and a value that need more than one ring's worth of traffic. */
+static int shm_round_trip(redisContext *c) {
+    redisReply *reply;
+    size_t big = SHARED_MEMORY_DEFAULT_BUF_SIZE * 6 + 7, i;
+    char *value = hi_malloc_safe(big);
+    int ok = 1;
+
+    reply = redisCommand(c, "PING");
+    ok &= reply != NULL && reply->type == REDIS_REPLY_STATUS && strcmp(reply->str, "PONG") == 0;
+    freeReplyObject(reply);
+
+    reply = redisCommand(c, "SET foo %s", "bar");
+    freeReplyObject(reply);
+    reply = redisCommand(c, "GET foo");
+    ok &= reply != NULL && reply->type == REDIS_REPLY_STRING && strcmp(reply->str, "bar") == 0;
+    freeReplyObject(reply);
+
+    for (i = 0; i < 3; i++)
+        freeReplyObject(redisCommand(c, "RPUSH mylist %d", (int)i));
+    reply = redisCommand(c, "LRANGE mylist 0 -1");
+    ok &= reply != NULL && reply->type == REDIS_REPLY_ARRAY && reply->elements == 3 &&
+          strcmp(reply->element[2]->str, "2") == 0;
+    freeReplyObject(reply);
+
+    for (i = 0; i < 1000; i++)
+        redisAppendCommand(c, "INCR counter");
+    for (i = 0; i < 1000; i++) {
+        ok &= redisGetReply(c, (void**)&reply) == REDIS_OK && reply != NULL &&
+              reply->type == REDIS_REPLY_INTEGER && reply->integer == (long long)i + 1;
+        freeReplyObject(reply);
+    }
+
+    for (i = 0; i < big; i++)
+        value[i] = 'a' + i % 26;
+    reply = redisCommand(c, "SET big %b", value, big);
+    freeReplyObject(reply);
+    reply = redisCommand(c, "GET big");
+    ok &= reply != NULL && reply->type == REDIS_REPLY_STRING && reply->len == big &&
+          memcmp(reply->str, value, big) == 0;
+    freeReplyObject(reply);
+
+    hi_free(value);
+    return ok;
+}
+
+/* Counts INCR replies, run by the poller thread under its lock. */
+static void shm_poller_incr_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    redisReply *reply = r;
+    int *replies = privdata;
+    (void)ac;
+    if (reply != NULL && reply->type == REDIS_REPLY_INTEGER && reply->integer == *replies + 1)
+        (*replies)++;
+}
+
+/* A direct poller drives several contexts at once, with no event loop. */
+static int shm_poller_round_trips(struct config config) {
+    redisSharedMemoryPollerOptions options = {0};
+    redisSharedMemoryPoller *poller;
+    redisAsyncContext *ac[4];
+    int replies[4] = {0}, done = 0, ok = 1, i, j, polls;
+
+    options.flags = SHARED_MEMORY_POLLER_DIRECT;
+    poller = redisSharedMemoryPollerCreate(&options);
+    assert(poller != NULL);
+    redisSharedMemoryPollerLock(poller);
+    for (i = 0; i < 4; i++) {
+        ac[i] = redisAsyncConnectUnix(config.shm.path);
+        assert(ac[i] != NULL && ac[i]->err == 0);
+        ok &= redisAsyncUseSharedMemory(ac[i], NULL, NULL) == REDIS_OK;
+        ok &= redisSharedMemoryPollerAdd(poller, ac[i]) == REDIS_OK;
+        redisAsyncCommand(ac[i], NULL, NULL, "DEL poller:%d", i);
+        for (j = 0; j < 100; j++)
+            redisAsyncCommand(ac[i], shm_poller_incr_cb, &replies[i], "INCR poller:%d", i);
+    }
+    redisSharedMemoryPollerUnlock(poller);
+
+    for (polls = 0; !done && polls < 5000; polls++) {
+        usleep(1000);
+        redisSharedMemoryPollerLock(poller);
+        for (i = 0, done = 1; i < 4; i++)
+            done &= replies[i] == 100;
+        redisSharedMemoryPollerUnlock(poller);
+    }
+
+    redisSharedMemoryPollerLock(poller);
+    for (i = 0; i < 4; i++)
+        redisAsyncFree(ac[i]);
+    redisSharedMemoryPollerUnlock(poller);
+    redisSharedMemoryPollerFree(poller);
+    return ok && done;
+}
+
+#ifdef HIREDIS_TEST_ASYNC
+/* Chains PINGs until 100 came back, then disconnects. */
+static void shm_loop_poll_ping_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    int *replies = privdata;
+    (void)r;
+    if (++*replies < 100)
+        redisAsyncCommand(ac, shm_loop_poll_ping_cb, replies, "PING");
+    else
+        redisAsyncDisconnect(ac);
+}
+
+/* The libevent adapter polls the ring instead of waiting for the doorbell. */
+static int shm_loop_poll_round_trips(struct config config) {
+    redisSharedMemoryOptions options = {0};
+    struct event_base *loop = event_base_new();
+    redisAsyncContext *ac;
+    int replies = 0;
+
+    options.flags = SHARED_MEMORY_OPT_LOOP_POLL;
+    ac = redisAsyncConnectUnix(config.shm.path);
+    assert(ac != NULL && ac->err == 0);
+    redisLibeventAttach(ac, loop);
+    redisAsyncUseSharedMemoryWithOptions(ac, shm_loop_poll_ping_cb, &replies, &options);
+    event_base_dispatch(loop);
+    event_base_free(loop);
+    /* The SHM.OPEN reply counts as the first. */
+    return replies == 100;
+}
+
+typedef struct shmPollerRaceState {
+    redisSharedMemoryPoller *poller;
+    redisAsyncContext *ac;
+    struct event_base *loop;
+    pthread_t thread;
+    int started;
+    int replies;
+    int stop; /* Under the poller lock. */
+} shmPollerRaceState;
+
+/* Takes the context away from the poller and gives it back, over and over. */
+static void *shm_poller_race_main(void *privdata) {
+    shmPollerRaceState *state = privdata;
+
+    int stop = 0;
+
+    while (!stop) {
+        redisSharedMemoryPollerRemove(state->poller, state->ac);
+        sched_yield();
+        redisSharedMemoryPollerLock(state->poller);
+        redisSharedMemoryPollerAdd(state->poller, state->ac);
+        stop = state->stop;
+        redisSharedMemoryPollerUnlock(state->poller);
+        sched_yield();
+    }
+    return NULL;
+}
+
+/* Chains PINGs, so the event loop keeps arming the doorbell. */
+static void shm_poller_race_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    shmPollerRaceState *state = privdata;
+    (void)r;
+    if (!state->started) {
+        state->started = 1;
+        assert(pthread_create(&state->thread, NULL, shm_poller_race_main, state) == 0);
+    }
+    if (++state->replies < 5000)
+        redisAsyncCommand(ac, shm_poller_race_cb, state, "PING");
+    else
+        event_base_loopbreak(state->loop);
+}
+
+/* Removing the poller from another thread while the event loop arms the
+ * doorbell must not leave the loop waiting for a reply nobody signals. */
+static int shm_poller_race_round_trips(struct config config) {
+    redisSharedMemoryOptions options = {0};
+    shmPollerRaceState state = {0};
+    struct timeval timeout = {30, 0};
+
+    options.flags = SHARED_MEMORY_OPT_DOORBELL;
+    state.poller = redisSharedMemoryPollerCreate(NULL);
+    assert(state.poller != NULL);
+    state.loop = event_base_new();
+    state.ac = redisAsyncConnectUnix(config.shm.path);
+    assert(state.ac != NULL && state.ac->err == 0);
+    redisLibeventAttach(state.ac, state.loop);
+    redisAsyncUseSharedMemoryWithOptions(state.ac, shm_poller_race_cb, &state, &options);
+    /* Gives up instead of hanging when a wakeup is lost. */
+    event_base_loopexit(state.loop, &timeout);
+    event_base_dispatch(state.loop);
+
+    if (state.started) {
+        redisSharedMemoryPollerLock(state.poller);
+        state.stop = 1;
+        redisSharedMemoryPollerUnlock(state.poller);
+        pthread_join(state.thread, NULL);
+    }
+    redisSharedMemoryPollerRemove(state.poller, state.ac);
+    redisAsyncFree(state.ac);
+    redisSharedMemoryPollerFree(state.poller);
+    event_base_free(state.loop);
+    return state.replies == 5000;
+}
+
+static void *shm_poller_free_main(void *privdata) {
+    redisSharedMemoryPollerFree(privdata);
+    return NULL;
+}
+
+/* Frees the poller on another thread while the context leaves it. */
+static void shm_poller_free_cb(redisAsyncContext *ac, void *r, void *privdata) {
+    pthread_t *thread = privdata;
+    redisSharedMemoryPoller *poller = redisSharedMemoryPollerCreate(NULL);
+    (void)r;
+
+    assert(poller != NULL);
+    redisSharedMemoryPollerLock(poller);
+    assert(redisSharedMemoryPollerAdd(poller, ac) == REDIS_OK);
+    redisSharedMemoryPollerUnlock(poller);
+    assert(pthread_create(thread, NULL, shm_poller_free_main, poller) == 0);
+    redisAsyncDisconnect(ac);
+}
+
+/* A poller may be freed while an event loop frees a context it serves. */
+static int shm_poller_free_round_trips(struct config config) {
+    redisSharedMemoryOptions options = {0};
+    struct event_base *loop;
+    redisAsyncContext *ac;
+    pthread_t thread;
+    int i;
+
+    options.flags = SHARED_MEMORY_OPT_DOORBELL;
+    for (i = 0; i < 50; i++) {
+        loop = event_base_new();
+        ac = redisAsyncConnectUnix(config.shm.path);
+        assert(ac != NULL && ac->err == 0);
+        redisLibeventAttach(ac, loop);
+        redisAsyncUseSharedMemoryWithOptions(ac, shm_poller_free_cb, &thread, &options);
+        event_base_dispatch(loop);
+        pthread_join(thread, NULL);
+        event_base_free(loop);
+    }
+    return 1;
+}
+#endif
+
+static void test_shared_memory(struct config config) {
+    static const struct {
+        const char *name;
+        int flags;
+    } variants[] = {
+        {"default options", 0},
+        {"RING_V2 and MIRROR", SHARED_MEMORY_OPT_RING_V2|SHARED_MEMORY_OPT_MIRROR},
+        {"ADAPTIVE_WAIT and HEARTBEAT", SHARED_MEMORY_OPT_ADAPTIVE_WAIT|SHARED_MEMORY_OPT_HEARTBEAT},
+        {"MEMFD and DOORBELL", SHARED_MEMORY_OPT_MEMFD|SHARED_MEMORY_OPT_DOORBELL},
+        {"ZERO_COPY_READ", SHARED_MEMORY_OPT_ZERO_COPY_READ},
+        {"LEASED_READ", SHARED_MEMORY_OPT_LEASED_READ|SHARED_MEMORY_OPT_RING_V2},
+        {"SLAB", SHARED_MEMORY_OPT_SLAB},
+    };
+    redisSharedMemoryOptions options;
+    redisContext *c;
+    redisReply *reply;
+    redisStats stats;
+    char *value;
+    size_t i;
+
+    for (i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+        memset(&options, 0, sizeof(options));
+        options.flags = variants[i].flags;
+        options.slab_size = 1024*1024;
+        printf("#%02d ", ++tests);
+        printf("Round trips through shared memory with %s: ", variants[i].name);
+        c = do_connect_shm(config, &options);
+        test_cond(shm_round_trip(c));
+        redisFree(c);
+    }
+
+    {
+        redisOptions copts = {0};
+
+        REDIS_OPTIONS_SET_UNIX(&copts, config.shm.path);
+        copts.options = REDIS_OPT_ARENA_REPLIES;
+        c = redisConnectWithOptions(&copts);
+        assert(c != NULL && !c->err);
+        memset(&options, 0, sizeof(options));
+        options.flags = SHARED_MEMORY_OPT_LEASED_READ|SHARED_MEMORY_OPT_RING_V2;
+        freeReplyObject(redisUseSharedMemoryWithOptions(c, &options));
+        assert(redisIsSharedMemoryInitialized(c));
+        freeReplyObject(redisCommand(c, "FLUSHALL"));
+        test("Round trips through shared memory with arena replies: ");
+        reply = redisCommand(c, "PING");
+        test_cond(reply != NULL && reply->arena != NULL && shm_round_trip(c));
+        freeReplyObject(reply);
+        redisFree(c);
+    }
+
+    {
+        redisOptions copts = {0};
+
+        REDIS_OPTIONS_SET_UNIX(&copts, config.shm.path);
+        copts.options = REDIS_OPT_STRING_SLICES;
+        c = redisConnectWithOptions(&copts);
+        assert(c != NULL && !c->err);
+        memset(&options, 0, sizeof(options));
+        freeReplyObject(redisUseSharedMemoryWithOptions(c, &options));
+        assert(redisIsSharedMemoryInitialized(c));
+        freeReplyObject(redisCommand(c, "FLUSHALL"));
+        test("Round trips through shared memory with string slices: ");
+        freeReplyObject(redisCommand(c, "SET foo bar"));
+        reply = redisCommand(c, "GET foo");
+        i = reply != NULL && reply->lease != NULL && !strcmp(reply->str, "bar");
+        freeReplyObject(reply);
+        test_cond(i && shm_round_trip(c));
+        redisFree(c);
+    }
+
+    {
+        size_t big = SHARED_MEMORY_DEFAULT_BUF_SIZE * 6 + 7, j;
+        streamSink sink = {0};
+        char *value = hi_malloc_safe(big);
+
+        for (j = 0; j < big; j++)
+            value[j] = 'a' + j % 26;
+        sink.buf = hi_malloc_safe(big);
+        sink.cap = big;
+        memset(&options, 0, sizeof(options));
+        c = do_connect_shm(config, &options);
+        freeReplyObject(redisCommand(c, "SET big %b", value, big));
+        c->reader->stream = streamCollect;
+        c->reader->streamdata = &sink;
+        c->reader->stream_min = 1024;
+        test("Large strings stream out of shared memory: ");
+        reply = redisCommand(c, "GET big");
+        test_cond(reply != NULL && reply->type == REDIS_REPLY_STRING && reply->len == 0 &&
+                  sink.len == big && sink.done == 1 && sink.chunks > 1 &&
+                  memcmp(sink.buf, value, big) == 0);
+        freeReplyObject(reply);
+        redisFree(c);
+        hi_free(sink.buf);
+        hi_free(value);
+    }
+
+    /* Values past a quarter of the ring take the slab, and 1000 bytes is well
+     * past the point where the ring lends instead of copying. */
+    value = hi_malloc_safe(SHARED_MEMORY_DEFAULT_BUF_SIZE);
+    memset(value, 'x', SHARED_MEMORY_DEFAULT_BUF_SIZE);
+
+    memset(&options, 0, sizeof(options));
+    options.flags = SHARED_MEMORY_OPT_LEASED_READ;
+    c = do_connect_shm(config, &options);
+    freeReplyObject(redisCommand(c, "SET foo %b", value, (size_t)1000));
+    test("Leased reads lend strings out of the to_client ring: ");
+    reply = redisCommand(c, "GET foo");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STRING && reply->len == 1000 &&
+              reply->lease != NULL && reply->str[reply->len] == '\0');
+    test("Strings lent by the ring outlive their context: ");
+    redisFree(c);
+    test_cond(memcmp(reply->str, value, 1000) == 0);
+    freeReplyObject(reply);
+
+    memset(&options, 0, sizeof(options));
+    options.flags = SHARED_MEMORY_OPT_SLAB;
+    options.slab_size = 1024*1024;
+    c = do_connect_shm(config, &options);
+    freeReplyObject(redisCommand(c, "SET big %b", value, (size_t)SHARED_MEMORY_DEFAULT_BUF_SIZE));
+    test("Large strings are borrowed from the slab: ");
+    reply = redisCommand(c, "GET big");
+    test_cond(reply != NULL && reply->type == REDIS_REPLY_STRING &&
+              reply->len == SHARED_MEMORY_DEFAULT_BUF_SIZE && reply->lease != NULL &&
+              memcmp(reply->str, value, reply->len) == 0);
+    freeReplyObject(reply);
+    redisFree(c);
+
+    memset(&options, 0, sizeof(options));
+    c = do_connect_shm(config, &options);
+    test("Stats time round trips and count bytes through the rings: ");
+    assert(redisEnableStats(c) == REDIS_OK);
+    for (i = 0; i < 100; i++)
+        freeReplyObject(redisCommand(c, "PING"));
+    redisGetStats(c, &stats);
+    /* *1\r\n$4\r\nPING\r\n out and +PONG\r\n back. */
+    test_cond(stats.round_trips == 100 && stats.bytes_written == 1400 && stats.bytes_read == 700 &&
+              stats.latency_min > 0 && stats.latency_min <= redisStatsPercentile(&stats, 50) &&
+              redisStatsPercentile(&stats, 50) <= redisStatsPercentile(&stats, 99.9) &&
+              redisStatsPercentile(&stats, 99.9) <= stats.latency_max);
+    test("Stats start over after a reset: ");
+    redisResetStats(c);
+    freeReplyObject(redisCommand(c, "PING"));
+    redisGetStats(c, &stats);
+    test_cond(stats.round_trips == 1 && stats.bytes_read == 7 &&
+              redisStatsPercentile(&stats, 50) == stats.latency_max);
+    redisFree(c);
+
+    for (i = 0; i < 2; i++) {
+        struct timeval tv = {0, 100000};
+        long long t1;
+        memset(&options, 0, sizeof(options));
+        options.flags = i ? SHARED_MEMORY_OPT_ADAPTIVE_WAIT : 0;
+        c = do_connect_shm(config, &options);
+        test(i ? "Sleeping shared memory waits time out: " : "Spinning shared memory waits time out: ");
+        redisSetTimeout(c, tv);
+        t1 = usec();
+        reply = redisCommand(c, "DEBUG SLEEP 0.5");
+        test_cond(reply == NULL && c->err == REDIS_ERR_TIMEOUT && usec() - t1 < 400000);
+        redisFree(c);
+    }
+
+    test("A direct poller thread serves several contexts: ");
+    test_cond(shm_poller_round_trips(config));
+
+#ifdef HIREDIS_TEST_ASYNC
+    test("Event loops poll the rings with LOOP_POLL: ");
+    test_cond(shm_loop_poll_round_trips(config));
+
+    test("Pollers can be removed while the event loop arms the doorbell: ");
+    test_cond(shm_poller_race_round_trips(config));
+
+    test("Pollers can be freed while their contexts are: ");
+    test_cond(shm_poller_free_round_trips(config));
+#endif
+
+    hi_free(value);
+}
+#endif
+
 // static long __test_callback_flags = 0;
 // static void __test_callback(redisContext *c, void *privdata) {
 //     ((void)c);
@@ -1882,6 +2781,19 @@ static void test_monitor(struct config config) {
 }
 #endif /* HIREDIS_TEST_ASYNC */
 
+static int report_results(int skips_as_fails) {
+    if (fails || (skips_as_fails && skips)) {
+        printf("*** %d TESTS FAILED ***\n", fails);
+        if (skips) {
+            printf("*** %d TESTS SKIPPED ***\n", skips);
+        }
+        return 1;
+    }
+
+    printf("ALL TESTS PASSED (%d skipped)\n", skips);
+    return 0;
+}
+
 int main(int argc, char **argv) {
     struct config cfg = {
         .tcp = {
@@ -1895,6 +2807,7 @@ int main(int argc, char **argv) {
     int throughput = 1;
     int test_inherit_fd = 1;
     int skips_as_fails = 0;
+    int test_redis = 1;
     int test_unix_socket;
 
     /* Parse command line options. */
@@ -1915,6 +2828,11 @@ int main(int argc, char **argv) {
             test_inherit_fd = 0;
         } else if (argc >= 1 && !strcmp(argv[0],"--skips-as-fails")) {
             skips_as_fails = 1;
+        } else if (argc >= 2 && !strcmp(argv[0],"--shm")) {
+            argv++; argc--;
+            cfg.shm.path = argv[0];
+        } else if (argc >= 1 && !strcmp(argv[0],"--skip-redis")) {
+            test_redis = 0;
 #ifdef HIREDIS_TEST_SSL
         } else if (argc >= 2 && !strcmp(argv[0],"--ssl-port")) {
             argv++; argc--;
@@ -1957,6 +2875,16 @@ int main(int argc, char **argv) {
     test_blocking_connection_errors();
     test_free_null();
 
+#ifndef _WIN32
+    if (cfg.shm.path) {
+        printf("\nTesting shared memory against hiredis-shm-server (%s):\n", cfg.shm.path);
+        test_shared_memory(cfg);
+    }
+#endif
+
+    if (!test_redis)
+        return report_results(skips_as_fails);
+
     printf("\nTesting against TCP connection (%s:%d):\n", cfg.tcp.host, cfg.tcp.port);
     cfg.type = CONN_TCP;
     test_blocking_connection(cfg);
@@ -2029,14 +2957,5 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (fails || (skips_as_fails && skips)) {
-        printf("*** %d TESTS FAILED ***\n", fails);
-        if (skips) {
-            printf("*** %d TESTS SKIPPED ***\n", skips);
-        }
-        return 1;
-    }
-
-    printf("ALL TESTS PASSED (%d skipped)\n", skips);
-    return 0;
+    return report_results(skips_as_fails);
 }